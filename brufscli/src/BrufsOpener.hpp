@@ -31,9 +31,10 @@ namespace Brufscli {
 
 class BrufsInstance {
 private:
-    std::shared_ptr<Brufs::Brufs> fs;
-    std::shared_ptr<Brufs::Disk> disk;
+    // Destroyed bottom to top: the filesystem writes its last changes through the disk
     std::shared_ptr<Brufs::AbstIO> io;
+    std::shared_ptr<Brufs::Disk> disk;
+    std::shared_ptr<Brufs::Brufs> fs;
 
 public:
     BrufsInstance(
@@ -41,7 +42,7 @@ public:
         std::shared_ptr<Brufs::Disk> disk,
         std::shared_ptr<Brufs::AbstIO> io
     ) :
-        fs(fs), disk(disk), io(io)
+        io(io), disk(disk), fs(fs)
     {}
 
 
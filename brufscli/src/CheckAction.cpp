@@ -76,6 +76,7 @@ int Brufscli::CheckAction::run([[maybe_unused]] const std::string &name) {
     this->logger.info("Free space tree at: 0x%lX, %s (%d%%)",
         fs.get_header().fbt_address, in_fbt_str.c_str(), in_fbt_pct
     );
+    this->logger.info("%u allocation groups", fs.get_num_groups());
 
     Brufs::SSize root_count = fs.count_roots();
     this->logger.info("%lld roots", root_count);
@@ -92,6 +93,11 @@ int Brufscli::CheckAction::run([[maybe_unused]] const std::string &name) {
         this->logger.info("  ait at 0x%lX", root.get_header().ait_address);
     }
 
+    const auto &cache = fs.get_cache();
+    this->logger.info("Block cache: %lu hits, %lu misses (%u blocks)",
+        cache.get_hits(), cache.get_misses(), cache.get_capacity()
+    );
+
     this->logger.info("OK\n");
 
     return 0;
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "CompactAction.hpp"
+#include "Util.hpp"
+
+std::vector<std::string> Brufscli::CompactAction::get_names() const {
+    return {"compact"};
+}
+
+void Brufscli::CompactAction::apply_option(
+    int sw,
+    [[maybe_unused]] int snam, [[maybe_unused]] const std::string &lnam,
+    const std::string &val
+) {
+    if (sw == SLOPT_DIRECT && this->spec.empty()) {
+        this->spec = val;
+        return;
+    }
+
+    if (sw == SLOPT_DIRECT) {
+        throw InvalidArgumentException(
+            "Unexpected value " + val + " (path is " + this->spec + ")"
+        );
+    }
+}
+
+int Brufscli::CompactAction::run([[maybe_unused]] const std::string &name) {
+    auto path = this->path_parser.parse({this->spec.c_str(), this->spec.length()});
+    this->path_validator.validate(path, true, false);
+
+    auto brufs = this->opener.open_existing(path.get_partition());
+    auto &fs = brufs.get_fs();
+    const auto &io = brufs.get_io();
+
+    Brufs::Size reserved, available, extents_before, extents_after, in_fbt;
+    auto status = fs.count_free_blocks(reserved, available, extents_before, in_fbt);
+    this->on_error(status, "Unable to query global space usage: ", io);
+
+    Brufs::Size merged;
+    status = fs.compact_free_space(merged);
+    this->on_error(status, "Unable to compact the free space: ", io);
+
+    status = fs.count_free_blocks(reserved, available, extents_after, in_fbt);
+    this->on_error(status, "Unable to query global space usage: ", io);
+
+    auto avail_str = Util::pretty_print_bytes(available);
+
+    this->logger.info("Merged %lu extents", merged);
+    this->logger.info("Available: %s (%lu) in %lu extents, was %lu",
+        avail_str.c_str(), available, extents_after, extents_before
+    );
+
+    return 0;
+}
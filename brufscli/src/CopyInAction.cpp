@@ -134,7 +134,7 @@ int Brufscli::CopyInAction::run([[maybe_unused]] const std::string &name) {
 
         Brufs::Size num_transferred = 0;
         while (num_transferred < num_read) {
-            auto num_written = file.write(
+            auto num_written = file.write_sequential(
                 buf.data() + num_transferred, num_read - num_transferred, offset + num_transferred
             );
 
@@ -143,6 +143,9 @@ int Brufscli::CopyInAction::run([[maybe_unused]] const std::string &name) {
                     num_read - num_transferred, io.strstatus(num_written)
                 );
 
+                // Whatever was written stays, but not the space reserved after it
+                (void) file.trim();
+
                 return 1;
             }
 
@@ -152,6 +155,9 @@ int Brufscli::CopyInAction::run([[maybe_unused]] const std::string &name) {
         offset += num_transferred;
     }
 
+    status = file.trim();
+    this->on_error(status, "Unable to release the space reserved for the file: ", io);
+
     this->logger.debug("Copied %llu bytes", offset);
 
     return 0;
@@ -99,7 +99,7 @@ int Brufscli::CopyOutAction::run([[maybe_unused]] const std::string &name) {
 
     while (offset < size) {
         auto to_read = std::min(this->transfer_buffer_size, static_cast<size_t>(size - offset));
-        auto num_read = file.read(buf.data(), to_read, offset);
+        auto num_read = file.read_full(buf.data(), to_read, offset);
         this->on_error(static_cast<Brufs::Status>(num_read),
             "Unable to read " + std::to_string(to_read) + " bytes: ", io
         );
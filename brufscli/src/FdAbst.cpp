@@ -23,6 +23,7 @@
 #include <cstdio>
 #include <cassert>
 #include <cerrno>
+#include <fcntl.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -51,6 +52,28 @@ Brufs::SSize FdAbst::write(const void *buf, Brufs::Size count, Brufs::Address of
     return status;
 }
 
+Brufs::SSize FdAbst::discard(Brufs::Size count, Brufs::Address offset) {
+    struct stat st;
+    if (fstat(this->file, &st) == -1) return Brufs::Status::E_ABSTIO_BASE + errno;
+
+    int status;
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t range[2] = {offset, count};
+        status = ioctl(this->file, BLKDISCARD, &range);
+    } else {
+        status = fallocate(this->file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, count);
+    }
+
+    if (status == -1) {
+        // Not every device or filesystem can discard
+        if (errno == EOPNOTSUPP || errno == ENOTTY) return Brufs::Status::E_UNSUPPORTED;
+
+        return Brufs::Status::E_ABSTIO_BASE + errno;
+    }
+
+    return count;
+}
+
 const char *FdAbst::strstatus(Brufs::SSize eno) const {
     if (eno < Brufs::E_ABSTIO_BASE || eno >= Brufs::Status::OK) {
         return Brufs::strerror(static_cast<Brufs::Status>(eno));
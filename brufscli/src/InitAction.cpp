@@ -32,7 +32,10 @@ std::vector<slopt_Option> Brufscli::InitAction::get_options() const {
     return {
         {'c', "cluster-size", SLOPT_REQUIRE_ARGUMENT},
         {'l', "sc-low-mark", SLOPT_REQUIRE_ARGUMENT},
-        {'h', "sc-high-mark", SLOPT_REQUIRE_ARGUMENT}
+        {'h', "sc-high-mark", SLOPT_REQUIRE_ARGUMENT},
+        {'g', "group-size", SLOPT_REQUIRE_ARGUMENT},
+        {'d', "discard", SLOPT_DISALLOW_ARGUMENT},
+        {'L', "lazy", SLOPT_DISALLOW_ARGUMENT}
     };
 }
 
@@ -86,6 +89,18 @@ void Brufscli::InitAction::apply_option(
 
         break;
     }
+
+    case 'g':
+        this->ag_size = std::stoul(val);
+        break;
+
+    case 'd':
+        this->discard = true;
+        break;
+
+    case 'L':
+        this->lazy = true;
+        break;
     }
 }
 
@@ -137,6 +152,9 @@ int Brufscli::InitAction::run([[maybe_unused]] const std::string &name) {
     proto.cluster_size_exp = this->cluster_size_exp;
     proto.sc_low_mark = this->sc_low_mark;
     proto.sc_high_mark = this->sc_high_mark;
+    proto.ag_size = this->ag_size;
+    proto.set_flag(Brufs::DISCARD_FREED, this->discard);
+    proto.set_flag(Brufs::LAZY_INIT, this->lazy);
 
     auto status = fs.init(proto);
     this->on_error(status, "Unable to initialize the filesystem: ", io);
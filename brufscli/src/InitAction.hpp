@@ -41,6 +41,11 @@ private:
     uint8_t sc_low_mark = 12;
     uint8_t sc_high_mark = 24;
 
+    Brufs::Size ag_size = 0;
+
+    bool discard = false;
+    bool lazy = false;
+
     void validate_cluster_size();
     void validate_spare_marks();
 
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "TrimAction.hpp"
+#include "Util.hpp"
+
+std::vector<std::string> Brufscli::TrimAction::get_names() const {
+    return {"trim"};
+}
+
+std::vector<slopt_Option> Brufscli::TrimAction::get_options() const {
+    return {
+        {'o', "online", SLOPT_REQUIRE_ARGUMENT}
+    };
+}
+
+void Brufscli::TrimAction::apply_option(
+    int sw,
+    int snam, [[maybe_unused]] const std::string &lnam,
+    const std::string &val
+) {
+    if (sw == SLOPT_DIRECT && this->spec.empty()) {
+        this->spec = val;
+        return;
+    }
+
+    if (sw == SLOPT_DIRECT) {
+        throw InvalidArgumentException(
+            "Unexpected value " + val + " (path is " + this->spec + ")"
+        );
+    }
+
+    if (snam == 'o') {
+        if (val == "on") {
+            this->online = 1;
+        } else if (val == "off") {
+            this->online = 0;
+        } else {
+            throw InvalidArgumentException("Online discarding must be \"on\" or \"off\"");
+        }
+    }
+}
+
+int Brufscli::TrimAction::run([[maybe_unused]] const std::string &name) {
+    auto path = this->path_parser.parse({this->spec.c_str(), this->spec.length()});
+    this->path_validator.validate(path, true, false);
+
+    auto brufs = this->opener.open_existing(path.get_partition());
+    auto &fs = brufs.get_fs();
+    const auto &io = brufs.get_io();
+
+    if (this->online >= 0) {
+        auto status = fs.set_discarding(this->online);
+        this->on_error(status, "Unable to store the discard setting: ", io);
+    }
+
+    Brufs::Size discarded;
+    auto status = fs.discard_free_space(discarded);
+    if (status == Brufs::Status::E_UNSUPPORTED) {
+        this->logger.warn("The device doesn't support discarding");
+    } else {
+        this->on_error(status, "Unable to discard the free space: ", io);
+
+        auto discarded_str = Util::pretty_print_bytes(discarded);
+        this->logger.info("Discarded %s (%lu)", discarded_str.c_str(), discarded);
+    }
+
+    this->logger.info("Online discarding is %s", fs.is_discarding() ? "on" : "off");
+
+    return 0;
+}
@@ -31,12 +31,14 @@
 #include "InodeIdGenerator.hpp"
 #include "AddRootAction.hpp"
 #include "CheckAction.hpp"
+#include "CompactAction.hpp"
 #include "CopyInAction.hpp"
 #include "CopyOutAction.hpp"
 #include "InitAction.hpp"
 #include "LsAction.hpp"
 #include "MkdirAction.hpp"
 #include "TouchAction.hpp"
+#include "TrimAction.hpp"
 #include "VersionAction.hpp"
 
 using namespace Brufscli;
@@ -47,6 +49,8 @@ static void print_usage(const char *pname) {
         "Actions:\n"
         "init . . . : format a disk\n"
         "check  . . : print diagnostic information\n"
+        "compact  . : merge fragmented free space\n"
+        "trim . . . : discard the free space on the device\n"
         "help . . . : display help for an action\n",
         pname
     );
@@ -63,6 +67,7 @@ int main(int argc, char **argv) {
     std::vector<std::shared_ptr<Brufscli::Action>> actions = {
         std::make_shared<AddRootAction>(logger, brufs_opener, path_parser, path_validator),
         std::make_shared<CheckAction>(logger, brufs_opener, path_parser, path_validator),
+        std::make_shared<CompactAction>(logger, brufs_opener, path_parser, path_validator),
         std::make_shared<CopyInAction>(
             logger, brufs_opener, entity_creator, path_parser, path_validator
         ),
@@ -75,6 +80,7 @@ int main(int argc, char **argv) {
         std::make_shared<TouchAction>(
             logger, brufs_opener, entity_creator, path_parser, path_validator
         ),
+        std::make_shared<TrimAction>(logger, brufs_opener, path_parser, path_validator),
         std::make_shared<VersionAction>(logger)
     };
 
@@ -35,6 +35,7 @@ public:
 
     Brufs::SSize read(void *buf, Brufs::Size count, Brufs::Address offset) const override;
     Brufs::SSize write(const void *buf, Brufs::Size count, Brufs::Address offset) override;
+    Brufs::SSize discard(Brufs::Size count, Brufs::Address offset) override;
     const char *strstatus(Brufs::SSize eno) const override;
     Brufs::Size get_size() const override;
 };
@@ -39,8 +39,6 @@
 Brufuse::FdAbst *Brufuse::fs_io;
 Brufs::Brufs *Brufuse::fs;
 
-uv_rwlock_t Brufuse::fs_rwlock;
-
 namespace Brufuse {
 
 class BrufsException : public std::runtime_error {
@@ -62,6 +60,4 @@ void Brufuse::open_fs(const std::string &dev_path) {
             "Unable to open " + dev_path + ": " + fs_io->strstatus(fs->get_status())
         );
     }
-
-    uv_rwlock_init(&fs_rwlock);
 }
@@ -21,6 +21,7 @@
  */
 
 #include <cerrno>
+#include <fcntl.h>
 
 #include <random>
 
@@ -44,9 +45,23 @@ static constexpr double DEFAULT_ATTR_TIMEOUT = 1;
 
 fuse_lowlevel_ops Brufuse::fs_ops;
 
+Brufuse::MountedRoot::MountedRoot() : root(nullptr), session(nullptr), thread(nullptr) {
+    uv_rwlock_init(&this->namespace_lock);
+    for (auto &lock : this->inode_locks) uv_rwlock_init(&lock);
+    uv_mutex_init(&this->open_inodes_lock);
+}
+
+Brufuse::MountedRoot::~MountedRoot() {
+    uv_rwlock_destroy(&this->namespace_lock);
+    for (auto &lock : this->inode_locks) uv_rwlock_destroy(&lock);
+    uv_mutex_destroy(&this->open_inodes_lock);
+}
+
 Brufs::Status Brufuse::MountedRoot::open_inode(
     const Brufs::InodeId &id, Brufs::Inode &ino, bool store
 ) {
+    OpenInodesLock lock(this);
+
     auto found_inode = this->open_inodes.find(id);
     if (found_inode != this->open_inodes.end()) {
         ino = *found_inode->second.inode;
@@ -64,7 +79,7 @@ Brufs::Status Brufuse::MountedRoot::open_inode(
 
     auto store_anyway = (rand() / static_cast<double>(RAND_MAX)) < 0.8;
     if (store || store_anyway) {
-        OpenedInode oino {nino, store ? 1UL : 0UL};
+        OpenedInode oino {nino, store ? 1UL : 0UL, nullptr};
         this->open_inodes[id] = oino;
     }
 
@@ -87,7 +102,25 @@ Brufs::Status Brufuse::MountedRoot::open_typed_inode(
 Brufs::Status Brufuse::MountedRoot::open_file(
     const Brufs::InodeId &id, Brufs::File &ino, bool store
 ) {
-    return this->open_typed_inode(id, ino, Brufs::InodeType::FILE, store);
+    auto status = this->open_typed_inode(id, ino, Brufs::InodeType::FILE, store);
+    if (status < Brufs::Status::OK) return status;
+
+    ino.set_extent_map(this->get_extent_map(id));
+
+    return Brufs::Status::OK;
+}
+
+Brufs::ExtentMap *Brufuse::MountedRoot::get_extent_map(const Brufs::InodeId &id) {
+    OpenInodesLock lock(this);
+
+    // Files that aren't kept open look their extents up on the disk
+    auto found_inode = this->open_inodes.find(id);
+    if (found_inode == this->open_inodes.end()) return nullptr;
+
+    auto &opened_inode = found_inode->second;
+    if (!opened_inode.extent_map) opened_inode.extent_map = new Brufs::ExtentMap;
+
+    return opened_inode.extent_map;
 }
 
 Brufs::Status Brufuse::MountedRoot::open_directory(
@@ -109,6 +142,8 @@ Brufs::Status Brufuse::MountedRoot::get_directory(const Brufs::InodeId &id, Bruf
 }
 
 void Brufuse::MountedRoot::update_inode(const Brufs::Inode &other) {
+    OpenInodesLock lock(this);
+
     auto found_inode = this->open_inodes.find(other.get_id());
     if (found_inode == this->open_inodes.end()) return;
 
@@ -190,7 +225,7 @@ static bool is_correct_perms(int mask, unsigned int mode) {
 }
 
 static void on_access(fuse_req_t req, fuse_ino_t ino, int mask) {
-    Brufuse::ReadLock lock;
+    Brufuse::ReadLock lock(get_root_handle(req), ino_to_inode_id(ino));
     const auto context = fuse_req_ctx(req);
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
@@ -216,8 +251,8 @@ static void on_access(fuse_req_t req, fuse_ino_t ino, int mask) {
 }
 
 static void on_destroy(void *userdata) {
-    Brufuse::WriteLock lock;
     auto root_handle = static_cast<Brufuse::MountedRoot *>(userdata);
+    Brufuse::NamespaceLock lock(root_handle);
 
     for (const auto &it : root_handle->open_inodes) {
         auto status = it.second.inode->destroy();
@@ -233,7 +268,7 @@ static void on_destroy(void *userdata) {
 static void on_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     (void) fi; // Use ino instead
 
-    Brufuse::WriteLock lock;
+    Brufuse::WriteLock lock(get_root_handle(req), ino_to_inode_id(ino));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -254,7 +289,7 @@ static void on_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 }
 
 static void on_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
-    Brufuse::WriteLock lock;
+    Brufuse::NamespaceLock lock(get_root_handle(req));
     auto root_handle = get_root_handle(req);
 
     auto inode_id = ino_to_inode_id(ino);
@@ -284,6 +319,7 @@ static void on_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
 
     if (deleted || (rand() / static_cast<double>(RAND_MAX)) < 0.2) {
         delete opened_inode.inode;
+        delete opened_inode.extent_map;
         root_handle->open_inodes.erase(inode_id);
     }
 
@@ -326,7 +362,7 @@ static void inode_header_to_stat(
 }
 
 static int get_attr(fuse_req_t req, Brufs::InodeId inode_id, struct stat &attr) {
-    Brufuse::ReadLock lock;
+    Brufuse::ReadLock lock(get_root_handle(req), inode_id);
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -355,7 +391,7 @@ static void on_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi
 }
 
 static void on_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
-    Brufuse::ReadLock lock;
+    Brufuse::ReadLock lock(get_root_handle(req), ino_to_inode_id(parent));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -390,7 +426,7 @@ static void on_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
 }
 
 static void on_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
-    Brufuse::WriteLock lock;
+    Brufuse::NamespaceLock lock(get_root_handle(req));
     const auto context = fuse_req_ctx(req);
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
@@ -473,7 +509,7 @@ reply_status:
 static void on_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
     (void) rdev; // Not supported by Brufs
 
-    Brufuse::WriteLock lock;
+    Brufuse::NamespaceLock lock(get_root_handle(req));
     const auto context = fuse_req_ctx(req);
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
@@ -542,7 +578,7 @@ reply_status:
 }
 
 static void on_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-    Brufuse::ReadLock lock;
+    Brufuse::ReadLock lock(get_root_handle(req), ino_to_inode_id(ino));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
     auto inode_id = ino_to_inode_id(ino);
@@ -561,7 +597,7 @@ static void on_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 }
 
 static void on_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-    Brufuse::ReadLock lock;
+    Brufuse::ReadLock lock(get_root_handle(req), ino_to_inode_id(ino));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
     auto inode_id = ino_to_inode_id(ino);
@@ -584,7 +620,7 @@ static void on_read(
 ) {
     (void) fi; // Unused; uses ino instead
 
-    Brufuse::ReadLock lock;
+    Brufuse::ReadLock lock(get_root_handle(req), ino_to_inode_id(ino));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -604,19 +640,14 @@ static void on_read(
     auto true_size = std::min(uoff + size, file.get_header()->file_size) - uoff;
     auto buf = new char[true_size];
 
-    size_t total = 0;
-    while (total < true_size) {
-        auto num_read = file.read(buf + total, true_size - total, uoff + total);
-        if (num_read < Brufs::Status::OK) {
-            delete[] buf;
-            fuse_reply_err(req, status_to_errno(static_cast<Brufs::Status>(num_read)));
-            return;
-        }
-
-        total += num_read;
+    auto num_read = file.read_full(buf, true_size, uoff);
+    if (num_read < Brufs::Status::OK) {
+        delete[] buf;
+        fuse_reply_err(req, status_to_errno(static_cast<Brufs::Status>(num_read)));
+        return;
     }
 
-    fuse_reply_buf(req, buf, total);
+    fuse_reply_buf(req, buf, num_read);
     delete[] buf;
 }
 
@@ -625,7 +656,7 @@ static void on_readdir(
 ) {
     (void) fi; // Unused; uses ino instead
 
-    Brufuse::ReadLock lock;
+    Brufuse::ReadLock lock(get_root_handle(req), ino_to_inode_id(ino));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -636,8 +667,12 @@ static void on_readdir(
         return;
     }
 
+    // Only fetch as many entries as could possibly fit in the buffer
+    const size_t min_entry_size = fuse_add_direntry(req, nullptr, 0, "", nullptr, 0);
+    const size_t max_entries = size / min_entry_size + 1;
+
     Brufs::Vector<Brufs::DirectoryEntry> entries;
-    status = dir.collect(entries);
+    status = dir.collect(entries, static_cast<Brufs::Size>(off), max_entries);
     if (status < Brufs::Status::OK) {
         fuse_reply_err(req, status_to_errno(status));
         return;
@@ -647,7 +682,7 @@ static void on_readdir(
     size_t total = 0;
     Brufs::Inode hdr(*root);
 
-    for (size_t i = static_cast<size_t>(off); i < entries.get_size(); ++i) {
+    for (size_t i = 0; i < entries.get_size(); ++i) {
         const auto &entry = entries[i];
         char label[Brufs::MAX_LABEL_LENGTH + 1];
         memcpy(label, entry.label, Brufs::MAX_LABEL_LENGTH);
@@ -666,7 +701,7 @@ static void on_readdir(
         struct stat attr;
         inode_header_to_stat(entry.inode_id, hdr.get_header(), attr);
         size_t entry_size = fuse_add_direntry(
-            req, buf + total, size - total, label, &attr, static_cast<off_t>(i + 1)
+            req, buf + total, size - total, label, &attr, off + static_cast<off_t>(i + 1)
         );
 
         if (entry_size > size - total) break;
@@ -680,9 +715,22 @@ static void on_readdir(
 }
 
 void on_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-    // Wait until the kernel forgets the inode
-    (void) ino;
-    (void) fi;
+    // Wait until the kernel forgets the inode to destroy it, but give back the space that
+    // appending writes reserved past its end
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        Brufuse::WriteLock lock(get_root_handle(req), ino_to_inode_id(ino));
+        auto root_handle = get_root_handle(req);
+
+        Brufs::File file(*root_handle->root);
+        auto status = root_handle->get_file(ino_to_inode_id(ino), file);
+        if (status >= Brufs::Status::OK) status = file.trim();
+        if (status < Brufs::Status::OK) {
+            fuse_reply_err(req, status_to_errno(status));
+            return;
+        }
+
+        root_handle->update_inode(file);
+    }
 
     fuse_reply_err(req, 0);
 }
@@ -701,7 +749,7 @@ void on_rename(
     fuse_ino_t new_parent_ino, const char *new_name,
     unsigned int flags
 ) {
-    Brufuse::WriteLock lock;
+    Brufuse::NamespaceLock lock(get_root_handle(req));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -771,7 +819,7 @@ reply_status:
 }
 
 static void on_rmdir(fuse_req_t req, fuse_ino_t parent_ino, const char *name) {
-    Brufuse::WriteLock lock;
+    Brufuse::NamespaceLock lock(get_root_handle(req));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -814,7 +862,7 @@ void on_setattr(
 ) {
     (void) fi; // Use ino_num instead
 
-    Brufuse::WriteLock lock;
+    Brufuse::WriteLock lock(get_root_handle(req), ino_to_inode_id(ino_num));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -839,6 +887,8 @@ void on_setattr(
 
     if (to_set & FUSE_SET_ATTR_SIZE && ino.get_inode_type() == Brufs::InodeType::FILE) {
         Brufs::File file = ino;
+        file.set_extent_map(root_handle->get_extent_map(ino_to_inode_id(ino_num)));
+
         auto status = file.truncate(attr->st_size);
         if (status < Brufs::Status::OK) {
             fuse_reply_err(req, status_to_errno(status));
@@ -873,7 +923,7 @@ void on_setattr(
 }
 
 void on_unlink(fuse_req_t req, fuse_ino_t parent_ino, const char *name) {
-    Brufuse::WriteLock lock;
+    Brufuse::NamespaceLock lock(get_root_handle(req));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -911,7 +961,7 @@ static void on_write(
 ) {
     (void) fi; // Use ino instead.
 
-    Brufuse::WriteLock lock;
+    Brufuse::WriteLock lock(get_root_handle(req), ino_to_inode_id(ino));
     auto root_handle = get_root_handle(req);
     auto root = root_handle->root;
 
@@ -927,7 +977,7 @@ static void on_write(
 
     size_t total = 0;
     while (total < size) {
-        auto sstatus = file.write(buf + total, size - total, uoff + total);
+        auto sstatus = file.write_sequential(buf + total, size - total, uoff + total);
         if (sstatus < 0) {
             status = static_cast<Brufs::Status>(sstatus);
             goto reply_status;
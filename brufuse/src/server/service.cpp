@@ -26,12 +26,18 @@
 
 #include "service.hpp"
 
+/**
+ * The interval between maintenance runs in milliseconds.
+ */
+static constexpr uint64_t MAINTENANCE_INTERVAL = 1000;
+
 static std::string socket_path;
 
 static uv_loop_t loop;
 static uv_pipe_t server_pipe;
 static uv_signal_t sigint_handler;
 static uv_signal_t sighup_handler;
+static uv_timer_t maintenance_timer;
 
 static void on_close_at_closing(uv_handle_t *handle) {
     (void) handle;
@@ -76,6 +82,18 @@ static void on_sighup(uv_signal_t *handle, int signum) {
     (void) signum;
 }
 
+static void on_maintenance(uv_timer_t *handle) {
+    (void) handle;
+
+    // Keeps reserve management off the path of the FUSE threads
+    auto status = Brufuse::fs->refill_spare_clusters();
+    if (status < Brufs::Status::OK) {
+        fprintf(stderr, "Unable to refill the spare clusters: %s\n",
+            Brufuse::fs_io->strstatus(status)
+        );
+    }
+}
+
 static void on_new_conn(uv_stream_t *server, int status) {
     if (status < 0) {
         fprintf(stderr, "Unable to accept request connection: %s\n", uv_strerror(status));
@@ -162,6 +180,21 @@ int Brufuse::launch_service(
         return 1;
     }
 
+    // Set up the maintenance timer
+    status = uv_timer_init(&loop, &maintenance_timer);
+    if (status < 0) {
+        fprintf(stderr, "Unable to initialize the maintenance timer: %s\n", uv_strerror(status));
+        return 1;
+    }
+
+    status = uv_timer_start(
+        &maintenance_timer, on_maintenance, MAINTENANCE_INTERVAL, MAINTENANCE_INTERVAL
+    );
+    if (status < 0) {
+        fprintf(stderr, "Unable to start the maintenance timer: %s\n", uv_strerror(status));
+        return 1;
+    }
+
     status = uv_run(&loop, UV_RUN_DEFAULT);
     if (status < 0) {
         fprintf(stderr, "Error while listening for requests: %s\n", uv_strerror(status));
@@ -42,8 +42,18 @@ struct OpenedInode {
     Brufs::Inode *inode;
 
     uint64_t open_count;
+
+    /**
+     * The extents of a file, kept in memory while it's open; created on first use.
+     */
+    Brufs::ExtentMap *extent_map;
 };
 
+/**
+ * The number of locks inodes are spread over.
+ */
+static constexpr unsigned int NUM_INODE_LOCKS = 64;
+
 struct MountedRoot {
     std::string mount_point;
     std::string root_name;
@@ -52,6 +62,34 @@ struct MountedRoot {
     uv_thread_t *thread;
     std::map<Brufs::InodeId, OpenedInode> open_inodes;
 
+    /**
+     * Taken for reading by operations on a single inode and for writing by operations changing
+     * the directory structure, which touch several inodes at once.
+     */
+    uv_rwlock_t namespace_lock;
+
+    /**
+     * Guards the contents of single inodes; an inode uses the lock at its ID modulo the number
+     * of locks.
+     */
+    uv_rwlock_t inode_locks[NUM_INODE_LOCKS];
+
+    /**
+     * Guards #open_inodes.
+     */
+    uv_mutex_t open_inodes_lock;
+
+    MountedRoot();
+    ~MountedRoot();
+
+    MountedRoot(const MountedRoot &other) = delete;
+    MountedRoot &operator=(const MountedRoot &other) = delete;
+
+    uv_rwlock_t *get_inode_lock(const Brufs::InodeId &id) {
+        // The lower bits select the stream within an inode; all streams share a lock
+        return &this->inode_locks[(id >> 6) % NUM_INODE_LOCKS];
+    }
+
     Brufs::Status open_inode(const Brufs::InodeId &id, Brufs::Inode &ino, bool store = true);
     Brufs::Status get_inode(const Brufs::InodeId &id, Brufs::Inode &ino);
     Brufs::Status open_typed_inode(
@@ -61,6 +99,7 @@ struct MountedRoot {
 
     Brufs::Status open_file(const Brufs::InodeId &id, Brufs::File &ino, bool store = true);
     Brufs::Status get_file(const Brufs::InodeId &id, Brufs::File &ino);
+    Brufs::ExtentMap *get_extent_map(const Brufs::InodeId &id);
 
     Brufs::Status open_directory(
         const Brufs::InodeId &id, Brufs::Directory &ino, bool store = true
@@ -74,29 +113,87 @@ extern fuse_lowlevel_ops fs_ops;
 
 extern Brufs::Brufs *fs;
 extern FdAbst *fs_io;
-extern uv_rwlock_t fs_rwlock;
 
 extern std::map<std::string, MountedRoot *> mounted_roots;
 
+/**
+ * Locks a single inode for reading.
+ *
+ * The shared structures of the filesystem (free blocks, inode trees, block cache) are guarded by
+ * libbrufs itself, so operations on different inodes and different roots run in parallel.
+ */
 class ReadLock {
+private:
+    MountedRoot *root;
+    uv_rwlock_t *inode_lock;
+
 public:
-    ReadLock() {
-        uv_rwlock_rdlock(&fs_rwlock);
+    ReadLock(MountedRoot *root, const Brufs::InodeId &id) :
+        root(root), inode_lock(root->get_inode_lock(id))
+    {
+        uv_rwlock_rdlock(&this->root->namespace_lock);
+        uv_rwlock_rdlock(this->inode_lock);
     }
 
     ~ReadLock() {
-        uv_rwlock_rdunlock(&fs_rwlock);
+        uv_rwlock_rdunlock(this->inode_lock);
+        uv_rwlock_rdunlock(&this->root->namespace_lock);
     }
 };
 
+/**
+ * Locks a single inode for writing.
+ */
 class WriteLock {
+private:
+    MountedRoot *root;
+    uv_rwlock_t *inode_lock;
+
 public:
-    WriteLock() {
-        uv_rwlock_wrlock(&fs_rwlock);
+    WriteLock(MountedRoot *root, const Brufs::InodeId &id) :
+        root(root), inode_lock(root->get_inode_lock(id))
+    {
+        uv_rwlock_rdlock(&this->root->namespace_lock);
+        uv_rwlock_wrlock(this->inode_lock);
     }
 
     ~WriteLock() {
-        uv_rwlock_wrunlock(&fs_rwlock);
+        uv_rwlock_wrunlock(this->inode_lock);
+        uv_rwlock_rdunlock(&this->root->namespace_lock);
+    }
+};
+
+/**
+ * Locks every inode in a root, for operations changing the directory structure.
+ */
+class NamespaceLock {
+private:
+    MountedRoot *root;
+
+public:
+    explicit NamespaceLock(MountedRoot *root) : root(root) {
+        uv_rwlock_wrlock(&this->root->namespace_lock);
+    }
+
+    ~NamespaceLock() {
+        uv_rwlock_wrunlock(&this->root->namespace_lock);
+    }
+};
+
+/**
+ * Guards the open inode map of a root.
+ */
+class OpenInodesLock {
+private:
+    MountedRoot *root;
+
+public:
+    explicit OpenInodesLock(MountedRoot *root) : root(root) {
+        uv_mutex_lock(&this->root->open_inodes_lock);
+    }
+
+    ~OpenInodesLock() {
+        uv_mutex_unlock(&this->root->open_inodes_lock);
     }
 };
 
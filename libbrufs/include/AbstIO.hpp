@@ -56,6 +56,20 @@ public:
      */
     virtual SSize write(const void *buf, Size count, Address offset) = 0;
 
+    /**
+     * Tells the disk that `count` bytes starting from offset `offset` are no longer in use, so
+     * the storage behind them can be released. Their contents are undefined afterwards.
+     *
+     * The default implementation doesn't support discarding.
+     *
+     * @param count the number of bytes to discard
+     * @param offset the offset from which to start discarding
+     *
+     * @return the number of bytes discarded, E_UNSUPPORTED if the disk can't discard, or any
+     *         other status code on error
+     */
+    virtual SSize discard(Size count, Address offset);
+
     /**
      * Returns a string describing the given Status code.
      *
@@ -0,0 +1,603 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "types.hpp"
+#include "Extent.hpp"
+#include "Header.hpp"
+#include "Mutex.hpp"
+#include "Status.hpp"
+#include "Vector.hpp"
+#include "BmTree/btree-decl.hpp"
+
+namespace Brufs {
+
+class AllocGroup;
+
+/**
+ * The magic byte sequence identifying an allocation group.
+ */
+static const char *const GROUP_MAGIC_STRING = "BRUFS\nAG";
+
+/**
+ * The full length of the group magic string in bytes.
+ */
+static const Size GROUP_MAGIC_STRING_LENGTH = 8;
+
+/**
+ * The header of an allocation group, stored in the first cluster of the group.
+ *
+ * The first group has no header of its own; it's described by the filesystem header. Like there,
+ * the spare cluster list directly follows the header.
+ */
+struct GroupHeader {
+    /**
+     * Magic string identifying the cluster as a group header
+     */
+    uint8_t magic[GROUP_MAGIC_STRING_LENGTH];
+
+    /**
+     * xxHash64 of the group header up to header_size bytes, with this field 0
+     */
+    uint64_t checksum;
+
+    /**
+     * The size of the header in bytes
+     */
+    uint32_t header_size;
+
+    /**
+     * The index of the group on the disk
+     */
+    uint32_t index;
+
+    /**
+     * The starting address of the free blocks tree of the group.
+     */
+    uint64_t fbt_address;
+
+    /**
+     * The starting address of the free offset tree of the group.
+     */
+    uint64_t fot_address;
+
+    /**
+     * The current amount of spare clusters in the group.
+     */
+    uint8_t sc_count;
+
+    /**
+     * The free space counters of the group.
+     */
+    FreeSpaceCounters free_space;
+
+    /**
+     * The start of the uninitialized tail of the group, or 0 if it has none.
+     *
+     * Groups created before lazy initialization existed have a header_size ending before this
+     * field.
+     */
+    uint64_t uninit_start;
+};
+static_assert(std::is_standard_layout<GroupHeader>::value, "group headers must be standard-layout");
+
+/**
+ * A Bm+tree indexing the free space of an allocation group.
+ *
+ * Its nodes come from the spare clusters of the group, and root changes are stored in the group
+ * header.
+ *
+ * DO NOT USE EXCEPT INSIDE THE ALLOCGROUP CLASS!
+ *
+ * @tparam K the key type
+ */
+template <typename K>
+class GroupTree : public BmTree::BmTree<K, Extent> {
+private:
+    AllocGroup *group;
+    Address *target;
+
+    Status alloc(Size length, Extent &target, Address goal) override;
+    Status free(const Extent &ext) override;
+
+public:
+    GroupTree(Brufs *fs, AllocGroup *group) :
+        BmTree::BmTree<K, Extent>(fs, 0), group(group), target(nullptr)
+    {}
+
+    void set_target(Address *target) {
+        this->target = target;
+    }
+
+    Status on_root_change(Address new_addr) override;
+};
+
+/**
+ * A region of the disk with its own free space trees and spare clusters.
+ *
+ * Every group has its own lock, so allocations in different groups don't contend. The first group
+ * shares the lock and the spare cluster list of the filesystem header; a filesystem created
+ * without allocation groups consists of that group only.
+ *
+ * Extents never cross group boundaries. Use the groups through the Brufs class.
+ */
+class AllocGroup {
+private:
+    Brufs *fs;
+
+    /**
+     * The index of the group on the disk.
+     */
+    unsigned int index;
+
+    /**
+     * The first address in the group.
+     */
+    Address start;
+
+    /**
+     * The address right after the group.
+     */
+    Address end;
+
+    /**
+     * The lock of this group, unless it's the first.
+     */
+    Mutex own_lock;
+
+    /**
+     * Guards the free space trees and the spare clusters of the group.
+     */
+    Mutex &lock;
+
+    /**
+     * The group header followed by the spare cluster list, or null for the first group.
+     */
+    char *raw_header;
+
+    /**
+     * Where the group metadata lives, either in the group header or in the filesystem header.
+     */
+    uint64_t *fbt_address;
+    uint64_t *fot_address;
+    uint8_t *sc_count;
+    Extent *spare_clusters;
+    FreeSpaceCounters *counters;
+    uint64_t *uninit_start;
+
+    /**
+     * The counters of a first group whose filesystem header has no room for them.
+     */
+    FreeSpaceCounters own_counters {};
+
+    /**
+     * The tail start of a group whose header has no room for it, so it never has a tail.
+     */
+    uint64_t own_uninit_start = 0;
+
+    /**
+     * Whether the group has a free offset tree; only the first group of an old filesystem hasn't.
+     */
+    bool has_fot;
+
+    /**
+     * The free blocks tree.
+     *
+     * This tree stores free extents in the group indexed by their size.
+     */
+    GroupTree<Size> fbt;
+
+    /**
+     * The free offset tree.
+     *
+     * This tree stores the same free extents as the free blocks tree, indexed by their offset, to
+     * find free space near a goal address. It is authoritative: extents taken from here are left
+     * behind in the free blocks tree and skipped when they turn up there.
+     */
+    GroupTree<Address> fot;
+
+    /**
+     * Where release_tree_block collects the blocks of the free space trees while they are torn
+     * down by compact_free_space.
+     */
+    Vector<Extent> *reclaimed = nullptr;
+
+    /**
+     * The clusters allocate_tree_blocks hands out while compact_free_space rebuilds the free space
+     * trees.
+     */
+    Vector<Extent> *tree_block_pool = nullptr;
+
+    /**
+     * The number of size classes with a free list.
+     */
+    static constexpr unsigned int NUM_SIZE_CLASSES = 2;
+
+    /**
+     * The maximum number of extents in a single free list.
+     */
+    static constexpr unsigned int FREE_LIST_CAPACITY = 64;
+
+    /**
+     * The number of extents to take from the free space trees at once when a free list runs dry.
+     */
+    static constexpr unsigned int FREE_LIST_RUN = 16;
+
+    /**
+     * The extent length of every size class: a single block and a single cluster.
+     */
+    Size size_classes[NUM_SIZE_CLASSES];
+
+    /**
+     * Free extents of exactly the size of their class, taken out of the free space trees.
+     *
+     * Allocations and frees of these common sizes are served from here without touching the
+     * trees. The extents are only free in memory: they go back to the trees when the group is
+     * spilled, and leak if the filesystem isn't closed cleanly.
+     */
+    Vector<Extent> free_lists[NUM_SIZE_CLASSES];
+
+    /**
+     * Tree blocks released while the spare cluster list was full, waiting to be indexed as free
+     * space once the tree operation that released them has finished.
+     */
+    Vector<Extent> released;
+
+    /**
+     * Stores the group metadata.
+     *
+     * @return the status
+     */
+    Status store();
+
+    /**
+     * Adds an extent to the free space indexes.
+     *
+     * @param ext the extent to add
+     *
+     * @return the status
+     */
+    Status add_free_extent(const Extent &ext);
+
+    /**
+     * Subtracts an extent taken out of the free space indexes from the counters.
+     *
+     * @param ext the extent
+     */
+    void drop_free_extent(const Extent &ext);
+
+    /**
+     * Takes the smallest free extent of at least the given size out of the free space indexes,
+     * falling back to the uninitialized tail.
+     *
+     * @param length the minimum size of the extent
+     * @param result where to store the extent
+     *
+     * @return E_NOT_FOUND if there is no such extent, or any other status
+     */
+    Status take_free_extent(Size length, Extent &result);
+
+    /**
+     * Returns the length of the uninitialized tail of the group.
+     *
+     * The tail is free space that was never indexed by the free space trees. It counts as a
+     * single free extent.
+     *
+     * @return the length in bytes, 0 if there is no tail
+     */
+    Size get_tail_length() const;
+
+    /**
+     * Takes free space from the start of the uninitialized tail.
+     *
+     * @param length the minimum number of bytes to take
+     * @param max_length the number of bytes to take if the tail is long enough
+     * @param result where to store the extent
+     *
+     * @return E_NOT_FOUND if the tail is too short, or any other status
+     */
+    Status take_from_tail(Size length, Size max_length, Extent &result);
+
+    /**
+     * Takes free space at or after a goal address.
+     *
+     * The space either starts at the goal, or at the first free extent after it that is large
+     * enough, looking at no more than Brufs::GOAL_SEARCH_DISTANCE extents. As much space as the
+     * extent allows is taken, in multiples of the minimum size, up to the maximum size.
+     *
+     * @param length the minimum number of bytes to take
+     * @param max_length the maximum number of bytes to take
+     * @param goal the address to start looking at
+     * @param target where to store the extent
+     *
+     * @return E_NOT_FOUND if there is no such space nearby, or any other status
+     */
+    Status take_free_extent_near(Size length, Size max_length, Address goal, Extent &target);
+
+    /**
+     * Returns the size class of an extent length.
+     *
+     * @param length the length
+     *
+     * @return the index of the size class, or -1 if the length has none
+     */
+    int size_class_of(Size length) const;
+
+    /**
+     * Takes an extent from a free list.
+     *
+     * With a goal, only an extent starting exactly at the goal is taken, so consecutive
+     * allocations continue the run the list was refilled with.
+     *
+     * @param size_class the size class of the list
+     * @param goal where the extent must start, or 0 for anywhere
+     * @param target where to store the extent
+     *
+     * @return whether an extent was taken
+     */
+    bool take_from_free_list(int size_class, Address goal, Extent &target);
+
+    /**
+     * Returns the extents in the free lists to the free space trees.
+     *
+     * @return the status
+     */
+    Status spill_free_lists_locked();
+
+    /**
+     * Merges an extent with the free extents directly before and after it, taking those out of
+     * the free space indexes.
+     *
+     * Without a free offset tree, the neighbors can't be found and the extent is left as-is.
+     *
+     * @param ext the extent to grow
+     *
+     * @return the status
+     */
+    Status coalesce_free_extent(Extent &ext);
+
+    /**
+     * Takes back a block of one of the free space trees.
+     *
+     * The block goes to the spare cluster list if there's room. Otherwise it's set aside until
+     * #index_released_blocks(), since indexing it now would modify the tree that released it in
+     * the middle of an operation.
+     *
+     * @param ext the extent of the block
+     *
+     * @return the status
+     */
+    Status release_tree_block(const Extent &ext);
+
+    /**
+     * Indexes the tree blocks set aside by #release_tree_block(const Extent &) as free space.
+     *
+     * @return the status
+     */
+    Status index_released_blocks();
+
+    /**
+     * Recounts the free space counters by walking the free space trees.
+     *
+     * @return the status
+     */
+    Status scan_free_space();
+
+    /**
+     * Checks whether the free space counters are plausible for the group.
+     *
+     * @return whether the counters can be trusted
+     */
+    bool counters_valid() const;
+
+    /**
+     * Takes the largest free extent out of the free space indexes or the uninitialized tail.
+     *
+     * @param result where to store the extent
+     *
+     * @return E_NOT_FOUND if there are no free extents, or any other status
+     */
+    Status take_largest_free_extent(Extent &result);
+
+    /**
+     * Tops up the spare cluster list from the free space indexes.
+     *
+     * @param target the number of spare clusters to have afterwards
+     *
+     * @return the status
+     */
+    Status refill_spare_clusters(unsigned int target);
+
+    friend GroupTree<Size>;
+    friend GroupTree<Address>;
+
+public:
+    /**
+     * Creates the first group, described by the filesystem header.
+     *
+     * @param fs the filesystem the group is part of
+     * @param lock the lock of the filesystem header
+     * @param hdr the filesystem header
+     * @param end the address right after the group
+     */
+    AllocGroup(Brufs *fs, Mutex &lock, Header *hdr, Address end);
+
+    /**
+     * Creates any other group, described by its own header.
+     *
+     * @param fs the filesystem the group is part of
+     * @param index the index of the group
+     * @param start the first address in the group
+     * @param end the address right after the group
+     */
+    AllocGroup(Brufs *fs, unsigned int index, Address start, Address end);
+
+    ~AllocGroup();
+
+    // Groups are non-copyable
+    AllocGroup(const AllocGroup &other) = delete;
+    AllocGroup &operator=(const AllocGroup &other) = delete;
+
+    /**
+     * Loads the group metadata from disk.
+     *
+     * The free space counters are recounted if they are missing or don't add up.
+     *
+     * @return E_BAD_MAGIC or E_CHECKSUM_MISMATCH if the group header is damaged, E_NO_FBT if a
+     *         free space tree is missing, or any other status
+     */
+    Status load();
+
+    /**
+     * Creates the group metadata on disk, marking the rest of the group as free.
+     *
+     * @return the status
+     */
+    Status init();
+
+    unsigned int get_index() const { return this->index; }
+    Address get_start() const { return this->start; }
+    Address get_end() const { return this->end; }
+
+    /**
+     * Allocates a single extent in this group.
+     *
+     * @param length the number of bytes to allocate
+     * @param target where to store the allocated extent
+     * @param goal where to preferably place the extent, or 0 for anywhere
+     *
+     * @return E_WONT_FIT if no free extent in the group is large enough, or any other status
+     */
+    Status allocate_blocks(Size length, Extent &target, Address goal);
+
+    /**
+     * Returns the extents in the free lists of this group to its free space trees, so the disk
+     * describes all free space.
+     *
+     * @return the status
+     */
+    Status spill_free_lists();
+
+    /**
+     * Allocates the largest free extents in this group until a request is covered or the group
+     * runs out of usable space.
+     *
+     * @param remaining the number of bytes left to allocate; lowered by what was allocated
+     * @param target where to append the allocated extents
+     *
+     * @return the status
+     */
+    Status take_extents(Size &remaining, Vector<Extent> &target);
+
+    /**
+     * Allocates a free cluster from the spare clusters of this group.
+     *
+     * @param target where to store the allocated extent
+     *
+     * @return E_NO_SPACE if the spare clusters ran out, or any other status
+     */
+    Status allocate_tree_blocks(Extent &target);
+
+    /**
+     * Frees an extent in this group, merging it with any free extents it borders.
+     *
+     * @param ext the extent to free
+     *
+     * @return the status
+     */
+    Status free_blocks(const Extent &ext);
+
+    /**
+     * Adds the free space of the group to the given totals, read from the counters.
+     *
+     * @see Brufs::count_free_blocks(Size &, Size &, Size &, Size &)
+     *
+     * @return the status
+     */
+    Status count_free_blocks(Size &standby, Size &available, Size &extents, Size &in_fbt);
+
+    /**
+     * Discards the free extents and the spare clusters of the group.
+     *
+     * @see Brufs::discard_free_space(Size &)
+     *
+     * @param discarded where to add the number of bytes discarded
+     *
+     * @return the status
+     */
+    Status discard_free_space(Size &discarded);
+
+    /**
+     * Tops up the spare cluster list of the group to the high mark.
+     *
+     * @see Brufs::refill_spare_clusters()
+     *
+     * @return the status
+     */
+    Status top_up_spare_clusters();
+
+    /**
+     * Returns the spare clusters above the high mark to the free space trees, after the mark
+     * was lowered.
+     *
+     * @return the status
+     */
+    Status release_excess_spare_clusters();
+
+    /**
+     * Rebuilds the free space trees of the group, merging all physically adjacent free extents.
+     *
+     * @see Brufs::compact_free_space(Size &)
+     *
+     * @param merged where to add the number of extents that were merged away
+     *
+     * @return E_NO_SPACE if there is no room for the new trees, or any other status
+     */
+    Status compact_free_space(Size &merged);
+};
+
+template <typename K>
+Status GroupTree<K>::alloc(Size length, Extent &target, Address goal) {
+    (void) length;
+    (void) goal;
+
+    auto status = this->group->allocate_tree_blocks(target);
+    if (status >= Status::OK) this->group->counters->tree_bytes += target.length;
+
+    return status;
+}
+
+template <typename K>
+Status GroupTree<K>::free(const Extent &ext) {
+    return this->group->release_tree_block(ext);
+}
+
+template <typename K>
+Status GroupTree<K>::on_root_change(Address new_addr) {
+    *this->target = new_addr;
+    return this->group->store();
+}
+
+}
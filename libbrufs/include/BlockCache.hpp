@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+
+#include "types.hpp"
+#include "Mutex.hpp"
+#include "Status.hpp"
+
+namespace Brufs {
+
+struct Disk;
+
+/**
+ * A bounded cache of on-disk blocks.
+ *
+ * The cache is shared by all Bm+trees residing on a filesystem, so the hot upper levels of the
+ * trees stay in memory. Blocks are evicted using the CLOCK algorithm; pinned blocks are never
+ * evicted.
+ *
+ * Writes are passed on to the disk immediately, unless a batch is open: then written blocks are
+ * only marked dirty, and every dirty block is written exactly once, in address order, when the
+ * outermost batch ends. Dirty blocks are never evicted; if no slot can hold a written block, the
+ * write goes straight to disk instead. After the blocks are written, the commit hook (if any) is
+ * called, so the owner can write state that must only reach the disk after the blocks do.
+ *
+ * The cache is safe to use from multiple threads. Batches are kept per thread: a write is only
+ * deferred if the writing thread has a batch open, and when a thread's outermost batch ends, the
+ * dirty blocks are written even if other threads still have batches open.
+ */
+class BlockCache {
+public:
+    /**
+     * The default number of blocks the cache can hold.
+     */
+    static constexpr unsigned int DEFAULT_CAPACITY = 1024;
+
+    /**
+     * Called when the outermost batch ends and its blocks were written.
+     *
+     * @param context the context passed to #set_commit_hook(CommitHook, void *)
+     *
+     * @return the status of the commit
+     */
+    using CommitHook = Status (*)(void *context);
+
+    /**
+     * A single cached block.
+     */
+    struct Slot {
+        /**
+         * The address of the block, or 0 if the slot is empty.
+         */
+        Address addr;
+
+        /**
+         * The size of the block in bytes.
+         */
+        Size length;
+
+        /**
+         * The cached data.
+         */
+        char *buf;
+
+        /**
+         * The number of users currently holding on to the block.
+         */
+        unsigned int pins;
+
+        /**
+         * Whether the block was used since the clock hand last passed it.
+         */
+        bool referenced;
+
+        /**
+         * Whether the cached data is newer than the data on disk.
+         */
+        bool dirty;
+
+        /**
+         * The index of the next slot in the same hash bucket, or -1.
+         */
+        long next;
+    };
+
+    /**
+     * Keeps a batch open for as long as it's in scope.
+     *
+     * Call #finish(Status) to end the batch and learn whether the dirty blocks made it to disk;
+     * otherwise the batch ends when the scope is left and any write errors are lost.
+     */
+    class Batch {
+    private:
+        BlockCache &cache;
+        bool open;
+
+    public:
+        explicit Batch(BlockCache &cache) : cache(cache), open(true) {
+            this->cache.begin_batch();
+        }
+
+        ~Batch() {
+            if (this->open) (void) this->cache.end_batch();
+        }
+
+        Batch(const Batch &other) = delete;
+        Batch &operator=(const Batch &other) = delete;
+
+        /**
+         * Ends the batch.
+         *
+         * @param status the status of the operation performed in the batch
+         *
+         * @return the given status if it's an error, or the status of the write-back otherwise
+         */
+        Status finish(Status status) {
+            assert(this->open);
+            this->open = false;
+
+            const auto flushed = this->cache.end_batch();
+            if (status < Status::OK) return status;
+            if (flushed < Status::OK) return flushed;
+            return status;
+        }
+    };
+
+private:
+    /**
+     * The disk the blocks are read from and written to.
+     */
+    Disk *dsk;
+
+    /**
+     * The slots in the cache.
+     */
+    Slot *slots;
+
+    /**
+     * The number of slots in the cache.
+     */
+    unsigned int capacity;
+
+    /**
+     * The heads of the hash chains, indexed by the hash of the block address.
+     */
+    long *buckets;
+
+    /**
+     * The number of hash buckets; always a power of two.
+     */
+    unsigned int num_buckets;
+
+    /**
+     * The position of the clock hand.
+     */
+    unsigned int hand;
+
+    /**
+     * The dirty slots, in the order they were first written to.
+     */
+    Slot **dirty;
+
+    /**
+     * The number of dirty slots.
+     */
+    unsigned int num_dirty;
+
+    /**
+     * The number of batches currently open, in all threads.
+     */
+    unsigned int open_batches;
+
+    /**
+     * The function to call after the outermost batch is written, or null.
+     */
+    CommitHook commit_hook;
+
+    /**
+     * The context to pass to the commit hook.
+     */
+    void *commit_context;
+
+    Size hits;
+    Size misses;
+
+    /**
+     * Guards the slots, the hash chains and the dirty list.
+     */
+    Mutex mutex;
+
+    unsigned int hash(Address addr) const;
+
+    Slot *find(Address addr);
+    void unlink(Slot *slot);
+    void forget_dirty(Slot *slot);
+    Slot *evict();
+
+public:
+    /**
+     * Creates a new block cache.
+     *
+     * If the memory for the cache can't be allocated, the cache will pass all requests on to
+     * the disk.
+     *
+     * @param dsk the disk to cache
+     * @param capacity the maximum number of blocks to keep in memory
+     */
+    BlockCache(Disk *dsk, unsigned int capacity = DEFAULT_CAPACITY);
+
+    ~BlockCache();
+
+    // Caches are non-copyable
+    BlockCache(const BlockCache &other) = delete;
+    BlockCache &operator=(const BlockCache &other) = delete;
+
+    /**
+     * Looks up a block, loading it from disk if it's not in the cache yet, and pins it.
+     *
+     * Every successfully acquired slot must be released again using #release(Slot *). The pin
+     * only keeps the slot from being evicted; threads sharing a block must synchronize access to
+     * its contents themselves.
+     *
+     * @param addr the address of the block
+     * @param length the size of the block in bytes
+     * @param slot where to store the pinned slot
+     * @param load whether to read the block from disk on a miss; if false, the contents of the
+     *        slot are undefined on a miss
+     *
+     * @return E_NO_SPACE if every slot is pinned, or any status returned by the disk
+     */
+    Status acquire(Address addr, Size length, Slot *&slot, bool load = true);
+
+    /**
+     * Unpins a block acquired earlier.
+     *
+     * @param slot the slot to release
+     */
+    void release(Slot *slot);
+
+    /**
+     * Reads a block through the cache.
+     *
+     * @param addr the address of the block
+     * @param length the size of the block in bytes
+     * @param buf where to copy the block to
+     *
+     * @return the status
+     */
+    Status read(Address addr, Size length, void *buf);
+
+    /**
+     * Writes a block to disk and updates the cached copy.
+     *
+     * While a batch is open, only the cached copy is updated and the block is written when the
+     * batch ends.
+     *
+     * @param addr the address of the block
+     * @param length the size of the block in bytes
+     * @param buf the new contents of the block
+     *
+     * @return the status
+     */
+    Status write(Address addr, Size length, const void *buf);
+
+    /**
+     * Opens a batch, deferring the writes of the calling thread until the matching #end_batch().
+     *
+     * Batches nest; only ending the outermost one of a thread writes the dirty blocks.
+     */
+    void begin_batch();
+
+    /**
+     * Closes a batch opened by #begin_batch(), writing all dirty blocks if it was the outermost
+     * one of the calling thread.
+     *
+     * The commit hook is called after the blocks are written, without holding the cache lock.
+     *
+     * @return the status of the write-back, or of the commit hook
+     */
+    Status end_batch();
+
+    /**
+     * Sets the function to call whenever the outermost batch ends.
+     *
+     * @param hook the function to call, or null to call nothing
+     * @param context the value to pass to the hook
+     */
+    void set_commit_hook(CommitHook hook, void *context) {
+        this->commit_hook = hook;
+        this->commit_context = context;
+    }
+
+    /**
+     * Writes every dirty block to disk in address order.
+     *
+     * Blocks that fail to be written stay dirty.
+     *
+     * @return the first error encountered, or OK
+     */
+    Status flush();
+
+    /**
+     * Drops all cached blocks starting inside the given range.
+     *
+     * Should be called whenever the blocks are freed, since they may be overwritten without
+     * passing through the cache afterwards. Dirty blocks are dropped without being written.
+     *
+     * @param addr the start of the range
+     * @param length the size of the range in bytes
+     */
+    void invalidate(Address addr, Size length);
+
+    /**
+     * Drops every cached block.
+     */
+    void clear();
+
+    unsigned int get_capacity() const { return this->capacity; }
+    Size get_hits() const { return this->hits; }
+    Size get_misses() const { return this->misses; }
+    unsigned int get_num_dirty() const { return this->num_dirty; }
+
+    /**
+     * Returns whether the calling thread has a batch open.
+     *
+     * @return whether the thread's writes are deferred
+     */
+    bool in_batch() const;
+
+    void reset_stats() {
+        this->hits = 0;
+        this->misses = 0;
+    }
+};
+
+}
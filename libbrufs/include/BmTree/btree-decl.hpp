@@ -28,6 +28,7 @@
 
 #include "../Status.hpp"
 #include "../Extent.hpp"
+#include "../Vector.hpp"
 
 namespace Brufs {
 class Brufs;
@@ -40,7 +41,8 @@ namespace Brufs::BmTree {
  *
  * @param fs the filesystem to allocate the blocks from
  * @param length the number of bytes the allocation should contain
- * @param target where to store allocation information
+ * @param target where to store allocation information; on entry, its offset holds the address
+ *               the allocation should preferably be placed at, or 0 if there is no preference
  *
  * @return a status code whether allocation succeeded or failed
  */
@@ -61,6 +63,18 @@ using EntryConsumer = Status (*)(K &key, V *item, P pl);
 template <typename K, typename V>
 using ContextlessEntryConsumer = Status (*)(K &key, V *item);
 
+/**
+ * A key and a pointer to its value, as passed to BmTree::bulk_load.
+ *
+ * @tparam K the key type
+ * @tparam V the value type
+ */
+template <typename K, typename V>
+struct Record {
+    K key;
+    const V *value;
+};
+
 template <typename V>
 bool equiv_values(const V *current, const V *replacement) {
     (void) current;
@@ -74,7 +88,8 @@ bool equiv_values(const V *current, const V *replacement) {
  */
 struct Header {
     /**
-     * The magic header "B+" marking this as a Bm+tree.
+     * The magic header "B+" marking this as a Bm+tree, or "B#" if the inner nodes also keep the
+     * number of values below each child.
      */
     uint8_t magic[2];
 
@@ -93,8 +108,8 @@ struct Header {
      */
     uint32_t num_values;
 
-    Header(uint8_t level = 0, uint32_t num_values = 0) :
-        magic {'B', '+'},
+    Header(uint8_t level = 0, uint32_t num_values = 0, bool counted = false) :
+        magic {'B', static_cast<uint8_t>(counted ? '#' : '+')},
         level(level),
         size(sizeof(Header)),
         num_values(num_values)
@@ -106,6 +121,86 @@ static_assert(sizeof(Header) % 8 == 0);
 template <typename K, typename V>
 class Node;
 
+template <typename K, typename V>
+class Cursor;
+
+/**
+ * A small stack of spare node buffers.
+ *
+ * Every level of a descent creates a node with its own buffer; taking those buffers from here
+ * keeps lookups and updates from allocating memory once the pool is warm.
+ */
+class NodeBufferPool {
+public:
+    /**
+     * The maximum number of spare buffers; enough for a full path plus the siblings touched by
+     * a split or merge.
+     */
+    static constexpr unsigned int CAPACITY = 8;
+
+private:
+    char *buffers[CAPACITY];
+    unsigned int count;
+
+    /**
+     * The size of every buffer in the pool.
+     */
+    Size length;
+
+public:
+    NodeBufferPool() : count(0), length(0) {}
+
+    ~NodeBufferPool() {
+        this->clear();
+    }
+
+    // Pools own their buffers
+    NodeBufferPool(const NodeBufferPool &other) = delete;
+    NodeBufferPool &operator=(const NodeBufferPool &other) = delete;
+
+    /**
+     * Returns a buffer of the given size, allocating one if the pool has none to spare.
+     *
+     * @param length the size of the buffer in bytes
+     *
+     * @return the buffer, or NULL if it could not be allocated
+     */
+    char *take(Size length) {
+        if (length == this->length && this->count > 0) return this->buffers[--this->count];
+        return static_cast<char *>(malloc(length));
+    }
+
+    /**
+     * Returns a buffer to the pool, freeing it if the pool is full.
+     *
+     * @param buf the buffer; may be NULL
+     * @param length the size of the buffer in bytes
+     */
+    void give(char *buf, Size length) {
+        if (!buf) return;
+
+        // The tree changed its node size; the old buffers are useless now
+        if (length != this->length) {
+            this->clear();
+            this->length = length;
+        }
+
+        if (this->count == CAPACITY) {
+            ::free(buf);
+            return;
+        }
+
+        this->buffers[this->count++] = buf;
+    }
+
+    /**
+     * Frees every spare buffer.
+     */
+    void clear() {
+        while (this->count > 0) ::free(this->buffers[--this->count]);
+    }
+};
+
 /**
  * A B+tree with flexible index prediction.
  *
@@ -142,23 +237,48 @@ private:
 
     Deallocator dealloctr;
 
+    /**
+     * Spare buffers for the nodes of this tree. Declared before the root, so it outlives it.
+     */
+    NodeBufferPool buffers;
+
     /**
      * The root of the tree.
      */
     Node<K, V> root;
     friend Node<K, V>;
+    friend Cursor<K, V>;
 
     /**
      * Allocates a block for the tree.
      *
+     * Subclasses may override this to take blocks from somewhere the allocator can't reach.
+     *
      * @param length the length of the block in bytes
      * @param target where to write the block extent
+     * @param goal the address to place the block near, or 0 for anywhere
+     *
+     * @return a status return code
+     */
+    virtual Status alloc(Size length, Extent &target, Address goal = 0);
+
+    /**
+     * Releases a block of the tree.
+     *
+     * @param ext the extent of the block
      *
      * @return a status return code
      */
-    Status alloc(Size length, Extent &target);
+    virtual Status free(const Extent &ext);
 
-    Status free(const Extent &ext);
+    /**
+     * The last key, address and value count of a node, used while building a tree bottom-up.
+     */
+    struct ChildRef {
+        K key;
+        Address addr;
+        Size count;
+    };
 
 public:
     /**
@@ -181,7 +301,17 @@ public:
 
     BmTree<K, V> &operator=(const BmTree<K, V> &other);
 
-    Status init(Size new_length = 0);
+    /**
+     * Creates a new, empty tree.
+     *
+     * @param new_length the size of each node, or 0 to keep the current size
+     * @param counted whether inner nodes should keep the number of values in each subtree,
+     *                making count_values() and Cursor::seek_to_nth() logarithmic at the cost of
+     *                storing every node on the path on each insertion and removal
+     *
+     * @return a status code
+     */
+    Status init(Size new_length = 0, bool counted = false);
 
     Status search(const K key, V *value, bool exact = false);
     Status search(const K key, V &value, bool exact = false) {
@@ -210,6 +340,61 @@ public:
         return this->remove(key, &value, exact);
     }
 
+    /**
+     * Inserts a batch of records sorted by key.
+     *
+     * Records that land in the same leaf are added to it in memory, so every touched node is
+     * stored once instead of once per record. Leaves are split as they fill up.
+     *
+     * @param first an iterator to the first Record to insert
+     * @param last an iterator past the last Record to insert
+     * @param collide whether to refuse keys that are already present
+     *
+     * @return E_INVALID_ARGUMENT if the records are not sorted, E_EXISTS if a key collides, or any
+     *         other status; on failure, a prefix of the records may have been inserted
+     */
+    template <typename I>
+    Status insert_batch(I first, I last, bool collide = false);
+
+    /**
+     * Removes one value for each key in a sorted batch of keys, with exact matching.
+     *
+     * Keys are removed from their leaf in memory, so every touched node is stored once instead of
+     * once per key. Keys without a value are skipped.
+     *
+     * @param first an iterator to the first key to remove
+     * @param last an iterator past the last key to remove
+     * @param removed where to store the number of values removed
+     *
+     * @return E_INVALID_ARGUMENT if the keys are not sorted, or any other status
+     */
+    template <typename I>
+    Status remove_batch(I first, I last, Size &removed);
+
+    /**
+     * Fills an empty tree with sorted records, building it bottom-up.
+     *
+     * Leaves are packed up to the fill factor and every node is written exactly once, so the
+     * cost is dominated by sequential writes instead of a descent and node rewrite per key.
+     *
+     * @param first an iterator to the first Record to insert
+     * @param last an iterator past the last Record to insert
+     * @param fill_percent how full each node should be, between 50 and 100 percent
+     *
+     * @return E_EXISTS if the tree is not empty, E_INVALID_ARGUMENT if the records are not
+     *         sorted or the fill factor is out of range, or any other status
+     */
+    template <typename I>
+    Status bulk_load(I first, I last, unsigned int fill_percent = 100);
+
+    /**
+     * Counts the values in the tree.
+     * This only reads the root if the tree is counted, and every leaf otherwise.
+     *
+     * @param count where to store the number of values
+     *
+     * @return a status code
+     */
     Status count_values(Size &count);
     Status count_used_space(Size &size);
 
@@ -260,6 +445,12 @@ public:
  */
 template <typename K, typename V>
 struct Node {
+    /**
+     * The percentage of values that stays in the left node when splitting the rightmost node of
+     * a level while appending to it.
+     */
+    static constexpr unsigned int APPEND_SPLIT_PERCENT = 90;
+
     /**
      * The filesystem this node resides on.
      */
@@ -328,6 +519,13 @@ struct Node {
      */
     Node(const Node<K, V> &other);
 
+    /**
+     * Moves another node, taking over its buffer.
+     *
+     * @param other the node to move
+     */
+    Node(Node<K, V> &&other);
+
     /**
      * Destructs the node, while retaining the data on-disk.
      */
@@ -341,12 +539,36 @@ struct Node {
      */
     Node<K, V> &operator=(const Node<K, V> &other);
 
+    /**
+     * Moves another node into this instance, taking over its buffer and its contents.
+     *
+     * @param other the node to move
+     */
+    Node<K, V> &operator=(Node<K, V> &&other);
+
+    /**
+     * Takes a buffer from the container's pool, or allocates one.
+     *
+     * @param container the tree the buffer is for; may be NULL
+     * @param length the size of the buffer in bytes
+     *
+     * @return the buffer
+     */
+    static char *take_buffer(BmTree<K, V> *container, Size length);
+
+    /**
+     * Hands this node's buffer back to the container's pool.
+     */
+    void release_buffer();
+
     /**
      * Initializes the node.
      *
+     * @param counted whether the tree keeps subtree value counts
+     *
      * @return a status code
      */
-    Status init();
+    Status init(bool counted = false);
 
     /**
      * Returns the size of the value type in bytes.
@@ -392,6 +614,53 @@ struct Node {
      */
     Address &prev();
 
+    /**
+     * Returns whether this node is the last one on its level, as far as the chain of parents
+     * tells.
+     */
+    bool is_rightmost() const;
+
+    /**
+     * Returns whether the tree keeps the number of values in each subtree.
+     */
+    bool is_counted() const;
+
+    /**
+     * Returns whether this node stores a value count for each of its children.
+     */
+    bool has_counts() const;
+
+    /**
+     * Returns a pointer into the in-memory buffer to the value count of the first child.
+     * The node must have counts.
+     */
+    Size *get_counts();
+
+    /**
+     * Returns the number of values in the subtree rooted at this node.
+     * For inner nodes without counts, this is the number of children instead.
+     */
+    Size count_subtree();
+
+    /**
+     * Updates the value count kept for a child in memory.
+     *
+     * @param child the modified child
+     *
+     * @return whether the count changed
+     */
+    bool update_count(Node<K, V> &child);
+
+    /**
+     * Updates the value count kept for a child after the child has been modified.
+     *
+     * @param child the modified child
+     * @param self the address this node had before the modification
+     *
+     * @return a status code
+     */
+    Status refresh_count(Node<K, V> &child, Address self);
+
     /**
      * Loads the node from disk.
      *
@@ -453,10 +722,12 @@ struct Node {
     Status get_first(V *value);
     Status get_last(V *value);
 
-    Status insert_initial(const K &key, Address left, Address right);
+    Status insert_initial(
+        const K &key, Address left, Address right, Size left_count = 0, Size right_count = 0
+    );
 
     template <typename R>
-    Status split(const K &key, const R *value, unsigned int idx);
+    Status split(const K &key, const R *value, unsigned int idx, Size count = 0);
 
     /**
      * Inserts a value in this node, without walking the rest of the tree.
@@ -470,8 +741,21 @@ struct Node {
     template <typename R>
     Status insert_direct(const K &key, const R *value, bool collide = false);
 
+    /**
+     * Inserts a value at a specific index in this node, splitting it if it's full.
+     *
+     * @param key the key to insert the value under
+     * @param value the value to insert
+     * @param idx the index to insert the value at
+     * @param collide whether to refuse duplicate keys
+     * @param count the number of values below the new child, if this is a counted inner node
+     *
+     * @return a status code
+     */
     template <typename R>
-    Status insert_direct_at(const K &key, const R *value, unsigned int idx, bool collide = false);
+    Status insert_direct_at(
+        const K &key, const R *value, unsigned int idx, bool collide = false, Size count = 0
+    );
 
     /**
      * Inserts a value in this part of the (sub-)tree.
@@ -483,10 +767,56 @@ struct Node {
      */
     Status insert(const K &key, const V *value, bool collide);
 
+    /**
+     * Applies a run of sorted keys to the children of this inner node, descending into each
+     * child once and storing this node once.
+     *
+     * @param it the next key to apply; advanced by the children
+     * @param last the end of the keys
+     * @param bound if not null, only keys less than this one belong to this subtree
+     * @param get_key extracts the key from an iterator
+     * @param run_child applies the run to a child, given the child and its bound
+     *
+     * @return RETRY if the tree was restructured and the caller should descend again, or any
+     *         other status
+     */
+    template <typename I, typename G, typename R>
+    Status run_children(I &it, I last, const K *bound, G get_key, R run_child);
+
+    /**
+     * Inserts a run of sorted records in this subtree, storing each touched node once.
+     *
+     * @param it the next Record to insert; advanced past every inserted record
+     * @param last the end of the records
+     * @param bound if not null, only records with keys less than this one belong to this subtree
+     * @param collide whether to refuse duplicate keys
+     *
+     * @return RETRY if a leaf had to be split and the caller should descend again, or any other
+     *         status
+     */
+    template <typename I>
+    Status insert_run(I &it, I last, const K *bound, bool collide);
+
     Status update(const K &key, const V *value);
 
     Status remove(const K &key, V *value, bool exact);
 
+    /**
+     * Removes one value for each key in a run of sorted keys from this subtree, storing each
+     * touched node once.
+     *
+     * Stops at keys that aren't in the leaf they route to, or whose removal would need a merge.
+     *
+     * @param it the next key to remove; advanced past every removed key
+     * @param last the end of the keys
+     * @param bound if not null, only keys less than this one belong to this subtree
+     * @param removed incremented for every removed value
+     *
+     * @return RETRY if the caller should handle the next key by itself, or any other status
+     */
+    template <typename I>
+    Status remove_run(I &it, I last, const K *bound, Size &removed);
+
     template <typename R>
     Status adopt(Node *adoptee);
 
@@ -514,4 +844,156 @@ struct Node {
     // }
 };
 
+/**
+ * A position in the leaves of a Bm+tree, used to scan a range of entries in either direction.
+ *
+ * The cursor remembers the path from the root to the current leaf, so stepping past the edge of a
+ * leaf only reloads the nodes along that path and no leaf is loaded before it is needed.
+ * Any modification of the tree invalidates the cursor; seek again afterwards.
+ *
+ * @tparam K the key type
+ * @tparam V the value type in the leaves
+ */
+template <typename K, typename V>
+class Cursor {
+private:
+    /**
+     * An inner node on the path to the current leaf.
+     */
+    struct Step {
+        /**
+         * The address of the inner node.
+         */
+        Address addr;
+
+        /**
+         * The index of the child the path continues in.
+         */
+        unsigned int index;
+
+        /**
+         * The number of children of the inner node.
+         */
+        unsigned int num_values;
+    };
+
+    BmTree<K, V> *tree;
+
+    /**
+     * The inner nodes from the root down to the current leaf.
+     */
+    Vector<Step> path;
+
+    /**
+     * The current leaf.
+     */
+    Node<K, V> leaf;
+
+    /**
+     * The index of the current entry in the leaf.
+     */
+    unsigned int index;
+
+    bool valid;
+
+    /**
+     * Walks down from a node to its first or last leaf, extending the path.
+     *
+     * @param addr the address of the node to start from
+     * @param last whether to go to the last leaf instead of the first
+     *
+     * @return a status code
+     */
+    Status descend(Address addr, bool last);
+
+    /**
+     * Moves to the adjacent entry.
+     *
+     * @param forward whether to move to the next entry instead of the previous one
+     *
+     * @return E_NOT_FOUND if there is no such entry, or any other status
+     */
+    Status step(bool forward);
+
+public:
+    /**
+     * Creates an unpositioned cursor over a tree.
+     *
+     * @param tree the tree to scan
+     */
+    explicit Cursor(BmTree<K, V> &tree);
+
+    Cursor(const Cursor<K, V> &other) = delete;
+    Cursor<K, V> &operator=(const Cursor<K, V> &other) = delete;
+
+    /**
+     * Moves the cursor to the first entry with a key not less than the given key.
+     *
+     * @param key the key to search for
+     *
+     * @return E_NOT_FOUND if all keys are less than the given key, or any other status
+     */
+    Status seek(const K &key);
+
+    /**
+     * Moves the cursor to the entry with the given zero-based rank.
+     * This takes one descent in a counted tree and a scan from the first entry otherwise.
+     *
+     * @param rank the number of entries before the one to move to
+     *
+     * @return E_NOT_FOUND if the tree has no more than rank entries, or any other status
+     */
+    Status seek_to_nth(Size rank);
+
+    /**
+     * Moves the cursor to the first entry in the tree.
+     *
+     * @return E_NOT_FOUND if the tree is empty, or any other status
+     */
+    Status seek_first();
+
+    /**
+     * Moves the cursor to the last entry in the tree.
+     *
+     * @return E_NOT_FOUND if the tree is empty, or any other status
+     */
+    Status seek_last();
+
+    /**
+     * Moves the cursor to the next entry.
+     *
+     * @return E_NOT_FOUND if the cursor was at the last entry, or any other status
+     */
+    Status next() { return this->step(true); }
+
+    /**
+     * Moves the cursor to the previous entry.
+     *
+     * @return E_NOT_FOUND if the cursor was at the first entry, or any other status
+     */
+    Status prev() { return this->step(false); }
+
+    /**
+     * Returns whether the cursor points to an entry.
+     */
+    bool is_valid() const { return this->valid; }
+
+    /**
+     * Returns the key of the current entry. The cursor must be valid.
+     */
+    const K &get_key() {
+        assert(this->valid);
+        return this->leaf.get_keys()[this->index];
+    }
+
+    /**
+     * Returns the value of the current entry. The cursor must be valid.
+     * The pointer is invalidated when the cursor moves.
+     */
+    V *get_value() {
+        assert(this->valid);
+        return this->leaf.template get_value<V>(this->index);
+    }
+};
+
 }
@@ -47,7 +47,8 @@ static inline Status ALLOC_NEVER(Brufs &fs, Size length, Extent &target) {
 }
 
 static inline Status ALLOC_NORMAL(Brufs &fs, Size length, Extent &target) {
-    return fs.allocate_blocks(length, target);
+    const Address goal = target.offset;
+    return fs.allocate_blocks(length, target, goal);
 }
 
 static inline Status DEALLOC_NORMAL(Brufs &fs, const Extent &ext) {
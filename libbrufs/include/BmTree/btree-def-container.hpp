@@ -23,6 +23,7 @@
 #pragma once
 
 #include "../types.hpp"
+#include "../Vector.hpp"
 
 #include <stdio.h>
 #include <time.h>
@@ -37,7 +38,8 @@ Status BmTree<K, V>::update_root(Address new_addr, Size length) {
 }
 
 template <typename K, typename V>
-Status BmTree<K, V>::alloc(Size length, Extent &target) {
+Status BmTree<K, V>::alloc(Size length, Extent &target, Address goal) {
+    target = {goal, 0};
     return this->alloctr(*this->fs, length, target);
 }
 
@@ -68,9 +70,13 @@ BmTree<K, V>::BmTree(
 
 template <typename K, typename V>
 BmTree<K, V>::BmTree(const BmTree<K, V> &other) :
-    fs(other.fs), length(other.length), max_level(other.max_level), alloctr(other.alloctr),
+    fs(other.fs), length(other.length), max_level(other.max_level),
+    value_size(other.value_size), alloctr(other.alloctr), dealloctr(other.dealloctr),
     root(other.root)
-{}
+{
+    // The root is part of this tree now, not of the other one
+    this->root.container = this;
+}
 
 template <typename K, typename V>
 BmTree<K, V> &BmTree<K, V>::operator=(const BmTree<K, V> &other) {
@@ -78,14 +84,17 @@ BmTree<K, V> &BmTree<K, V>::operator=(const BmTree<K, V> &other) {
 
     this->fs = other.fs;
     this->max_level = other.max_level;
+    this->value_size = other.value_size;
     this->alloctr = other.alloctr;
+    this->dealloctr = other.dealloctr;
     this->root = other.root;
+    this->root.container = this;
 
     return *this;
 }
 
 template <typename K, typename V>
-Status BmTree<K, V>::init(Size length) {
+Status BmTree<K, V>::init(Size length, bool counted) {
     if (length != 0) {
         this->length = length;
     }
@@ -97,9 +106,9 @@ Status BmTree<K, V>::init(Size length) {
 
     Node<K, V> new_root(this->fs, root_extent.offset, this->length, this);
 
-    status = new_root.init();
+    status = new_root.init(counted);
     if (status < 0) {
-        (void) this->fs->free_blocks(root_extent);
+        (void) this->free(root_extent);
         return status;
     }
 
@@ -141,26 +150,238 @@ Status BmTree<K, V>::get_last(V *value) {
 
 template <typename K, typename V>
 Status BmTree<K, V>::insert(const K key, const V *value, bool collide) {
+    BlockCache::Batch batch(this->fs->get_cache());
+
     Status stt = this->root.load();
     if (stt < 0) return stt;
 
-    return this->root.insert(key, value, collide);
+    return batch.finish(this->root.insert(key, value, collide));
 }
 
 template <typename K, typename V>
 Status BmTree<K, V>::update(const K key, const V *value) {
+    BlockCache::Batch batch(this->fs->get_cache());
+
     Status stt = this->root.load();
     if (stt < 0) return stt;
 
-    return this->root.update(key, value);
+    return batch.finish(this->root.update(key, value));
 }
 
 template <typename K, typename V>
 Status BmTree<K, V>::remove(const K key, V *value, bool strict) {
+    BlockCache::Batch batch(this->fs->get_cache());
+
     Status status = this->root.load();
     if (status < 0) return status;
 
-    return this->root.remove(key, value, strict);
+    return batch.finish(this->root.remove(key, value, strict));
+}
+
+template <typename K, typename V>
+template <typename I>
+Status BmTree<K, V>::insert_batch(I first, I last, bool collide) {
+    for (I it = first, prev = first; it != last; prev = it, ++it) {
+        if (it->key < prev->key) return Status::E_INVALID_ARGUMENT;
+    }
+
+    // Nodes touched by several runs are still written only once
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    while (first != last) {
+        Status status = this->root.load();
+        if (status < Status::OK) return status;
+
+        status = this->root.insert_run(first, last, nullptr, collide);
+        if (status < Status::OK) return status;
+    }
+
+    return batch.finish(Status::OK);
+}
+
+template <typename K, typename V>
+template <typename I>
+Status BmTree<K, V>::remove_batch(I first, I last, Size &removed) {
+    for (I it = first, prev = first; it != last; prev = it, ++it) {
+        if (*it < *prev) return Status::E_INVALID_ARGUMENT;
+    }
+
+    removed = 0;
+
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    // Values may be larger than V
+    Vector<uint8_t> value_buf;
+    value_buf.resize(this->value_size);
+    auto value = reinterpret_cast<V *>(value_buf.data());
+
+    while (first != last) {
+        Status status = this->root.load();
+        if (status < Status::OK) return status;
+
+        const I before = first;
+        status = this->root.remove_run(first, last, nullptr, removed);
+        if (status < Status::OK) return status;
+
+        if (first != before) continue;
+
+        // The run couldn't make progress, so take the regular route for this key
+        status = this->root.load();
+        if (status < Status::OK) return status;
+
+        status = this->root.remove(*first, value, true);
+        if (status >= Status::OK) ++removed;
+        else if (status != Status::E_NOT_FOUND) return status;
+
+        ++first;
+    }
+
+    return batch.finish(Status::OK);
+}
+
+template <typename K, typename V>
+template <typename I>
+Status BmTree<K, V>::bulk_load(I first, I last, unsigned int fill_percent) {
+    if (fill_percent < 50 || fill_percent > 100) return Status::E_INVALID_ARGUMENT;
+
+    Status status = this->root.load();
+    if (status < Status::OK) return status;
+
+    if (this->root.hdr->level != 0 || this->root.hdr->num_values != 0) return Status::E_EXISTS;
+
+    Size num_records = 0;
+    for (I it = first; it != last; ++it) ++num_records;
+
+    if (num_records == 0) return Status::OK;
+
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    Node<K, V> node(this->fs, 0, this->length, this);
+    Vector<Address> allocated;
+
+    const auto store_node = [&](
+        Address addr, unsigned int level, Size count, Address prev, ChildRef &ref
+    ) {
+        node.addr = addr;
+        node.hdr->level = level;
+        node.hdr->num_values = count;
+        node.prev() = prev;
+
+        ref = {node.get_keys()[count - 1], addr, node.count_subtree()};
+
+        return node.store();
+    };
+
+    const auto write_node = [&](unsigned int level, Size count, Address prev, ChildRef &ref) {
+        // Lay the nodes out one after the other where possible
+        const Address goal = allocated.get_size() > 0 ? allocated.back() + this->length : 0;
+
+        Extent extent;
+        auto status = this->alloc(this->length, extent, goal);
+        if (status < Status::OK) return status;
+
+        allocated.push_back(extent.offset);
+
+        return store_node(extent.offset, level, count, prev, ref);
+    };
+
+    const bool counted = this->root.is_counted();
+    const auto reset_node = [&](unsigned int level) {
+        memset(node.buf, 0, this->length);
+        new (node.hdr) Header(level, 0, counted);
+        node.hdr->size = this->root.hdr->size;
+    };
+
+    // Pack the leaves
+    reset_node(0);
+    const Size leaf_cap = node.template get_cap<V>();
+    const Size per_leaf = max<Size>(1, leaf_cap * fill_percent / 100);
+    const Size num_leaves = updiv(num_records, per_leaf);
+
+    Vector<ChildRef> children;
+    Address prev = 0;
+    I it = first;
+
+    for (Size i = 0; i < num_leaves; ++i) {
+        const Size count = num_records / num_leaves + (i < num_records % num_leaves);
+
+        reset_node(0);
+        auto keys = node.get_keys();
+
+        for (Size j = 0; j < count; ++j, ++it) {
+            const bool sorted = (j == 0 && children.empty())
+                || !(it->key < (j > 0 ? keys[j - 1] : children.back().key));
+            if (!sorted) {
+                status = Status::E_INVALID_ARGUMENT;
+                goto clean_up;
+            }
+
+            keys[j] = it->key;
+            memcpy(node.template get_value<V>(j), it->value, node.get_record_size());
+        }
+
+        ChildRef ref;
+        if (num_leaves == 1) {
+            // Everything fits in the (empty) root
+            return batch.finish(store_node(this->root.addr, 0, count, 0, ref));
+        }
+
+        status = write_node(0, count, prev, ref);
+        if (status < Status::OK) goto clean_up;
+
+        children.push_back(ref);
+        prev = ref.addr;
+    }
+
+    // Build the inner levels on top of the previous one until only the root remains
+    for (unsigned int level = 1; children.get_size() > 1; ++level) {
+        reset_node(level);
+        const Size inner_cap = node.template get_cap<Address>();
+        const Size per_node = max<Size>(2, inner_cap * fill_percent / 100);
+        const Size num_children = children.get_size();
+        const Size num_nodes = updiv(num_children, per_node);
+
+        Vector<ChildRef> parents;
+        prev = 0;
+        Size k = 0;
+
+        for (Size i = 0; i < num_nodes; ++i) {
+            const Size count = num_children / num_nodes + (i < num_children % num_nodes);
+
+            reset_node(level);
+            auto keys = node.get_keys();
+            auto values = node.template get_values<Address>();
+            auto counts = counted ? node.get_counts() : nullptr;
+
+            for (Size j = 0; j < count; ++j, ++k) {
+                keys[j] = children[k].key;
+                values[j] = children[k].addr;
+                if (counted) counts[j] = children[k].count;
+            }
+
+            ChildRef ref;
+            status = write_node(level, count, prev, ref);
+            if (status < Status::OK) goto clean_up;
+
+            parents.push_back(ref);
+            prev = ref.addr;
+        }
+
+        children = parents;
+    }
+
+    {
+        const Extent old_root(this->root.addr, this->length);
+
+        status = this->update_root(children.front().addr);
+        if (status < Status::OK) goto clean_up;
+
+        return batch.finish(this->free(old_root));
+    }
+
+clean_up:
+    for (const auto addr : allocated) (void) this->free({addr, this->length});
+    return batch.finish(status);
 }
 
 template <typename K, typename V>
@@ -168,6 +389,11 @@ Status BmTree<K, V>::count_values(Size &count) {
     Status status = this->root.load();
     if (status < 0) return status;
 
+    if (this->root.is_counted()) {
+        count = this->root.count_subtree();
+        return Status::OK;
+    }
+
     Address leaf_addr;
     status = this->root.get_last_leaf(leaf_addr);
     if (status < 0) return status;
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "../types.hpp"
+#include "../Brufs.hpp"
+#include "btree-search.hpp"
+
+namespace Brufs::BmTree {
+
+template <typename K, typename V>
+Cursor<K, V>::Cursor(BmTree<K, V> &tree) :
+    tree(&tree), leaf(tree.fs, 0, tree.length, &tree), index(0), valid(false)
+{}
+
+template <typename K, typename V>
+Status Cursor<K, V>::descend(Address addr, bool last) {
+    while (true) {
+        this->leaf.addr = addr;
+
+        Status status = this->leaf.load();
+        if (status < Status::OK) return status;
+
+        const unsigned int num_values = this->leaf.hdr->num_values;
+
+        if (this->leaf.hdr->level == 0) {
+            this->index = last && num_values > 0 ? num_values - 1 : 0;
+            this->valid = num_values > 0;
+            return Status::OK;
+        }
+
+        assert(num_values > 0);
+
+        const unsigned int idx = last ? num_values - 1 : 0;
+        this->path.push_back({addr, idx, num_values});
+
+        addr = this->leaf.template get_values<Address>()[idx];
+    }
+}
+
+template <typename K, typename V>
+Status Cursor<K, V>::step(bool forward) {
+    if (!this->valid) return Status::E_NOT_FOUND;
+
+    do {
+        if (forward && this->index + 1 < this->leaf.hdr->num_values) {
+            ++this->index;
+            return Status::OK;
+        }
+
+        if (!forward && this->index > 0) {
+            --this->index;
+            return Status::OK;
+        }
+
+        // Climb until there is a sibling subtree in the right direction
+        while (!this->path.empty()) {
+            auto &step = this->path.back();
+            if (forward ? step.index + 1 < step.num_values : step.index > 0) break;
+
+            this->path.pop_back();
+        }
+
+        if (this->path.empty()) {
+            this->valid = false;
+            return Status::E_NOT_FOUND;
+        }
+
+        auto &step = this->path.back();
+        step.index += forward ? 1 : -1;
+
+        this->leaf.addr = step.addr;
+        Status status = this->leaf.load();
+        if (status < Status::OK) {
+            this->valid = false;
+            return status;
+        }
+
+        const Address child = this->leaf.template get_values<Address>()[step.index];
+
+        status = this->descend(child, !forward);
+        if (status < Status::OK) {
+            this->valid = false;
+            return status;
+        }
+
+        // An empty leaf can only be the root, but don't trust the disk blindly
+        this->valid = true;
+    } while (this->leaf.hdr->num_values == 0);
+
+    return Status::OK;
+}
+
+template <typename K, typename V>
+Status Cursor<K, V>::seek(const K &key) {
+    this->path.clear();
+    this->valid = false;
+
+    Address addr = this->tree->root.addr;
+
+    while (true) {
+        this->leaf.addr = addr;
+
+        Status status = this->leaf.load();
+        if (status < Status::OK) return status;
+
+        const unsigned int num_values = this->leaf.hdr->num_values;
+        auto keys = this->leaf.get_keys();
+
+        if (this->leaf.hdr->level == 0) {
+            if (num_values == 0) return Status::E_NOT_FOUND;
+
+            this->index = lower_bound(keys, num_values, key);
+            if (this->index < num_values) {
+                this->valid = true;
+                return Status::OK;
+            }
+
+            // Every key in this leaf is smaller, so the match is the first key of the next one
+            this->index = num_values - 1;
+            this->valid = true;
+            return this->next();
+        }
+
+        assert(num_values > 0);
+
+        // Separators are the highest key in their left child, so stop at the first one that
+        // isn't smaller than the key to find the leftmost match.
+        const unsigned int idx = lower_bound(keys, num_values - 1, key);
+        this->path.push_back({addr, idx, num_values});
+
+        addr = this->leaf.template get_values<Address>()[idx];
+    }
+}
+
+template <typename K, typename V>
+Status Cursor<K, V>::seek_to_nth(Size rank) {
+    this->path.clear();
+    this->valid = false;
+
+    Address addr = this->tree->root.addr;
+
+    while (true) {
+        this->leaf.addr = addr;
+
+        Status status = this->leaf.load();
+        if (status < Status::OK) return status;
+
+        const unsigned int num_values = this->leaf.hdr->num_values;
+
+        if (this->leaf.hdr->level == 0) {
+            if (rank >= num_values) return Status::E_NOT_FOUND;
+
+            this->index = static_cast<unsigned int>(rank);
+            this->valid = true;
+            return Status::OK;
+        }
+
+        if (!this->leaf.has_counts()) break;
+
+        // Skip every child that lies entirely before the rank
+        auto counts = this->leaf.get_counts();
+
+        unsigned int idx = 0;
+        for (; idx < num_values - 1 && rank >= counts[idx]; ++idx) rank -= counts[idx];
+
+        this->path.push_back({addr, idx, num_values});
+
+        addr = this->leaf.template get_values<Address>()[idx];
+    }
+
+    // Without counts, count from the start
+    Status status = this->seek_first();
+    for (; status == Status::OK && rank > 0; --rank) status = this->next();
+
+    return status;
+}
+
+template <typename K, typename V>
+Status Cursor<K, V>::seek_first() {
+    this->path.clear();
+    this->valid = false;
+
+    Status status = this->descend(this->tree->root.addr, false);
+    if (status < Status::OK) return status;
+
+    return this->valid ? Status::OK : Status::E_NOT_FOUND;
+}
+
+template <typename K, typename V>
+Status Cursor<K, V>::seek_last() {
+    this->path.clear();
+    this->valid = false;
+
+    Status status = this->descend(this->tree->root.addr, true);
+    if (status < Status::OK) return status;
+
+    return this->valid ? Status::OK : Status::E_NOT_FOUND;
+}
+
+}
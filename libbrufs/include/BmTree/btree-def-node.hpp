@@ -28,6 +28,7 @@
 #include "../types.hpp"
 #include "../io.hpp"
 #include "../Brufs.hpp"
+#include "btree-search.hpp"
 
 namespace Brufs::BmTree {
 
@@ -37,7 +38,7 @@ Node<K, V>::Node(Brufs *fs, Address addr, Size length, BmTree<K, V> *container,
     fs(fs), addr(addr), length(length), container(container), parent(parent),
     index_in_parent(index_in_parent)
 {
-    this->buf = static_cast<char *>(malloc(length));
+    this->buf = take_buffer(container, length);
     this->hdr = reinterpret_cast<Header *>(this->buf);
 }
 
@@ -54,16 +55,40 @@ Node<K, V>::Node(const Node<K, V> &other) :
     Node(other.fs, other.addr, other.length, other.container, other.parent)
 {}
 
+template<typename K, typename V>
+Node<K, V>::Node(Node<K, V> &&other) :
+    fs(other.fs), addr(other.addr), length(other.length), container(other.container),
+    buf(other.buf), hdr(other.hdr), parent(other.parent), index_in_parent(other.index_in_parent)
+{
+    other.buf = nullptr;
+    other.hdr = nullptr;
+}
+
 template <typename K, typename V>
 Node<K, V>::~Node() {
-    free(this->buf);
+    this->release_buffer();
+}
+
+template <typename K, typename V>
+char *Node<K, V>::take_buffer(BmTree<K, V> *container, Size length) {
+    if (!container) return static_cast<char *>(malloc(length));
+    return container->buffers.take(length);
+}
+
+template <typename K, typename V>
+void Node<K, V>::release_buffer() {
+    if (this->container) this->container->buffers.give(this->buf, this->length);
+    else free(this->buf);
+
+    this->buf = nullptr;
+    this->hdr = nullptr;
 }
 
 template<typename K, typename V>
 Node<K, V> &Node<K, V>::operator=(const Node<K, V> &other) {
     if (this->length != other.length || !this->buf) {
-        this->~Node();
-        this->buf = static_cast<char *>(malloc(other.length));
+        this->release_buffer();
+        this->buf = take_buffer(other.container, other.length);
         this->hdr = reinterpret_cast<Header *>(this->buf);
     }
 
@@ -76,10 +101,31 @@ Node<K, V> &Node<K, V>::operator=(const Node<K, V> &other) {
     return *this;
 }
 
+template<typename K, typename V>
+Node<K, V> &Node<K, V>::operator=(Node<K, V> &&other) {
+    if (this == &other) return *this;
+
+    this->release_buffer();
+
+    this->fs = other.fs;
+    this->addr = other.addr;
+    this->length = other.length;
+    this->container = other.container;
+    this->buf = other.buf;
+    this->hdr = other.hdr;
+    this->parent = other.parent;
+    this->index_in_parent = other.index_in_parent;
+
+    other.buf = nullptr;
+    other.hdr = nullptr;
+
+    return *this;
+}
+
 template <typename K, typename V>
-Status Node<K, V>::init() {
+Status Node<K, V>::init(bool counted) {
     memset(this->buf, 0, this->length);
-    new (this->hdr) Header;
+    new (this->hdr) Header(0, 0, counted);
     this->hdr->size = next_multiple_of(this->hdr->size, alignof(K));
     this->hdr->size = this->hdr->size >= sizeof(K) ? this->hdr->size : sizeof(K);
 
@@ -95,7 +141,10 @@ template<typename K, typename V>
 template <typename R>
 auto Node<K, V>::get_cap() {
     auto usable = (this->length - this->hdr->size - sizeof(Address));
-    return usable / next_multiple_of(sizeof(K) + this->get_record_size(), alignof(R));
+    auto entry_size = sizeof(K) + this->get_record_size();
+    if (this->has_counts()) entry_size += sizeof(Size);
+
+    return usable / next_multiple_of(entry_size, alignof(R));
 }
 
 template<typename K, typename V>
@@ -130,14 +179,85 @@ Address &Node<K, V>::prev() {
     return *this->get_link();
 }
 
+template <typename K, typename V>
+bool Node<K, V>::is_rightmost() const {
+    for (auto node = this; node->parent != nullptr; node = node->parent) {
+        if (node->index_in_parent != node->parent->hdr->num_values - 1) return false;
+    }
+
+    return true;
+}
+
+template <typename K, typename V>
+bool Node<K, V>::is_counted() const {
+    return this->hdr->magic[1] == '#';
+}
+
+template <typename K, typename V>
+bool Node<K, V>::has_counts() const {
+    return this->hdr->level > 0 && this->is_counted();
+}
+
+template <typename K, typename V>
+Size *Node<K, V>::get_counts() {
+    assert(this->has_counts());
+
+    return reinterpret_cast<Size *>(
+        this->buf + this->length - sizeof(Address) - this->get_cap<Address>() * sizeof(Size)
+    );
+}
+
+template <typename K, typename V>
+Size Node<K, V>::count_subtree() {
+    if (!this->has_counts()) return this->hdr->num_values;
+
+    auto counts = this->get_counts();
+
+    Size count = 0;
+    for (unsigned int i = 0; i < this->hdr->num_values; ++i) count += counts[i];
+
+    return count;
+}
+
+template <typename K, typename V>
+bool Node<K, V>::update_count(Node<K, V> &child) {
+    auto values = this->get_values<Address>();
+
+    // Splits further down may have shifted the child
+    unsigned int idx = child.index_in_parent;
+    if (idx >= this->hdr->num_values || values[idx] != child.addr) {
+        for (idx = 0; idx < this->hdr->num_values && values[idx] != child.addr; ++idx);
+        if (idx >= this->hdr->num_values) return false;
+    }
+
+    auto counts = this->get_counts();
+    const auto count = child.count_subtree();
+    if (counts[idx] == count) return false;
+
+    counts[idx] = count;
+    return true;
+}
+
+template <typename K, typename V>
+Status Node<K, V>::refresh_count(Node<K, V> &child, Address self) {
+    // If this node was replaced as the root or freed in a merge, the structural change has
+    // already stored exact counts for everything that is left.
+    if (this->addr != self || child.addr == 0 || !this->has_counts()) return Status::OK;
+
+    if (!this->update_count(child)) return Status::OK;
+    return this->store();
+}
+
 template<typename K, typename V>
 Status Node<K, V>::load() {
     assert(this->buf);
 
-    SSize status = dread(this->fs->get_disk(), this->buf, this->length, this->addr);
-    if (status < 0) return static_cast<::Brufs::Status>(status);
+    Status status = this->fs->get_cache().read(this->addr, this->length, this->buf);
+    if (status < 0) return status;
 
-    if (memcmp(this->hdr->magic, "B+", 2) != 0) return Status::E_BAD_MAGIC;
+    if (memcmp(this->hdr->magic, "B+", 2) != 0 && memcmp(this->hdr->magic, "B#", 2) != 0) {
+        return Status::E_BAD_MAGIC;
+    }
     if (this->hdr->size % 8 > 0) return Status::E_MISALIGNED;
 
     return Status::OK;
@@ -145,23 +265,15 @@ Status Node<K, V>::load() {
 
 template<typename K, typename V>
 Status Node<K, V>::store() {
-
-    SSize status = dwrite(this->fs->get_disk(), this->buf, this->length, this->addr);
-    if (status < 0) return static_cast<::Brufs::Status>(status);
-
-    return Status::OK;
+    return this->fs->get_cache().write(this->addr, this->length, this->buf);
 }
 
 template<typename K, typename V>
 void Node<K, V>::locate(const K &key, unsigned int &result) {
     assert(this->hdr->num_values > 0);
 
-    auto keys = this->get_keys();
-
-    unsigned int i = 0;
-    for (; i < (this->hdr->num_values - 1) && key >= keys[i]; ++i);
-
-    result = i;
+    // The last key of an inner node is never compared against
+    result = upper_bound(this->get_keys(), this->hdr->num_values - 1, key);
 }
 
 template<typename K, typename V>
@@ -169,14 +281,17 @@ Status Node<K, V>::locate_in_leaf(const K &key, unsigned int &result) {
     assert(this->hdr->level == 0);
     assert(this->hdr->num_values > 0);
 
-    auto keys = this->get_keys();
+    const auto keys = this->get_keys();
+    const auto num_values = this->hdr->num_values;
 
-    unsigned int i = 0;
-    for (; i < this->hdr->num_values && key > keys[i]; ++i);
-    while (i < this->hdr->num_values - 1 && key == keys[i + 1]) ++i;
+    unsigned int i = lower_bound(keys, num_values, key);
+    if (i < num_values && keys[i] == key) {
+        // Point to the last of the matching keys
+        i += upper_bound(keys + i, num_values - i, key) - 1;
+    }
 
     result = i;
-    if (i >= this->hdr->num_values) return Status::E_NOT_FOUND;
+    if (i >= num_values) return Status::E_NOT_FOUND;
 
     return Status::OK;
 }
@@ -186,13 +301,14 @@ Status Node<K, V>::locate_in_leaf_strict(const K &key, unsigned int &result) {
     assert(this->hdr->level == 0);
     assert(this->hdr->num_values > 0);
 
-    auto keys = this->get_keys();
+    const auto keys = this->get_keys();
+    const auto num_values = this->hdr->num_values;
 
-    unsigned int i = 0;
-    for (; i < this->hdr->num_values && key != keys[i]; ++i);
+    unsigned int i = lower_bound(keys, num_values, key);
+    if (i < num_values && keys[i] != key) i = num_values;
 
     result = i;
-    if (i >= this->hdr->num_values) return Status::E_NOT_FOUND;
+    if (i >= num_values) return Status::E_NOT_FOUND;
 
     return Status::OK;
 }
@@ -334,7 +450,9 @@ Status Node<K, V>::get_last(V *value) {
 }
 
 template<typename K, typename V>
-Status Node<K, V>::insert_initial(const K &key, Address left, Address right) {
+Status Node<K, V>::insert_initial(
+    const K &key, Address left, Address right, Size left_count, Size right_count
+) {
     this->hdr->num_values = 2;
 
     auto keys = this->get_keys();
@@ -344,6 +462,11 @@ Status Node<K, V>::insert_initial(const K &key, Address left, Address right) {
     values[0] = left;
     values[1] = right;
 
+    if (this->has_counts()) {
+        this->get_counts()[0] = left_count;
+        this->get_counts()[1] = right_count;
+    }
+
     this->prev() = 0;
 
     return this->store();
@@ -351,26 +474,33 @@ Status Node<K, V>::insert_initial(const K &key, Address left, Address right) {
 
 template <typename K, typename V>
 template <typename R>
-Status Node<K, V>::split(const K &key, const R *value, const unsigned int idx) {
+Status Node<K, V>::split(const K &key, const R *value, const unsigned int idx, Size count) {
     Status status;
 
     auto keys = this->get_keys();
     auto values = this->get_values<R>();
 
-    auto num_left = this->hdr->num_values / 2;
-    auto num_right = this->hdr->num_values - num_left;
+    // Monotonically increasing keys (inode IDs, file offsets) only ever land in the rightmost
+    // nodes, so leave the left half nearly full when appending there. Inner nodes receive the
+    // new sibling just before their last child.
+    const unsigned int num_values = this->hdr->num_values;
+    const unsigned int append_idx = this->hdr->level > 0 ? num_values - 1 : num_values;
+    const bool appending = idx >= append_idx && this->is_rightmost();
+
+    auto num_left = appending ? num_values * APPEND_SPLIT_PERCENT / 100 : num_values / 2;
+    auto num_right = num_values - num_left;
 
     this->hdr->num_values = num_right;
 
     Extent sibling_extent;
-    status = this->container->alloc(this->length, sibling_extent);
+    status = this->container->alloc(this->length, sibling_extent, this->addr + this->length);
     if (status < 0) return status;
 
     Node<K, V> sibling(
         this->fs, sibling_extent.offset, this->length, this->container, this
     );
     memset(sibling.buf, 0, this->length);
-    new (sibling.hdr) Header(this->hdr->level, num_left);
+    new (sibling.hdr) Header(this->hdr->level, num_left, this->is_counted());
     sibling.hdr->size = this->hdr->size;
 
     auto sibling_keys = sibling.get_keys();
@@ -379,27 +509,43 @@ Status Node<K, V>::split(const K &key, const R *value, const unsigned int idx) {
     memcpy(sibling_keys, keys, num_left * sizeof(K));
     memcpy(sibling_values, values, num_left * this->get_record_size());
 
+    memmove(keys, keys + num_left, num_right * sizeof(K));
+    memmove(values, this->get_value<R>(num_left), num_right * this->get_record_size());
+
+    if (this->has_counts()) {
+        auto counts = this->get_counts();
+        memcpy(sibling.get_counts(), counts, num_left * sizeof(Size));
+        memmove(counts, counts + num_left, num_right * sizeof(Size));
+    }
+
     sibling.prev() = this->prev();
     this->prev() = sibling_extent.offset;
 
-    status = sibling.store();
-    if (status < 0) {
-        (void) this->container->free(sibling_extent);
-        return status;
+    // Insert the new value before linking the sibling, so the separator and subtree counts handed
+    // to the parent are final.
+    if (idx <= num_left) {
+        status = sibling.insert_direct_at<R>(key, value, idx, false, count);
+        if (status >= 0) status = this->store();
+    } else {
+        status = sibling.store();
+        if (status >= 0) status = this->insert_direct_at<R>(key, value, idx - num_left, false, count);
     }
 
-    memmove(keys, keys + num_left, num_right * sizeof(K));
-    memmove(values, this->get_value<R>(num_left), num_right * this->get_record_size());
-
-    status = this->store();
     if (status < 0) {
         (void) this->container->free(sibling_extent);
         return status;
     }
 
+    const K separator = sibling_keys[sibling.hdr->num_values - 1];
+
     if (this->parent != nullptr) {
+        if (this->parent->has_counts()) {
+            this->parent->get_counts()[this->index_in_parent] = this->count_subtree();
+        }
+
         status = this->parent->insert_direct_at<Address>(
-            sibling_keys[num_left - 1], &sibling_extent.offset, this->index_in_parent
+            separator, &sibling_extent.offset, this->index_in_parent, false,
+            sibling.count_subtree()
         );
         if (status < 0) {
             (void) this->container->free(sibling_extent);
@@ -408,41 +554,30 @@ Status Node<K, V>::split(const K &key, const R *value, const unsigned int idx) {
 
         ++this->index_in_parent;
 
-        if (idx <= num_left) {
-            return sibling.insert_direct_at<R>(key, value, idx);
-        }
-
-        return this->insert_direct_at<R>(key, value, idx - num_left);
+        return Status::OK;
     } else {
         Extent parent_extent;
-        status = this->container->alloc(this->length, parent_extent);
+        status = this->container->alloc(this->length, parent_extent, this->addr);
         if (status < 0) {
             (void) this->container->free(sibling_extent);
             return status;
         }
 
         // Create a new parent
-        Node<K, V> pstor(
+        Node<K, V> new_root(
             this->fs, parent_extent.offset, this->length, this->container
         );
-        this->parent = &pstor;
 
-        memset(this->parent->buf, 0, this->length);
-        new (this->parent->hdr) Header(this->hdr->level + 1);
-        this->parent->hdr->size = this->hdr->size;
+        memset(new_root.buf, 0, this->length);
+        new (new_root.hdr) Header(this->hdr->level + 1, 0, this->is_counted());
+        new_root.hdr->size = this->hdr->size;
 
-        status = this->parent->insert_initial(
-            sibling_keys[num_left - 1], sibling_extent.offset, this->addr
+        status = new_root.insert_initial(
+            separator, sibling_extent.offset, this->addr,
+            sibling.count_subtree(), this->count_subtree()
         );
         if (status < 0) return status;
 
-        if (idx <= num_left) {
-            status = sibling.insert_direct_at<R>(key, value, idx);
-        } else {
-            status = this->insert_direct_at<R>(key, value, idx - num_left);
-        }
-        if (status < 0) return status;
-
         return this->container->update_root(parent_extent.offset);
     }
 }
@@ -459,9 +594,11 @@ Status Node<K, V>::insert_direct(const K &key, const R *value, bool collide) {
 
 template <typename K, typename V>
 template <typename R>
-Status Node<K, V>::insert_direct_at(const K &key, const R *value, unsigned int idx, bool collide) {
+Status Node<K, V>::insert_direct_at(
+    const K &key, const R *value, unsigned int idx, bool collide, Size count
+) {
     auto key_cap = this->get_cap<R>();
-    if (this->hdr->num_values >= key_cap) return this->split<R>(key, value, idx);
+    if (this->hdr->num_values >= key_cap) return this->split<R>(key, value, idx, count);
 
     auto keys = this->get_keys();
 
@@ -483,6 +620,12 @@ Status Node<K, V>::insert_direct_at(const K &key, const R *value, unsigned int i
     );
     memcpy(this->get_value<R>(idx), value, this->get_record_size());
 
+    if (this->has_counts()) {
+        auto counts = this->get_counts();
+        memmove(counts + idx + 1, counts + idx, (this->hdr->num_values - idx) * sizeof(Size));
+        counts[idx] = count;
+    }
+
     ++this->hdr->num_values;
 
     return this->store();
@@ -504,6 +647,8 @@ Status Node<K, V>::insert(const K &key, const V *value, bool collide) {
 
     if (this->hdr->level > 0) {
         // This is an inner node, insert the node into the next
+        const Address self = this->addr;
+
         unsigned int idx;
         this->locate(key, idx);
 
@@ -514,12 +659,177 @@ Status Node<K, V>::insert(const K &key, const V *value, bool collide) {
         Status status = subtree.load();
         if (status < 0) return status;
 
-        return subtree.insert(key, value, collide);
+        status = subtree.insert(key, value, collide);
+        if (status < 0) return status;
+
+        return this->refresh_count(subtree, self);
     }
 
     return this->insert_direct<V>(key, value, collide);
 }
 
+template <typename K, typename V>
+template <typename I, typename G, typename R>
+Status Node<K, V>::run_children(I &it, I last, const K *bound, G get_key, R run_child) {
+    assert(this->hdr->level > 0);
+
+    const Address self = this->addr;
+    auto keys = this->get_keys();
+    auto values = this->get_values<Address>();
+
+    bool dirty = false;
+    Status status = Status::OK;
+
+    while (it != last && (bound == nullptr || get_key(it) < *bound)) {
+        unsigned int idx;
+        this->locate(get_key(it), idx);
+
+        // Everything below the separator goes into the same child
+        const bool is_last = idx == this->hdr->num_values - 1;
+        const K child_bound = is_last ? K() : keys[idx];
+        const K *child_bound_ptr = is_last ? bound : &child_bound;
+
+        Node<K, V> child(this->fs, values[idx], this->length, this->container, this, idx);
+        status = child.load();
+        if (status < Status::OK) break;
+
+        status = run_child(child, child_bound_ptr);
+
+        // If this node was replaced as the root or freed in a merge, the structural change has
+        // already stored exact counts for everything that is left.
+        if (this->addr != self) return status;
+        if (status < Status::OK) break;
+
+        if (child.addr != 0 && this->has_counts()) dirty |= this->update_count(child);
+
+        // The tree was restructured, so the caller has to descend again
+        if (status == Status::RETRY) break;
+    }
+
+    if (dirty) {
+        Status store_status = this->store();
+        if (store_status < Status::OK) return store_status;
+    }
+
+    return status;
+}
+
+template <typename K, typename V>
+template <typename I>
+Status Node<K, V>::insert_run(I &it, I last, const K *bound, bool collide) {
+    if (this->hdr->level > 0) {
+        return this->run_children(
+            it, last, bound,
+            [](const I &i) { return i->key; },
+            [&](Node<K, V> &child, const K *child_bound) {
+                return child.insert_run(it, last, child_bound, collide);
+            }
+        );
+    }
+
+    const auto cap = this->get_cap<V>();
+    auto keys = this->get_keys();
+
+    bool dirty = false;
+    Status status = Status::OK;
+
+    for (; it != last && (bound == nullptr || it->key < *bound); ++it) {
+        if (this->hdr->num_values >= cap) {
+            // Let the regular insertion split the leaf
+            if (dirty) {
+                status = this->store();
+                if (status < Status::OK) return status;
+            }
+
+            status = this->insert_direct<V>(it->key, it->value, collide);
+            if (status < Status::OK) return status;
+
+            ++it;
+            return Status::RETRY;
+        }
+
+        unsigned int idx = 0;
+        if (this->hdr->num_values > 0) (void) this->locate_in_leaf(it->key, idx);
+
+        if (collide && idx < this->hdr->num_values && keys[idx] == it->key) {
+            status = Status::E_EXISTS;
+            break;
+        }
+
+        const auto num_after = this->hdr->num_values - idx;
+        memmove(keys + idx + 1, keys + idx, num_after * sizeof(K));
+        memmove(
+            this->get_value<V>(idx + 1), this->get_value<V>(idx),
+            num_after * this->get_record_size()
+        );
+
+        keys[idx] = it->key;
+        memcpy(this->get_value<V>(idx), it->value, this->get_record_size());
+
+        ++this->hdr->num_values;
+        dirty = true;
+    }
+
+    if (dirty) {
+        Status store_status = this->store();
+        if (store_status < Status::OK) return store_status;
+    }
+
+    return status;
+}
+
+template <typename K, typename V>
+template <typename I>
+Status Node<K, V>::remove_run(I &it, I last, const K *bound, Size &removed) {
+    if (this->hdr->level > 0) {
+        return this->run_children(
+            it, last, bound,
+            [](const I &i) { return *i; },
+            [&](Node<K, V> &child, const K *child_bound) {
+                return child.remove_run(it, last, child_bound, removed);
+            }
+        );
+    }
+
+    // Like a single remove, only leaves that would end up less than half full need a merge
+    const Size min_values = this->parent != nullptr ? this->get_cap<V>() / 2 : 0;
+    auto keys = this->get_keys();
+
+    bool dirty = false;
+    Status status = Status::OK;
+
+    for (; it != last && (bound == nullptr || *it < *bound); ++it) {
+        unsigned int idx;
+        const bool found = this->hdr->num_values > 0
+            && this->locate_in_leaf_strict(*it, idx) >= Status::OK;
+
+        // Keys this leaf can't resolve on its own are left to the caller: they may be stored in
+        // the previous leaf, or removing them may take the leaf below the minimum.
+        if (!found || this->hdr->num_values - 1 < min_values) {
+            status = Status::RETRY;
+            break;
+        }
+
+        const auto num_after = this->hdr->num_values - idx - 1;
+        memmove(keys + idx, keys + idx + 1, num_after * sizeof(K));
+        memmove(
+            this->get_value<V>(idx), this->get_value<V>(idx + 1),
+            num_after * this->get_record_size()
+        );
+
+        --this->hdr->num_values;
+        ++removed;
+        dirty = true;
+    }
+
+    if (dirty) {
+        Status store_status = this->store();
+        if (store_status < Status::OK) return store_status;
+    }
+
+    return status;
+}
+
 template <typename K, typename V>
 Status Node<K, V>::update(const K &key, const V *value) {
     if (this->hdr->num_values == 0) return Status::E_NOT_FOUND;
@@ -599,6 +909,12 @@ Status Node<K, V>::adopt(Node<K, V> *adoptee) {
     memcpy(keys, adoptee->get_keys(), num_left * sizeof(K));
     memcpy(values, adoptee->get_values<R>(), num_left * this->get_record_size());
 
+    if (this->has_counts()) {
+        auto counts = this->get_counts();
+        memmove(counts + num_left, counts, num_right * sizeof(Size));
+        memcpy(counts, adoptee->get_counts(), num_left * sizeof(Size));
+    }
+
     this->hdr->num_values += num_left;
     this->prev() = adoptee->prev();
 
@@ -608,10 +924,19 @@ Status Node<K, V>::adopt(Node<K, V> *adoptee) {
 
     assert(this->parent);
 
+    if (this->parent->has_counts()) {
+        this->parent->get_counts()[this->index_in_parent] = this->count_subtree();
+    }
+
     status = this->parent->remove_direct<Address>(adoptee->index_in_parent);
     if (status < 0) return status;
 
-    return this->container->free({adoptee->addr, adoptee->length});
+    if (this->index_in_parent > adoptee->index_in_parent) --this->index_in_parent;
+
+    const Extent adoptee_extent {adoptee->addr, adoptee->length};
+    adoptee->addr = 0;
+
+    return this->container->free(adoptee_extent);
 }
 
 template <typename K, typename V>
@@ -631,6 +956,12 @@ Status Node<K, V>::abduct_highest(Node<K, V> &node) {
     keys[0] = node.get_keys()[node.hdr->num_values];
     memcpy(values, node.get_value<R>(node.hdr->num_values), this->get_record_size());
 
+    if (this->has_counts()) {
+        auto counts = this->get_counts();
+        memmove(counts + 1, counts, this->hdr->num_values * sizeof(Size));
+        counts[0] = node.get_counts()[node.hdr->num_values];
+    }
+
     ++this->hdr->num_values;
 
     // Write the new nodes to disk
@@ -644,6 +975,13 @@ Status Node<K, V>::abduct_highest(Node<K, V> &node) {
     auto parent_keys = this->parent->get_keys();
     auto node_keys = node.get_keys();
     parent_keys[node.index_in_parent] = node_keys[node.hdr->num_values - 1];
+
+    if (this->parent->has_counts()) {
+        auto parent_counts = this->parent->get_counts();
+        parent_counts[node.index_in_parent] = node.count_subtree();
+        parent_counts[this->index_in_parent] = this->count_subtree();
+    }
+
     return this->parent->store();
 }
 
@@ -661,6 +999,12 @@ Status Node<K, V>::abduct_lowest(Node<K, V> &node) {
     keys[this->hdr->num_values] = victim_keys[0];
     memcpy(this->get_value<R>(this->hdr->num_values), victim_values, this->get_record_size());
 
+    if (this->has_counts()) {
+        auto victim_counts = node.get_counts();
+        this->get_counts()[this->hdr->num_values] = victim_counts[0];
+        memmove(victim_counts, victim_counts + 1, node.hdr->num_values * sizeof(Size));
+    }
+
     ++this->hdr->num_values;
 
     memmove(victim_keys, victim_keys + 1, node.hdr->num_values * sizeof(K));
@@ -674,6 +1018,13 @@ Status Node<K, V>::abduct_lowest(Node<K, V> &node) {
 
     auto parent_keys = this->parent->get_keys();
     parent_keys[this->index_in_parent] = keys[this->hdr->num_values - 1];
+
+    if (this->parent->has_counts()) {
+        auto parent_counts = this->parent->get_counts();
+        parent_counts[this->index_in_parent] = this->count_subtree();
+        parent_counts[node.index_in_parent] = node.count_subtree();
+    }
+
     return this->parent->store();
 }
 
@@ -710,6 +1061,11 @@ Status Node<K, V>::remove_direct(unsigned int idx) {
         (this->hdr->num_values - idx) * this->get_record_size()
     );
 
+    if (this->has_counts()) {
+        auto counts = this->get_counts();
+        memmove(counts + idx, counts + idx + 1, (this->hdr->num_values - idx) * sizeof(Size));
+    }
+
     auto value_cap = this->get_cap<R>();
 
     // If the node is full enough or is the only node in the tree, just save and return.
@@ -776,11 +1132,27 @@ Status Node<K, V>::remove(const K &key, V *value, bool strict) {
 
     if (this->hdr->level > 0) {
         // This is an inner node, look up the address of the next node
+        const Address self = this->addr;
         auto values = this->get_values<Address>();
 
         unsigned int idx;
         this->locate(key, idx);
 
+        // Separators are the highest key in their left child, so an exact match may be stored
+        // one child to the left of where locate() goes.
+        if (strict && idx > 0 && this->get_keys()[idx - 1] == key) {
+            Node<K, V> left(
+                this->fs, values[idx - 1], this->length, this->container, this, idx - 1
+            );
+
+            Status status = left.load();
+            if (status < 0) return status;
+
+            status = left.remove(key, value, strict);
+            if (status >= 0) return this->refresh_count(left, self);
+            if (status != Status::E_NOT_FOUND) return status;
+        }
+
         Node<K, V> subtree(
             this->fs, values[idx], this->length, this->container, this, idx
         );
@@ -788,7 +1160,10 @@ Status Node<K, V>::remove(const K &key, V *value, bool strict) {
         Status status = subtree.load();
         if (status < 0) return status;
 
-        return subtree.remove(key, value, strict);
+        status = subtree.remove(key, value, strict);
+        if (status < 0) return status;
+
+        return this->refresh_count(subtree, self);
     }
 
     unsigned int idx;
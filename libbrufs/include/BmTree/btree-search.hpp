@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <type_traits>
+
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#  include <immintrin.h>
+#endif
+
+namespace Brufs::BmTree {
+
+/**
+ * The number of keys below which a search switches from bisection to a (vectorized) scan.
+ */
+static constexpr unsigned int SEARCH_WINDOW = 16;
+
+/**
+ * Counts the keys in a small window that are lower than the search key (if STRICT) or
+ * lower than or equal to the search key (if not STRICT).
+ *
+ * This is the portable version, which the compiler turns into branch-free code.
+ */
+template <bool STRICT, typename K>
+static inline unsigned int count_in_window(const K *keys, unsigned int num, const K &key) {
+    unsigned int count = 0;
+
+    for (unsigned int i = 0; i < num; ++i) {
+        count += STRICT ? (keys[i] < key) : !(key < keys[i]);
+    }
+
+    return count;
+}
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+
+/**
+ * Counts the 64-bit keys in a small window that are lower than (or equal to) the search key,
+ * comparing multiple keys at once.
+ *
+ * There is no unsigned 64-bit comparison, so unsigned keys are biased into the signed range.
+ */
+template <bool STRICT, typename K>
+static inline unsigned int count_in_window_simd(const K *keys, unsigned int num, const K &key) {
+    static_assert(sizeof(K) == sizeof(int64_t));
+
+    const int64_t bias = std::is_unsigned<K>::value ? INT64_MIN : 0;
+    const int64_t needle = static_cast<int64_t>(key) ^ bias;
+
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+#ifdef __AVX2__
+    const __m256i vbias = _mm256_set1_epi64x(bias);
+    const __m256i vneedle = _mm256_set1_epi64x(needle);
+
+    for (; i + 4 <= num; i += 4) {
+        const __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i));
+        const __m256i vkeys = _mm256_xor_si256(raw, vbias);
+
+        // STRICT: key > keys[i]; otherwise keys[i] > key, which is subtracted below
+        const __m256i cmp = STRICT
+            ? _mm256_cmpgt_epi64(vneedle, vkeys)
+            : _mm256_cmpgt_epi64(vkeys, vneedle);
+
+        const auto mask = _mm256_movemask_pd(_mm256_castsi256_pd(cmp));
+        count += STRICT ? __builtin_popcount(mask) : 4 - __builtin_popcount(mask);
+    }
+#else
+    const __m128i vbias = _mm_set1_epi64x(bias);
+    const __m128i vneedle = _mm_set1_epi64x(needle);
+
+    for (; i + 2 <= num; i += 2) {
+        const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i));
+        const __m128i vkeys = _mm_xor_si128(raw, vbias);
+
+        const __m128i cmp = STRICT
+            ? _mm_cmpgt_epi64(vneedle, vkeys)
+            : _mm_cmpgt_epi64(vkeys, vneedle);
+
+        const auto mask = _mm_movemask_pd(_mm_castsi128_pd(cmp));
+        count += STRICT ? __builtin_popcount(mask) : 2 - __builtin_popcount(mask);
+    }
+#endif
+
+    return count + count_in_window<STRICT>(keys + i, num - i, key);
+}
+
+#endif
+
+/**
+ * Counts the keys in a sorted array that are lower than the search key (if STRICT) or lower than
+ * or equal to the search key (if not STRICT).
+ *
+ * The array is bisected without branching until the remaining window is small enough to scan.
+ * 64-bit integer keys (Size, Hash, Address, ...) are scanned using SSE4.2 or AVX2 if the
+ * library is compiled with support for either.
+ *
+ * @param keys the sorted keys
+ * @param num the number of keys
+ * @param key the key to search for
+ *
+ * @return the number of keys before the search key
+ */
+template <bool STRICT, typename K>
+static inline unsigned int count_before(const K *keys, unsigned int num, const K &key) {
+    const K *base = keys;
+
+    while (num > SEARCH_WINDOW) {
+        const auto half = num / 2;
+        const K &pivot = base[half - 1];
+
+        base = (STRICT ? (pivot < key) : !(key < pivot)) ? base + half : base;
+        num -= half;
+    }
+
+    const unsigned int skipped = base - keys;
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+    if constexpr (std::is_integral<K>::value && sizeof(K) == sizeof(int64_t)) {
+        return skipped + count_in_window_simd<STRICT>(base, num, key);
+    }
+#endif
+
+    return skipped + count_in_window<STRICT>(base, num, key);
+}
+
+/**
+ * Returns the index of the first key not lower than the search key.
+ */
+template <typename K>
+static inline unsigned int lower_bound(const K *keys, unsigned int num, const K &key) {
+    return count_before<true>(keys, num, key);
+}
+
+/**
+ * Returns the index of the first key greater than the search key.
+ */
+template <typename K>
+static inline unsigned int upper_bound(const K *keys, unsigned int num, const K &key) {
+    return count_before<false>(keys, num, key);
+}
+
+}
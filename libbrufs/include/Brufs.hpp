@@ -23,12 +23,16 @@
 #pragma once
 
 #include "types.hpp"
+#include "AllocGroup.hpp"
+#include "BlockCache.hpp"
 #include "Disk.hpp"
 #include "Header.hpp"
+#include "Mutex.hpp"
 #include "Inode.hpp"
 #include "Root.hpp"
 #include "RootHeader.hpp"
 #include "Status.hpp"
+#include "Vector.hpp"
 #include "Version.hpp"
 #include "BmTree/btree-decl.hpp"
 
@@ -71,6 +75,10 @@ public:
  *
  * This is the main handle for the entire libary. It represents the super-root of all roots,
  * contains the master header and provides free block management.
+ *
+ * Free block management, the root hash table and the block cache may be used from multiple
+ * threads at once. The trees of a single inode are not protected; callers must serialize
+ * operations on the same inode themselves.
  */
 class Brufs {
 private:
@@ -79,6 +87,17 @@ private:
      */
     Disk *dsk;
 
+    /**
+     * The cache for tree nodes, shared by every tree on the disk.
+     */
+    BlockCache cache;
+
+    /**
+     * Guards the header, the first allocation group and the root hash table, which are shared
+     * by every root.
+     */
+    Mutex lock;
+
     union {
         /**
          * The filesystem header as a raw set of bytes.
@@ -93,13 +112,6 @@ private:
         Header *hdr;
     };
 
-    /**
-     * The free blocks tree.
-     *
-     * This tree stores free extents on the disk indexed by their size.
-     */
-    FsCTree<Size, Extent> fbt;
-
     /**
      * The root hash table.
      *
@@ -115,33 +127,142 @@ private:
     Status stt = Status::OK;
 
     /**
-     * Returns the start of the list of reserved clusters.
+     * The allocation groups of the disk, at least one.
+     */
+    AllocGroup **groups = nullptr;
+
+    /**
+     * The number of allocation groups.
+     */
+    unsigned int num_groups = 0;
+
+    /**
+     * Whether the in-memory header holds changes that haven't been written yet.
+     */
+    bool header_dirty = false;
+
+    /**
+     * A freed extent waiting for the batch that freed it to be written.
+     */
+    struct PendingDiscard {
+        Extent extent;
+
+        /**
+         * The number of the thread whose batch freed the extent.
+         */
+        unsigned int thread;
+    };
+
+    /**
+     * Guards #pending_discards and #committed_discards.
+     */
+    Mutex discard_lock;
+
+    /**
+     * Freed extents to discard once the batch that freed them has been written.
+     */
+    Vector<PendingDiscard> pending_discards;
+
+    /**
+     * Freed extents that a written header no longer uses, ready to be discarded.
+     */
+    Vector<Extent> committed_discards;
+
+    /**
+     * Marks the header as changed and writes it to disk.
      *
-     * The size of the list is determined by this->hdr->sc_count.
+     * While a batch is open, the header is only written once the outermost batch ends, after the
+     * blocks written in it, so every batch rewrites the first cluster at most once.
      *
-     * @return the reserved clusters
+     * @return the status
      */
-    Extent *get_spare_clusters() {
-        return reinterpret_cast<Extent *>(this->raw_header + this->hdr->header_size);
-    }
+    Status store_header();
 
     /**
-     * Writes the entire header to disk.
+     * Writes the entire header to disk if it has unwritten changes.
      *
      * @return the status
      */
-    Status store_header();
+    Status write_header();
+
+    /**
+     * The block cache commit hook, writing the header of the filesystem passed as the context and
+     * discarding the extents freed in the batch.
+     *
+     * Waits for the filesystem lock; allocation groups only take it while holding their own lock
+     * from within a batch of the filesystem, so they never commit while holding it.
+     */
+    static Status commit_batch(void *fs);
+
+    /**
+     * Queues a freed extent to be discarded when the current batch has been written.
+     *
+     * @param ext the extent
+     */
+    void queue_discard(const Extent &ext);
+
+    /**
+     * Drops the queued discards overlapping an extent that is being allocated again.
+     *
+     * @param ext the extent
+     */
+    void cancel_discards(const Extent &ext);
+
+    /**
+     * Marks the extents queued by the calling thread as ready to be discarded, once the header
+     * reflecting its batch has been written.
+     */
+    void commit_discards();
+
+    /**
+     * Discards the extents that are ready, merging adjacent ones into a single request.
+     *
+     * The extents that couldn't be discarded because of an error stay queued for the next flush;
+     * if the disk doesn't support discarding, they're dropped.
+     *
+     * @return the status
+     */
+    Status flush_discards();
+
+    /**
+     * Sets up the allocation groups described by the header, without loading them.
+     */
+    void create_groups();
+
+    /**
+     * Releases the allocation groups.
+     */
+    void destroy_groups();
+
+    /**
+     * Returns the allocation group an address is in.
+     *
+     * @param addr the address
+     *
+     * @return the index of the group
+     */
+    unsigned int group_of(Address addr) const;
+
+    /**
+     * Returns the group the calling thread allocates from when it has no goal.
+     *
+     * Threads are spread over the groups, so independent writers don't share one.
+     *
+     * @return the index of the group
+     */
+    unsigned int preferred_group() const;
 
-    friend FsCTree<Size, Extent>;
     friend FsCTree<Hash, RootHeader>;
+    friend AllocGroup;
 
 public:
     /**
      * Opens a new Brufs instance.
      *
      * @param dsk the disk the filesystem runs on
+     * @param cache_capacity the maximum number of tree nodes to keep in memory
      */
-    Brufs(Disk *dsk);
+    Brufs(Disk *dsk, unsigned int cache_capacity = BlockCache::DEFAULT_CAPACITY);
 
     /**
      * Closes a Brufs instance.
@@ -164,6 +285,13 @@ public:
      */
     Disk *get_disk() { return this->dsk; }
 
+    /**
+     * Returns the cache tree nodes are read through.
+     *
+     * @return the cache
+     */
+    BlockCache &get_cache() { return this->cache; }
+
     /**
      * Returns the header of the filesystem.
      *
@@ -178,15 +306,25 @@ public:
      * * cluster_size_exp
      * * sc_low_mark
      * * sc_high_mark
+     * * ag_size
+     * * flags
      *
      * The other fields are ignored; they are set automatically during initalization.
      *
+     * If an allocation group size is given, it must be a multiple of the cluster size with room
+     * for at least twice the spare clusters; otherwise the function returns E_INVALID_ARGUMENT.
+     *
      * @param protoheader a prototype for the filesystem header
      *
      * @return the status
      */
     Status init(Header &protoheader);
 
+    /**
+     * The maximum number of free extents to consider after the goal address of an allocation.
+     */
+    static constexpr unsigned int GOAL_SEARCH_DISTANCE = 32;
+
     /**
      * Allocates a number of free blocks.
      *
@@ -196,15 +334,38 @@ public:
      * If the size is not 512 nor a multiple of the cluster size, the function will
      * return E_MISALIGNED.
      *
+     * If a goal address is given, the extent is preferably placed at or shortly after it, for
+     * example right after the previous extent of the same file. If there's no room near the goal,
+     * the best fitting free extent in the goal's allocation group is used. Without a goal, the
+     * group of the calling thread is used. Other groups are only tried if that one is full.
+     *
      * @param length the number of bytes to allocate
      * @param target where to store the offset and length of the allocated extent
+     * @param goal where to preferably place the extent, or 0 for anywhere
+     *
+     * @return the status
+     */
+    Status allocate_blocks(Size length, Extent &target, Address goal = 0);
+
+    /**
+     * Allocates a number of free blocks in as few extents as possible.
+     *
+     * A single extent is allocated like #allocate_blocks(Size, Extent &, Address) does if one
+     * fits. Otherwise, the largest free extents are used until the request is covered, so the
+     * allocation still succeeds when the free space is fragmented.
+     *
+     * If not enough space is free, nothing is allocated and the function returns E_WONT_FIT.
+     *
+     * @param length the total number of bytes to allocate
+     * @param goal where to preferably place a single extent, or 0 for anywhere
+     * @param target where to store the allocated extents; cleared first
      *
      * @return the status
      */
-    Status allocate_blocks(Size length, Extent &target);
+    Status allocate_extents(Size length, Address goal, Vector<Extent> &target);
 
     /**
-     * Frees an extent.
+     * Frees an extent, merging it with any free extents it borders.
      *
      * Double-free is not checked.
      *
@@ -217,17 +378,117 @@ public:
     /**
      * Counts the size of various areas and structures covering the entire filesystem.
      *
+     * The totals come from counters every allocation group keeps up to date, so this doesn't walk
+     * the free space trees.
+     *
      * @param reserved the number of bytes in the spare cluster list
      * @param available the number of bytes left available in the system
-     * @param extents the number of distinct extents in the free blocks tree
-     * @param in_fbt the number of bytes used by the free blocks tree
+     * @param extents the number of distinct free extents
+     * @param in_fbt the number of bytes used by the free blocks and free offset trees
      *
      * @return the status
      */
     Status count_free_blocks(Size &reserved, Size &available, Size &extents, Size &in_fbt);
 
     /**
-     * Allocates a free cluster from the spare cluster list for use in the free blocks tree.
+     * Tops up the spare clusters of every allocation group to the high mark.
+     *
+     * Allocations only refill the spare clusters themselves once they run below the low mark.
+     * Calling this while the filesystem is idle keeps that work off the path of writes.
+     *
+     * @return the status
+     */
+    Status refill_spare_clusters();
+
+    /**
+     * Changes the spare cluster marks, and stores them in the header.
+     *
+     * Spare clusters above a lowered high mark are freed; a raised high mark is only reached by
+     * frees and #refill_spare_clusters().
+     *
+     * @param low_mark the number of spare clusters below which allocations refill them
+     * @param high_mark the maximum number of spare clusters
+     *
+     * @return E_INVALID_ARGUMENT if the low mark is 0 or above the high mark, E_HEADER_TOO_BIG
+     *         if the spare cluster lists wouldn't fit their headers, or any other status
+     */
+    Status set_spare_cluster_marks(uint8_t low_mark, uint8_t high_mark);
+
+    /**
+     * Rebuilds the free space trees, merging all physically adjacent free extents and dropping
+     * the stale entries of the free blocks tree.
+     *
+     * This is a one-shot pass for filesystems whose free space fragmented before free_blocks
+     * started merging neighbors, and for those without a free offset tree, which can't merge on
+     * free at all.
+     *
+     * @param merged where to store the number of extents that were merged away
+     *
+     * @return E_NO_SPACE if there is no room for the new trees, or any other status
+     */
+    Status compact_free_space(Size &merged);
+
+    /**
+     * Returns the extents kept in the in-memory free lists of every group to the free space
+     * trees, so the disk describes all free space.
+     *
+     * This happens automatically when the filesystem is closed.
+     *
+     * @return the status
+     */
+    Status spill_free_lists();
+
+    /**
+     * Returns whether freed extents are discarded on the disk.
+     *
+     * @return whether the DISCARD_FREED flag is set
+     */
+    bool is_discarding() const { return this->hdr->test_flag(DISCARD_FREED); }
+
+    /**
+     * Turns discarding freed extents on or off, and stores the setting in the header.
+     *
+     * Discards are sent in batches, after the free space trees recording the freed extents have
+     * been written.
+     *
+     * @param enable whether to discard freed extents
+     *
+     * @return the status
+     */
+    Status set_discarding(bool enable);
+
+    /**
+     * Discards all free space on the disk, including the spare clusters.
+     *
+     * This is the offline counterpart of discarding freed extents, for filesystems that didn't
+     * or disks that couldn't.
+     *
+     * @param discarded where to store the number of bytes the disk accepted to discard
+     *
+     * @return E_UNSUPPORTED if the disk doesn't support discarding, or any other status
+     */
+    Status discard_free_space(Size &discarded);
+
+    /**
+     * Returns the number of allocation groups the disk is divided into.
+     *
+     * @return the number of groups, at least 1
+     */
+    unsigned int get_num_groups() const { return this->num_groups; }
+
+    /**
+     * Returns where a root preferably allocates its data, so every root sticks to its own
+     * allocation group and roots in different groups don't contend.
+     *
+     * @param root the root
+     *
+     * @return a goal address for allocate_blocks
+     */
+    Address get_root_goal(const RootHeader &root) const;
+
+    /**
+     * Allocates a free cluster from the spare cluster list of the first allocation group for use
+     * in its free blocks tree.
      *
      * @param length the length of the cluster (unused, the global cluster size is used instead)
      * @param target where to store the extent information
@@ -297,3 +558,4 @@ Status FsCTree<K, V>::on_root_change(Address new_addr) {
 #include "BmTree/btree-def-alloc.hpp"
 #include "BmTree/btree-def-node.hpp"
 #include "BmTree/btree-def-container.hpp"
+#include "BmTree/btree-def-cursor.hpp"
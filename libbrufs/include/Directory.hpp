@@ -99,7 +99,23 @@ public:
      */
     SSize count();
 
+    /**
+     * Collects all entries in the directory.
+     *
+     * @param entries the vector to fill
+     */
     Status collect(Vector<DirectoryEntry> &entries);
+
+    /**
+     * Collects a slice of the entries in the directory, in a stable order.
+     * Only the path to the first entry and the leaves holding the slice are read, unless the
+     * directory predates subtree counts.
+     *
+     * @param entries the vector to fill
+     * @param offset the number of entries to skip
+     * @param max the maximum number of entries to collect
+     */
+    Status collect(Vector<DirectoryEntry> &entries, Size offset, Size max);
 };
 
 inline FileEntryTree::FileEntryTree(Directory &dir) :
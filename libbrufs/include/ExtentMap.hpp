@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "types.hpp"
+#include "Status.hpp"
+#include "DataExtent.hpp"
+#include "Vector.hpp"
+#include "Mutex.hpp"
+
+namespace Brufs {
+
+/**
+ * An in-memory copy of the extents of a file.
+ *
+ * A file with a map attached looks up its extents in memory instead of in its extent tree on
+ * the disk. The file loads the map on first use and keeps it in line with the tree when it
+ * changes, so the map must only be shared by files representing the same inode.
+ */
+class ExtentMap {
+private:
+    Mutex mutex;
+
+    /**
+     * The extents, ordered by file offset.
+     */
+    Vector<DataExtent> extents;
+
+    bool loaded = false;
+
+    Size find_index(Offset offset) const;
+
+public:
+    ExtentMap() = default;
+
+    // Maps are shared through pointers only
+    ExtentMap(const ExtentMap &other) = delete;
+    ExtentMap &operator=(const ExtentMap &other) = delete;
+
+    bool is_loaded();
+
+    /**
+     * Fills the map, unless it's already loaded.
+     *
+     * @param extents all extents of the file, ordered by file offset
+     */
+    void load(const Vector<DataExtent> &extents);
+
+    /**
+     * Empties the map, so it's loaded again on next use.
+     */
+    void invalidate();
+
+    /**
+     * Finds the first extent that ends after an offset in the file.
+     *
+     * @param offset the offset in the file
+     * @param target where to store the extent
+     *
+     * @return the status; E_NOT_FOUND if no extent ends after the offset
+     */
+    Status find(Offset offset, DataExtent &target);
+
+    /**
+     * Collects the extents that overlap a range of the file.
+     *
+     * @param start the start of the range in the file
+     * @param end the end of the range in the file
+     * @param target where to append the extents to, ordered by file offset
+     */
+    void find_range(Offset start, Offset end, Vector<DataExtent> &target);
+
+    /**
+     * Finds the extent at the highest offset in the file.
+     *
+     * @param target where to store the extent
+     *
+     * @return the status; E_NOT_FOUND if the file has no extents
+     */
+    Status get_last(DataExtent &target);
+
+    void insert(const DataExtent &extent);
+    void remove(const DataExtent &extent);
+};
+
+}
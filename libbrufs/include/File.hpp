@@ -26,6 +26,7 @@
 #include "Brufs.hpp"
 #include "Inode.hpp"
 #include "DataExtent.hpp"
+#include "ExtentMap.hpp"
 
 namespace Brufs {
 
@@ -42,6 +43,8 @@ public:
 
 class File : public Inode {
 private:
+    ExtentMap *extent_map = nullptr;
+
     Address &iet_address() {
         return *((Address *) this->get_data());
     }
@@ -53,23 +56,104 @@ private:
     Status resize_big_to_small  (Size old_size, Size new_size);
     Status resize_big_to_big    (Size old_size, Size new_size);
 
+    Status zero_range(Offset start, Offset end);
+    Status release_beyond(Offset end);
+
+    SSize write_data(const void *buf, Size count, Offset offset, bool sequential);
+
+    Status load_extent_map();
+    Status find_extent(Offset offset, DataExtent &target);
+    Status find_extents(Offset start, Offset end, Vector<DataExtent> &target);
+    Status find_last_extent(DataExtent &target);
+    Status forget_extents(Status status);
+
 public:
+    /**
+     * The maximum length of an extent grown by sequential writes.
+     *
+     * Sequential writes that append to a file reserve as much space again as its last extent
+     * holds, so a file written sequentially ends up in few extents that may be far longer than the
+     * maximum extent length of its root. Other writes still respect the latter.
+     */
+    static constexpr Size MAX_SEQUENTIAL_EXTENT_LENGTH = 64 * 1024 * 1024;
+
     using Inode::Inode;
     File(const Inode &other) : Inode(other) {}
+    File(const File &other) : Inode(other), extent_map(other.extent_map) {}
 
     File &operator=(const File &other) {
         Inode::operator=(other);
+        this->extent_map = other.extent_map;
 
         return *this;
     }
 
+    /**
+     * Attaches an in-memory copy of the extents of the file.
+     *
+     * Lookups use the map instead of the extent tree from then on, and changes to the extent tree
+     * are applied to the map as well. The map is loaded on first use and isn't owned by the file.
+     * As long as the map is kept, every change to the file must go through a file using it.
+     *
+     * @param map the map, or nullptr to use the extent tree directly
+     */
+    void set_extent_map(ExtentMap *map) {
+        this->extent_map = map;
+    }
+
     Status destroy() override;
 
     Status truncate(Size length);
     Status empty();
-    SSize write(const void *buf, Size count, Offset offset);
+
+    SSize write(const void *buf, Size count, Offset offset) {
+        return this->write_data(buf, count, offset, false);
+    }
+
+    /**
+     * Writes data like #write(const void *, Size, Offset), for a writer that keeps appending.
+     *
+     * Appending writes reserve space past the end of the file for the writes that follow them,
+     * see #MAX_SEQUENTIAL_EXTENT_LENGTH. The writer must call #trim() when it's done.
+     *
+     * @param buf the data to write
+     * @param count the number of bytes to write
+     * @param offset the offset in the file to start writing at
+     *
+     * @return the number of bytes written, or a status
+     */
+    SSize write_sequential(const void *buf, Size count, Offset offset) {
+        return this->write_data(buf, count, offset, true);
+    }
+
     SSize read(void *buf, Size count, Offset offset);
 
+    /**
+     * Releases the space reserved beyond the end of the file.
+     *
+     * Sequential writes reserve space past the end of the file for the writes that follow them.
+     * Call this when the file is done being written to, e.g. when it's closed; shrinking the file
+     * releases that space as well.
+     *
+     * @return the status
+     */
+    Status trim();
+
+    /**
+     * Reads a range of the file in full, up to its end.
+     *
+     * Unlike #read(void *, Size, Offset), this doesn't stop at the end of an extent or hole: the
+     * extents covering the range are found in a single pass over the extent tree, holes are
+     * zero-filled, and physically contiguous extents are read from the disk at once.
+     *
+     * @param buf the buffer to read into
+     * @param count the number of bytes to read
+     * @param offset the offset in the file to start reading at
+     *
+     * @return the number of bytes read, short only at the end of the file, or a status
+     */
+    SSize read_full(void *buf, Size count, Offset offset);
+
     File &set_size(Size new_size) {
         this->get_header()->file_size = new_size;
         return *this;
@@ -23,6 +23,7 @@
 
 #include <type_traits>
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "Extent.hpp"
@@ -40,6 +41,43 @@ static const char *const MAGIC_STRING = "BRUTAFS\nBINARY\n";
  */
 static const Size MAGIC_STRING_LENGTH = 16;
 
+/**
+ * Flags that can be set on the filesystem header.
+ */
+enum HeaderFlag {
+    /**
+     * Discard extents on the disk as soon as they're freed.
+     */
+    DISCARD_FREED,
+
+    /**
+     * Leave the free space of each allocation group out of its free space trees when the
+     * filesystem is initialized, handing it out from the uninitialized tail on demand.
+     */
+    LAZY_INIT
+};
+
+/**
+ * Running totals of the free space of an allocation group, kept up to date on every allocation so
+ * space queries don't have to walk the free space trees.
+ */
+struct FreeSpaceCounters {
+    /**
+     * The number of bytes in free extents, not counting the spare clusters.
+     */
+    uint64_t free_bytes;
+
+    /**
+     * The number of distinct free extents.
+     */
+    uint64_t free_extents;
+
+    /**
+     * The number of bytes used by the nodes of the free blocks and free offset trees.
+     */
+    uint64_t tree_bytes;
+};
+
 /**
  * The master header of the filesystem.
  */
@@ -106,15 +144,60 @@ struct Header {
     uint64_t rht_address;
 
     /**
-     * Flags
+     * Flags, see HeaderFlag
      *
      * Defaults to 0
      */
-    uint64_t flags;
+    uint64_t flags = 0;
+
+    /**
+     * The starting address of the free offset tree, indexing the free extents by their offset.
+     *
+     * Filesystems created before this tree existed have a header_size ending before this field.
+     */
+    uint64_t fot_address;
+
+    /**
+     * The size of an allocation group in bytes, or 0 if the whole disk is a single group.
+     *
+     * The last group also takes the remainder of the disk. Filesystems created before allocation
+     * groups existed have a header_size ending before this field.
+     */
+    uint64_t ag_size = 0;
+
+    /**
+     * The free space counters of the first allocation group.
+     *
+     * Filesystems created before the counters existed have a header_size ending before this
+     * field; their free space is counted when they're mounted.
+     */
+    FreeSpaceCounters free_space;
+
+    /**
+     * The start of the uninitialized tail of the first allocation group, or 0 if it has none.
+     *
+     * Filesystems created before lazy initialization existed have a header_size ending before
+     * this field.
+     */
+    uint64_t uninit_start;
 
     int validate(void *disk) const;
+
+    bool test_flag(const HeaderFlag index) const {
+        return this->flags & (1UL << index);
+    }
+
+    void set_flag(const HeaderFlag index, const bool value) {
+        auto bit = (1UL << index);
+        this->flags = (this->flags & ~bit) | (value * bit);
+    }
 };
 static_assert(std::is_standard_layout<Header>::value, "the fs header must be standard-layout");
+
+/**
+ * The size of the oldest header still supported, which lacks the free offset tree.
+ */
+static const Size MIN_HEADER_SIZE = offsetof(Header, fot_address);
 static_assert(sizeof(Header) <= (4096 - 16 * sizeof(Extent)), "the fs header should fit in 4k");
 
 }
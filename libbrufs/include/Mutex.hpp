@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <pthread.h>
+
+namespace Brufs {
+
+/**
+ * A recursive mutual exclusion lock.
+ *
+ * Recursive, because the structures it protects call back into themselves: freeing a node of
+ * the free blocks tree frees blocks, which modifies the free blocks tree.
+ */
+class Mutex {
+private:
+    pthread_mutex_t mutex;
+
+public:
+    Mutex() {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+        const int status = pthread_mutex_init(&this->mutex, &attr);
+        assert(status == 0);
+        (void) status;
+
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    ~Mutex() {
+        pthread_mutex_destroy(&this->mutex);
+    }
+
+    // Mutexes are non-copyable
+    Mutex(const Mutex &other) = delete;
+    Mutex &operator=(const Mutex &other) = delete;
+
+    void lock() {
+        pthread_mutex_lock(&this->mutex);
+    }
+
+    /**
+     * Takes the lock if no other thread holds it.
+     *
+     * @return whether the lock was taken
+     */
+    bool try_lock() {
+        return pthread_mutex_trylock(&this->mutex) == 0;
+    }
+
+    void unlock() {
+        pthread_mutex_unlock(&this->mutex);
+    }
+};
+
+/**
+ * Holds a mutex for as long as it's in scope.
+ */
+class MutexGuard {
+private:
+    Mutex &mutex;
+
+public:
+    explicit MutexGuard(Mutex &mutex) : mutex(mutex) {
+        this->mutex.lock();
+    }
+
+    ~MutexGuard() {
+        this->mutex.unlock();
+    }
+
+    MutexGuard(const MutexGuard &other) = delete;
+    MutexGuard &operator=(const MutexGuard &other) = delete;
+};
+
+}
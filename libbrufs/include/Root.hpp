@@ -23,6 +23,7 @@
 #pragma once
 
 #include "internal.hpp"
+#include "Mutex.hpp"
 #include "BmTree/btree-decl.hpp"
 #include "RootHeader.hpp"
 #include "InodeHeader.hpp"
@@ -77,6 +78,11 @@ class Root {
      */
     InoTree ait;
 
+    /**
+     * Guards the inode trees and the root header, which are shared by every inode in the root.
+     */
+    Mutex lock;
+
     friend InoTree;
 
     /**
@@ -160,6 +160,11 @@ enum [[nodiscard]] Status {
      */
     E_NO_ROOT,
 
+    /**
+     * The disk doesn't support the operation, e.g. discarding.
+     */
+    E_UNSUPPORTED,
+
     /**
      * Not a real error, but rather the lowest possible I/O abstraction status code
      */
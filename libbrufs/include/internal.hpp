@@ -79,7 +79,7 @@ static constexpr inline T next_power_of_two(T x) {
 
 template <typename M, typename B>
 static constexpr inline auto previous_multiple_of(M multiple, B base) {
-    return ((multiple - base + 1) / base) * base;
+    return (multiple / base) * base;
 }
 
 template <typename M, typename B>
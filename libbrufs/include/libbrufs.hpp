@@ -25,6 +25,7 @@
 #include "Brufs.hpp"
 #include "Directory.hpp"
 #include "File.hpp"
+#include "ExtentMap.hpp"
 #include "String.hpp"
 #include "Seed.hpp"
 #include "BuildInfo.hpp"
@@ -21,5 +21,13 @@
  */
 
 #include "AbstIO.hpp"
+#include "Status.hpp"
 
 Brufs::AbstIO::~AbstIO() {}
+
+Brufs::SSize Brufs::AbstIO::discard(Size count, Address offset) {
+    (void) count;
+    (void) offset;
+
+    return Status::E_UNSUPPORTED;
+}
@@ -0,0 +1,1074 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "xxhash/xxhash.h"
+
+#include "io.hpp"
+#include "internal.hpp"
+#include "AllocGroup.hpp"
+#include "Brufs.hpp"
+#include "Vector.hpp"
+
+static constexpr unsigned long MEGABYTE = 1024 * 1024;
+static constexpr unsigned long GIGABYTE = 1024 * MEGABYTE;
+static constexpr unsigned long INITIAL_FREE_EXTENT_LENGTH = 4 * GIGABYTE;
+
+Brufs::AllocGroup::AllocGroup(Brufs *fs, Mutex &lock, Header *hdr, Address end) :
+        fs(fs), index(0), start(0), end(end), lock(lock), raw_header(nullptr),
+        fbt_address(&hdr->fbt_address), fot_address(&hdr->fot_address), sc_count(&hdr->sc_count),
+        spare_clusters(reinterpret_cast<Extent *>(reinterpret_cast<char *>(hdr) + hdr->header_size)),
+        counters(&own_counters), has_fot(hdr->header_size > offsetof(Header, fot_address)),
+        fbt(fs, this), fot(fs, this)
+{
+    if (hdr->header_size >= offsetof(Header, free_space) + sizeof(FreeSpaceCounters)) {
+        this->counters = &hdr->free_space;
+    }
+
+    this->uninit_start = &this->own_uninit_start;
+    if (hdr->header_size >= offsetof(Header, uninit_start) + sizeof(hdr->uninit_start)) {
+        this->uninit_start = &hdr->uninit_start;
+    }
+
+    this->size_classes[0] = BLOCK_SIZE;
+    this->size_classes[1] = hdr->cluster_size;
+}
+
+Brufs::AllocGroup::AllocGroup(Brufs *fs, unsigned int index, Address start, Address end) :
+        fs(fs), index(index), start(start), end(end), lock(own_lock),
+        raw_header(static_cast<char *>(calloc(1, fs->get_header().cluster_size))),
+        has_fot(true), fbt(fs, this), fot(fs, this)
+{
+    assert(this->raw_header);
+
+    auto hdr = reinterpret_cast<GroupHeader *>(this->raw_header);
+    this->fbt_address = &hdr->fbt_address;
+    this->fot_address = &hdr->fot_address;
+    this->sc_count = &hdr->sc_count;
+    this->spare_clusters = reinterpret_cast<Extent *>(this->raw_header + sizeof(GroupHeader));
+    this->counters = &hdr->free_space;
+    this->uninit_start = &hdr->uninit_start;
+
+    this->size_classes[0] = BLOCK_SIZE;
+    this->size_classes[1] = fs->get_header().cluster_size;
+}
+
+Brufs::AllocGroup::~AllocGroup() {
+    free(this->raw_header);
+}
+
+Brufs::Status Brufs::AllocGroup::store() {
+    if (!this->raw_header) return this->fs->store_header();
+
+    auto hdr = reinterpret_cast<GroupHeader *>(this->raw_header);
+    hdr->checksum = 0;
+    hdr->checksum = XXH64(hdr, hdr->header_size, CHECKSUM_SEED);
+
+    // Through the cache, so a batch writes the group header only once
+    return this->fs->get_cache().write(
+        this->start, this->fs->get_header().cluster_size, this->raw_header
+    );
+}
+
+Brufs::Status Brufs::AllocGroup::load() {
+    const auto cluster_size = this->fs->get_header().cluster_size;
+
+    if (this->raw_header) {
+        auto sstatus = dread(this->fs->get_disk(), this->raw_header, cluster_size, this->start);
+        if (sstatus < 0) return static_cast<Status>(sstatus);
+
+        auto hdr = reinterpret_cast<GroupHeader *>(this->raw_header);
+        if (memcmp(hdr->magic, GROUP_MAGIC_STRING, GROUP_MAGIC_STRING_LENGTH) != 0) {
+            return Status::E_BAD_MAGIC;
+        }
+
+        if (hdr->index != this->index) return Status::E_BAD_MAGIC;
+        const auto min_size = offsetof(GroupHeader, uninit_start);
+        if (hdr->header_size < min_size) return Status::E_HEADER_TOO_SMALL;
+
+        const auto spares_size = this->fs->get_header().sc_high_mark * sizeof(Extent);
+        if (hdr->header_size + spares_size > cluster_size) return Status::E_HEADER_TOO_BIG;
+
+        const auto checksum = hdr->checksum;
+        hdr->checksum = 0;
+        if (XXH64(hdr, hdr->header_size, CHECKSUM_SEED) != checksum) {
+            return Status::E_CHECKSUM_MISMATCH;
+        }
+        hdr->checksum = checksum;
+
+        this->spare_clusters = reinterpret_cast<Extent *>(this->raw_header + hdr->header_size);
+
+        this->uninit_start = &this->own_uninit_start;
+        if (hdr->header_size >= sizeof(GroupHeader)) this->uninit_start = &hdr->uninit_start;
+    }
+
+    this->fbt.set_target(this->fbt_address);
+    auto status = this->fbt.update_root(*this->fbt_address, cluster_size);
+    if (status < Status::OK) return status;
+
+    if (this->has_fot) {
+        if (*this->fot_address == 0) return Status::E_NO_FBT;
+
+        this->fot.set_target(this->fot_address);
+        status = this->fot.update_root(*this->fot_address, cluster_size);
+        if (status < Status::OK) return status;
+    }
+
+    // Counters that are missing or off are corrected on disk with the next change to the group
+    if (this->counters == &this->own_counters || !this->counters_valid()) {
+        return this->scan_free_space();
+    }
+
+    return Status::OK;
+}
+
+bool Brufs::AllocGroup::counters_valid() const {
+    const auto &fs_header = this->fs->get_header();
+    const auto &counters = *this->counters;
+
+    if (counters.free_bytes % BLOCK_SIZE != 0) return false;
+    if (counters.tree_bytes % fs_header.cluster_size != 0) return false;
+    if (counters.free_bytes + counters.tree_bytes > this->end - this->start) return false;
+    if (counters.free_bytes < this->get_tail_length()) return false;
+
+    // Every extent is at least a block long, and free space is in at least one extent
+    if (counters.free_extents * BLOCK_SIZE > counters.free_bytes) return false;
+    if (counters.free_bytes > 0 && counters.free_extents == 0) return false;
+
+    // Both trees have at least a root
+    const Size num_trees = this->has_fot ? 2 : 1;
+    return counters.tree_bytes >= num_trees * fs_header.cluster_size;
+}
+
+Brufs::Status Brufs::AllocGroup::scan_free_space() {
+    FreeSpaceCounters counted {};
+
+    auto status = this->fbt.count_used_space(counted.tree_bytes);
+    if (status < Status::OK) return status;
+
+    if (this->has_fot) {
+        Size in_tree;
+        status = this->fot.count_used_space(in_tree);
+        if (status < Status::OK) return status;
+
+        counted.tree_bytes += in_tree;
+    }
+
+    // Count and sum the extents in a single pass over the leaves; the FOT has no stale entries
+    BmTree::Cursor<Size, Extent> cursor(this->has_fot ? this->fot : this->fbt);
+    for (status = cursor.seek_first(); status == Status::OK; status = cursor.next()) {
+        counted.free_bytes += cursor.get_value()->length;
+        ++counted.free_extents;
+    }
+
+    if (status != Status::E_NOT_FOUND) return status;
+
+    const auto tail_length = this->get_tail_length();
+    if (tail_length > 0) {
+        counted.free_bytes += tail_length;
+        ++counted.free_extents;
+    }
+
+    *this->counters = counted;
+    return Status::OK;
+}
+
+Brufs::Status Brufs::AllocGroup::init() {
+    const auto &fs_header = this->fs->get_header();
+    const auto cluster_size = fs_header.cluster_size;
+
+    if (this->raw_header) {
+        memset(this->raw_header, 0, cluster_size);
+
+        auto hdr = reinterpret_cast<GroupHeader *>(this->raw_header);
+        memcpy(hdr->magic, GROUP_MAGIC_STRING, GROUP_MAGIC_STRING_LENGTH);
+        hdr->header_size = sizeof(GroupHeader);
+        hdr->index = this->index;
+    }
+
+    // Provide some free extents for the FBT, right after the group header
+    for (int i = 0; i < fs_header.sc_high_mark; ++i) {
+        this->spare_clusters[i] = {this->start + (i + 1) * cluster_size, cluster_size};
+    }
+    *this->sc_count = fs_header.sc_high_mark;
+    *this->counters = {};
+    *this->uninit_start = 0;
+
+    Address dyn_start = this->start + (fs_header.sc_high_mark + 1) * cluster_size;
+    Size remaining = this->end - dyn_start;
+    this->counters->free_bytes = remaining;
+
+    this->fbt.set_target(this->fbt_address);
+    Status stt = this->fbt.init(cluster_size);
+    if (stt < Status::OK) return stt;
+
+    // Leave the trees empty; the rest of the group is taken from the tail as it's needed
+    if (fs_header.test_flag(LAZY_INIT) && this->uninit_start != &this->own_uninit_start) {
+        this->fot.set_target(this->fot_address);
+        stt = this->fot.init(cluster_size);
+        if (stt < Status::OK) return stt;
+
+        if (remaining > 0) {
+            *this->uninit_start = dyn_start;
+            this->counters->free_extents = 1;
+        }
+
+        return this->store();
+    }
+
+    Vector<Extent> free_extents;
+    while (remaining > INITIAL_FREE_EXTENT_LENGTH) {
+        free_extents.push_back({dyn_start, INITIAL_FREE_EXTENT_LENGTH});
+
+        dyn_start += INITIAL_FREE_EXTENT_LENGTH;
+        remaining -= INITIAL_FREE_EXTENT_LENGTH;
+    }
+
+    // The FBT is keyed by size, so the (shorter) tail goes first
+    const Extent tail {dyn_start, remaining};
+
+    Vector<BmTree::Record<Size, Extent>> records(free_extents.get_size() + 1);
+    if (remaining > 0) records.push_back({tail.length, &tail});
+    for (const auto &free_ext : free_extents) records.push_back({free_ext.length, &free_ext});
+
+    stt = this->fbt.bulk_load(records.begin(), records.end());
+    if (stt < Status::OK) return stt;
+
+    this->counters->free_extents = records.get_size();
+
+    // Initialize the FOT with the same extents, in offset order this time
+    this->fot.set_target(this->fot_address);
+    stt = this->fot.init(cluster_size);
+    if (stt < Status::OK) return stt;
+
+    Vector<BmTree::Record<Address, Extent>> offset_records(free_extents.get_size() + 1);
+    for (const auto &free_ext : free_extents) offset_records.push_back({free_ext.offset, &free_ext});
+    if (remaining > 0) offset_records.push_back({tail.offset, &tail});
+
+    stt = this->fot.bulk_load(offset_records.begin(), offset_records.end());
+    if (stt < Status::OK) return stt;
+
+    return this->store();
+}
+
+/*
+ * Free cluster management
+ */
+
+Brufs::Status Brufs::AllocGroup::add_free_extent(const Extent &ext) {
+    auto status = this->fbt.insert(ext.length, ext);
+    if (status >= Status::OK && this->has_fot) status = this->fot.insert(ext.offset, ext);
+    if (status < Status::OK) return status;
+
+    this->counters->free_bytes += ext.length;
+    ++this->counters->free_extents;
+
+    return status;
+}
+
+void Brufs::AllocGroup::drop_free_extent(const Extent &ext) {
+    this->counters->free_bytes -= ext.length;
+    --this->counters->free_extents;
+
+    // The extent is about to be used again
+    if (this->fs->is_discarding()) this->fs->cancel_discards(ext);
+}
+
+Brufs::Size Brufs::AllocGroup::get_tail_length() const {
+    if (*this->uninit_start == 0) return 0;
+    return this->end - *this->uninit_start;
+}
+
+Brufs::Status Brufs::AllocGroup::take_from_tail(Size length, Size max_length, Extent &result) {
+    const auto tail_length = this->get_tail_length();
+    if (tail_length == 0 || tail_length < length) return Status::E_NOT_FOUND;
+
+    result = {*this->uninit_start, min(tail_length, max(length, max_length))};
+
+    // Freed extents merge into the tail with their discards still pending
+    if (this->fs->is_discarding()) this->fs->cancel_discards(result);
+
+    // The tail counts as a single extent until it's used up
+    this->counters->free_bytes -= result.length;
+    if (result.length == tail_length) {
+        *this->uninit_start = 0;
+        --this->counters->free_extents;
+    } else {
+        *this->uninit_start += result.length;
+    }
+
+    return Status::OK;
+}
+
+Brufs::Status Brufs::AllocGroup::take_free_extent(Size length, Extent &result) {
+    while (true) {
+        auto status = this->fbt.remove(length, result);
+        if (status == Status::E_NOT_FOUND) {
+            // Not nibbling at the tail a cluster at a time
+            return this->take_from_tail(length, INITIAL_FREE_EXTENT_LENGTH, result);
+        }
+
+        if (status < Status::OK) return status;
+
+        if (!this->has_fot) {
+            this->drop_free_extent(result);
+            return status;
+        }
+
+        // Extents taken through the FOT stay behind in the FBT; only trust the FOT
+        Extent current;
+        status = this->fot.search(result.offset, current, true);
+        if (status == Status::E_NOT_FOUND) continue;
+        if (status < Status::OK) return status;
+
+        if (current.length != result.length) continue;
+
+        status = this->fot.remove(result.offset, current, true);
+        if (status < Status::OK) return status;
+
+        this->drop_free_extent(result);
+        return status;
+    }
+}
+
+Brufs::Status Brufs::AllocGroup::take_free_extent_near(
+    Size length, Size max_length, Address goal, Extent &target
+) {
+    goal = next_multiple_of<Address>(goal, BLOCK_SIZE);
+
+    if (*this->uninit_start != 0 && goal >= *this->uninit_start && goal < this->end) {
+        if (this->end - goal < length) return Status::E_NOT_FOUND;
+
+        // Index the part of the tail before the goal, so the tail starts right at it
+        if (goal > *this->uninit_start) {
+            const Extent skipped {*this->uninit_start, goal - *this->uninit_start};
+
+            *this->uninit_start = goal;
+            this->counters->free_bytes -= skipped.length;
+
+            auto status = this->add_free_extent(skipped);
+            if (status < Status::OK) return status;
+        }
+
+        const auto fitting = previous_multiple_of(this->get_tail_length(), length);
+        return this->take_from_tail(length, min(max_length, fitting), target);
+    }
+
+    Extent found {0, 0};
+    bool have_found = false;
+
+    {
+        BmTree::Cursor<Address, Extent> cursor(this->fot);
+
+        // Start at the extent that may contain the goal
+        auto status = cursor.seek(goal);
+        if (status == Status::E_NOT_FOUND) {
+            status = cursor.seek_last();
+        } else if (status == Status::OK && cursor.get_key() > goal) {
+            status = cursor.prev();
+            if (status == Status::E_NOT_FOUND) status = cursor.seek(goal);
+        }
+
+        for (
+            unsigned int i = 0;
+            status == Status::OK && i < Brufs::GOAL_SEARCH_DISTANCE;
+            ++i, status = cursor.next()
+        ) {
+            const Extent &ext = *cursor.get_value();
+            const Address end = ext.offset + ext.length;
+            if (end <= goal) continue;
+
+            const Address start = max(ext.offset, goal);
+            if (end - start < length) continue;
+
+            found = ext;
+            target = {start, min(max_length, previous_multiple_of(end - start, length))};
+            have_found = true;
+            break;
+        }
+
+        if (status < Status::OK && status != Status::E_NOT_FOUND) return status;
+    }
+
+    if (!have_found) return Status::E_NOT_FOUND;
+
+    // The FBT entry goes stale; take_free_extent skips it
+    Extent removed;
+    auto status = this->fot.remove(found.offset, removed, true);
+    if (status < Status::OK) return status;
+
+    this->drop_free_extent(removed);
+
+    if (target.offset > found.offset) {
+        status = this->add_free_extent({found.offset, target.offset - found.offset});
+        if (status < Status::OK) return status;
+    }
+
+    const Address found_end = found.offset + found.length;
+    const Address target_end = target.offset + target.length;
+    if (found_end > target_end) {
+        status = this->add_free_extent({target_end, found_end - target_end});
+        if (status < Status::OK) return status;
+    }
+
+    return Status::OK;
+}
+
+Brufs::Status Brufs::AllocGroup::coalesce_free_extent(Extent &ext) {
+    if (!this->has_fot) return Status::OK;
+
+    Extent left;
+    bool has_left = false;
+
+    {
+        BmTree::Cursor<Address, Extent> cursor(this->fot);
+
+        auto status = cursor.seek(ext.offset);
+        if (status == Status::OK) status = cursor.prev();
+        else if (status == Status::E_NOT_FOUND) status = cursor.seek_last();
+
+        if (status == Status::OK) {
+            left = *cursor.get_value();
+            has_left = left.offset + left.length == ext.offset;
+        } else if (status != Status::E_NOT_FOUND) {
+            return status;
+        }
+    }
+
+    // Merged neighbors leave stale entries in the FBT; take_free_extent skips them
+    if (has_left) {
+        auto status = this->fot.remove(left.offset, left, true);
+        if (status < Status::OK) return status;
+
+        this->drop_free_extent(left);
+
+        ext = {left.offset, left.length + ext.length};
+    }
+
+    Extent right;
+    auto status = this->fot.search(ext.offset + ext.length, right, true);
+    if (status == Status::E_NOT_FOUND) return Status::OK;
+    if (status < Status::OK) return status;
+
+    status = this->fot.remove(right.offset, right, true);
+    if (status < Status::OK) return status;
+
+    this->drop_free_extent(right);
+
+    ext.length += right.length;
+
+    return Status::OK;
+}
+
+Brufs::Status Brufs::AllocGroup::release_tree_block(const Extent &ext) {
+    this->counters->tree_bytes -= ext.length;
+
+    this->fs->get_cache().invalidate(ext.offset, ext.length);
+
+    if (this->reclaimed) {
+        this->reclaimed->push_back(ext);
+        return Status::OK;
+    }
+
+    // Stored along with the rest of the operation that released the block
+    if (*this->sc_count < this->fs->get_header().sc_high_mark) {
+        this->spare_clusters[(*this->sc_count)++] = ext;
+        return Status::OK;
+    }
+
+    this->released.push_back(ext);
+    return Status::OK;
+}
+
+Brufs::Status Brufs::AllocGroup::index_released_blocks() {
+    // Indexing a block may release others
+    while (this->released.get_size() > 0) {
+        Extent ext = this->released.back();
+        this->released.pop_back();
+
+        auto status = this->coalesce_free_extent(ext);
+        if (status < Status::OK) return status;
+
+        status = this->add_free_extent(ext);
+        if (status < Status::OK) return status;
+    }
+
+    return Status::OK;
+}
+
+int Brufs::AllocGroup::size_class_of(Size length) const {
+    for (unsigned int i = 0; i < NUM_SIZE_CLASSES; ++i) {
+        if (this->size_classes[i] == length) return i;
+    }
+
+    return -1;
+}
+
+bool Brufs::AllocGroup::take_from_free_list(int size_class, Address goal, Extent &target) {
+    auto &list = this->free_lists[size_class];
+    if (list.get_size() == 0) return false;
+
+    Size index = list.get_size() - 1;
+    if (goal != 0) {
+        // Usually the last one, as runs are listed back to front
+        while (list[index].offset != goal) {
+            if (index == 0) return false;
+            --index;
+        }
+    }
+
+    target = list[index];
+    list[index] = list.back();
+    list.pop_back();
+
+    return true;
+}
+
+Brufs::Status Brufs::AllocGroup::spill_free_lists() {
+    MutexGuard guard(this->lock);
+
+    bool empty = true;
+    for (const auto &list : this->free_lists) empty = empty && list.get_size() == 0;
+    if (empty) return Status::OK;
+
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    auto status = this->spill_free_lists_locked();
+    if (status < Status::OK) return status;
+
+    return batch.finish(this->store());
+}
+
+Brufs::Status Brufs::AllocGroup::spill_free_lists_locked() {
+    for (auto &list : this->free_lists) {
+        while (list.get_size() > 0) {
+            Extent ext = list.back();
+            list.pop_back();
+
+            auto status = this->coalesce_free_extent(ext);
+            if (status < Status::OK) return status;
+
+            status = this->add_free_extent(ext);
+            if (status < Status::OK) return status;
+        }
+    }
+
+    return this->index_released_blocks();
+}
+
+Brufs::Status Brufs::AllocGroup::allocate_blocks(Size length, Extent &target, Address goal) {
+    MutexGuard guard(this->lock);
+
+    const int size_class = this->size_class_of(length);
+    if (size_class >= 0 && this->take_from_free_list(size_class, goal, target)) return Status::OK;
+
+    // Refilling the spare clusters touches the same FBT nodes again
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    // Take a run of extents of a common size at once, so the next ones don't touch the trees
+    Size run_length = length;
+    if (size_class >= 0) {
+        const Size room = FREE_LIST_CAPACITY - this->free_lists[size_class].get_size();
+        run_length = min<Size>(FREE_LIST_RUN, room + 1) * length;
+    }
+
+    Extent run;
+    Status status = Status::E_NOT_FOUND;
+    if (goal != 0 && this->has_fot) {
+        status = this->take_free_extent_near(length, run_length, goal, run);
+        if (status < Status::OK && status != Status::E_NOT_FOUND) return status;
+    }
+
+    if (status == Status::E_NOT_FOUND) {
+        // Rather a whole run than a piece of the smallest fitting extent
+        Extent result;
+        status = this->take_free_extent(run_length, result);
+        if (status == Status::E_NOT_FOUND && run_length > length) {
+            status = this->take_free_extent(length, result);
+        }
+
+        if (status == Status::E_NOT_FOUND) {
+            // The space may be sitting in the free lists
+            status = this->spill_free_lists_locked();
+            if (status < Status::OK) return status;
+
+            status = this->take_free_extent(length, result);
+        }
+
+        if (status == Status::E_NOT_FOUND) return Status::E_WONT_FIT;
+        if (status < 0) return status;
+
+        run = {result.offset, min(run_length, previous_multiple_of(result.length, length))};
+
+        if (result.length > run.length) {
+            status = this->add_free_extent({run.offset + run.length, result.length - run.length});
+            if (status < 0) return status;
+        }
+    }
+
+    target = {run.offset, length};
+
+    // List the rest of the run back to front, so it's handed out in order
+    if (size_class >= 0) {
+        for (Address piece = run.offset + run.length; piece > target.offset + length;) {
+            piece -= length;
+            this->free_lists[size_class].push_back({piece, length});
+        }
+    }
+
+    status = this->index_released_blocks();
+    if (status < Status::OK) return status;
+
+    status = this->refill_spare_clusters(this->fs->get_header().sc_low_mark);
+    if (status < Status::OK) return status;
+
+    return batch.finish(this->store());
+}
+
+Brufs::Status Brufs::AllocGroup::take_largest_free_extent(Extent &result) {
+    const auto tail = min<Size>(this->get_tail_length(), INITIAL_FREE_EXTENT_LENGTH);
+
+    while (true) {
+        Extent largest;
+        auto status = this->fbt.get_last(&largest);
+        if (status == Status::E_NOT_FOUND) return this->take_from_tail(tail, tail, result);
+        if (status < Status::OK) return status;
+
+        if (tail > largest.length) return this->take_from_tail(tail, tail, result);
+
+        // The entry may be stale; if so, take_free_extent drops it and the next largest is tried
+        status = this->take_free_extent(largest.length, result);
+        if (status != Status::E_NOT_FOUND) return status;
+    }
+}
+
+Brufs::Status Brufs::AllocGroup::refill_spare_clusters(unsigned int target) {
+    const auto cluster_size = this->fs->get_header().cluster_size;
+
+    auto list = this->spare_clusters;
+    while (*this->sc_count < target) {
+        Extent replacement;
+        auto status = this->take_free_extent(cluster_size, replacement);
+        if (status < Status::OK) return status;
+
+        while (
+            replacement.length >= cluster_size
+            && *this->sc_count < target
+        ) {
+            list[*this->sc_count] = {replacement.offset, cluster_size};
+            replacement.offset += cluster_size;
+            replacement.length -= cluster_size;
+
+            ++*this->sc_count;
+        }
+
+        if (replacement.length > 0) {
+            status = this->add_free_extent(replacement);
+            if (status < Status::OK) return status;
+        }
+    }
+
+    return Status::OK;
+}
+
+Brufs::Status Brufs::AllocGroup::top_up_spare_clusters() {
+    MutexGuard guard(this->lock);
+
+    const auto high_mark = this->fs->get_header().sc_high_mark;
+    if (*this->sc_count >= high_mark) return Status::OK;
+
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    auto status = this->refill_spare_clusters(high_mark);
+    if (status < Status::OK) return status;
+
+    status = this->index_released_blocks();
+    if (status < Status::OK) return status;
+
+    return batch.finish(this->store());
+}
+
+Brufs::Status Brufs::AllocGroup::release_excess_spare_clusters() {
+    MutexGuard guard(this->lock);
+
+    const auto high_mark = this->fs->get_header().sc_high_mark;
+    if (*this->sc_count <= high_mark) return Status::OK;
+
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    while (*this->sc_count > high_mark) {
+        Extent ext = this->spare_clusters[--*this->sc_count];
+
+        auto status = this->coalesce_free_extent(ext);
+        if (status < Status::OK) return status;
+
+        status = this->add_free_extent(ext);
+        if (status < Status::OK) return status;
+    }
+
+    auto status = this->index_released_blocks();
+    if (status < Status::OK) return status;
+
+    return batch.finish(this->store());
+}
+
+Brufs::Status Brufs::AllocGroup::take_extents(Size &remaining, Vector<Extent> &target) {
+    const auto cluster_size = this->fs->get_header().cluster_size;
+
+    MutexGuard guard(this->lock);
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    // Only needed when free space is scarce, so give the trees all of it
+    Status status = this->spill_free_lists_locked();
+    if (status < Status::OK) return status;
+
+    while (remaining > 0) {
+        Extent ext;
+        status = this->take_largest_free_extent(ext);
+        if (status < Status::OK) break;
+
+        const auto piece = min(remaining, previous_multiple_of<Size>(ext.length, cluster_size));
+        if (piece == 0) {
+            status = this->add_free_extent(ext);
+            break;
+        }
+
+        if (ext.length > piece) {
+            status = this->add_free_extent({ext.offset + piece, ext.length - piece});
+            if (status < Status::OK) break;
+        }
+
+        target.push_back({ext.offset, piece});
+        remaining -= piece;
+    }
+
+    // Running out of space is fine; the next group may have more
+    if (status < Status::OK && status != Status::E_NOT_FOUND) return status;
+
+    status = this->index_released_blocks();
+    if (status < Status::OK) return status;
+
+    status = this->refill_spare_clusters(this->fs->get_header().sc_low_mark);
+    if (status < Status::OK) return status;
+
+    return batch.finish(this->store());
+}
+
+Brufs::Status Brufs::AllocGroup::allocate_tree_blocks(Extent &target) {
+    MutexGuard guard(this->lock);
+
+    if (this->tree_block_pool && this->tree_block_pool->get_size() > 0) {
+        target = this->tree_block_pool->back();
+        this->tree_block_pool->pop_back();
+        return Status::OK;
+    }
+
+    if (*this->sc_count == 0) return Status::E_NO_SPACE;
+    --*this->sc_count;
+
+    auto list = this->spare_clusters;
+    target = list[*this->sc_count];
+
+    return this->store();
+}
+
+Brufs::Status Brufs::AllocGroup::free_blocks(const Extent &ext) {
+    MutexGuard guard(this->lock);
+
+    const auto &fs_header = this->fs->get_header();
+    auto fbt_block_size = fs_header.cluster_size;
+
+    this->fs->get_cache().invalidate(ext.offset, ext.length);
+
+    // Keep extents of a common size for the next allocation of that size, once the spare
+    // clusters are topped up
+    const int size_class = this->size_class_of(ext.length);
+    if (
+        size_class >= 0 && *this->sc_count >= fs_header.sc_high_mark
+        && this->free_lists[size_class].get_size() < FREE_LIST_CAPACITY
+    ) {
+        this->free_lists[size_class].push_back(ext);
+        return Status::OK;
+    }
+
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    Extent residual = ext;
+    if (*this->sc_count < fs_header.sc_high_mark && ext.length >= fbt_block_size) {
+        auto list = this->spare_clusters;
+
+        list[(*this->sc_count)++] = {ext.offset, fbt_block_size};
+
+        residual = {ext.offset + fbt_block_size, ext.length - fbt_block_size};
+    }
+
+    if (residual.length > 0) {
+        // Only the space that's indexed; spare clusters may be used before the discard is sent
+        if (this->fs->is_discarding()) this->fs->queue_discard(residual);
+
+        auto status = this->coalesce_free_extent(residual);
+        if (status < Status::OK) return status;
+
+        if (*this->uninit_start != 0 && residual.offset + residual.length == *this->uninit_start) {
+            // Right before the tail; it's still all free, so just let the tail start earlier
+            *this->uninit_start = residual.offset;
+            this->counters->free_bytes += residual.length;
+        } else {
+            status = this->add_free_extent(residual);
+            if (status < Status::OK) return status;
+        }
+    }
+
+    auto status = this->index_released_blocks();
+    if (status < Status::OK) return status;
+
+    return batch.finish(this->store());
+}
+
+static int compare_extent_offsets(const void *a, const void *b) {
+    const auto left = static_cast<const Brufs::Extent *>(a)->offset;
+    const auto right = static_cast<const Brufs::Extent *>(b)->offset;
+
+    return (left > right) - (left < right);
+}
+
+static int compare_extent_lengths(const void *a, const void *b) {
+    const auto left = static_cast<const Brufs::Extent *>(a);
+    const auto right = static_cast<const Brufs::Extent *>(b);
+
+    if (left->length != right->length) return (left->length > right->length) ? 1 : -1;
+    return compare_extent_offsets(a, b);
+}
+
+/**
+ * Returns an upper bound on the number of nodes a bulk-loaded free space tree needs.
+ */
+static Brufs::Size count_tree_blocks(Brufs::Size num_records, Brufs::Size node_size) {
+    // Every entry, leaf or inner, takes at most a key, an extent and a count
+    const Brufs::Size per_node = (node_size - 64) / 32;
+
+    Brufs::Size total = 1;
+    for (auto num_nodes = num_records; num_nodes > 1;) {
+        num_nodes = updiv(num_nodes, per_node);
+        total += num_nodes;
+    }
+
+    return total;
+}
+
+Brufs::Status Brufs::AllocGroup::compact_free_space(Size &merged) {
+    MutexGuard guard(this->lock);
+    BlockCache::Batch batch(this->fs->get_cache());
+
+    auto spill_status = this->spill_free_lists_locked();
+    if (spill_status < Status::OK) return spill_status;
+
+    // Collect the free extents; the FOT has no stale entries, the FBT only in absence of a FOT
+    Vector<Extent> free_exts;
+    {
+        BmTree::Cursor<Size, Extent> cursor(this->has_fot ? this->fot : this->fbt);
+
+        Status status;
+        for (status = cursor.seek_first(); status == Status::OK; status = cursor.next()) {
+            free_exts.push_back(*cursor.get_value());
+        }
+
+        if (status != Status::E_NOT_FOUND) return status;
+    }
+
+    const auto cluster_size = this->fs->get_header().cluster_size;
+    const Size num_trees = this->has_fot ? 2 : 1;
+
+    // Make sure the new trees fit before tearing down the old ones
+    Size num_tree_blocks = num_trees * count_tree_blocks(free_exts.get_size(), cluster_size);
+    Size num_fitting = 0;
+    for (const auto &ext : free_exts) num_fitting += ext.length / cluster_size;
+
+    if (num_fitting < num_tree_blocks) {
+        // The tail may still have room for them
+        const Size missing = (num_tree_blocks - num_fitting) * cluster_size;
+
+        Extent from_tail;
+        auto status = this->take_from_tail(missing, missing, from_tail);
+        if (status == Status::E_NOT_FOUND) return Status::E_NO_SPACE;
+        if (status < Status::OK) return status;
+
+        free_exts.push_back(from_tail);
+    }
+
+    Vector<Extent> reclaimed;
+    this->reclaimed = &reclaimed;
+
+    auto status = this->fbt.destroy();
+    if (status >= Status::OK && this->has_fot) status = this->fot.destroy();
+
+    this->reclaimed = nullptr;
+    if (status < Status::OK) return status;
+
+    for (const auto &ext : reclaimed) free_exts.push_back(ext);
+
+    qsort(free_exts.data(), free_exts.get_size(), sizeof(Extent), compare_extent_offsets);
+
+    Vector<Extent> compacted;
+    for (const auto &ext : free_exts) {
+        if (compacted.get_size() > 0) {
+            auto &last = compacted.back();
+            if (last.offset + last.length == ext.offset) {
+                last.length += ext.length;
+                ++merged;
+                continue;
+            }
+        }
+
+        compacted.push_back(ext);
+    }
+
+    // Set aside the blocks of the new trees from the end of the group
+    Vector<Extent> pool;
+    num_tree_blocks = num_trees * count_tree_blocks(compacted.get_size(), cluster_size);
+    for (Size i = compacted.get_size(); i > 0 && pool.get_size() < num_tree_blocks; --i) {
+        auto &ext = compacted[i - 1];
+
+        while (ext.length >= cluster_size && pool.get_size() < num_tree_blocks) {
+            ext.length -= cluster_size;
+            pool.push_back({ext.offset + ext.length, cluster_size});
+        }
+    }
+
+    Vector<Extent> by_offset;
+    for (const auto &ext : compacted) {
+        if (ext.length > 0) by_offset.push_back(ext);
+    }
+
+    Vector<Extent> by_length(by_offset.get_size());
+    for (const auto &ext : by_offset) by_length.push_back(ext);
+    qsort(by_length.data(), by_length.get_size(), sizeof(Extent), compare_extent_lengths);
+
+    this->tree_block_pool = &pool;
+
+    status = this->fbt.init(cluster_size);
+    if (status >= Status::OK) {
+        Vector<BmTree::Record<Size, Extent>> records(by_length.get_size());
+        for (const auto &ext : by_length) records.push_back({ext.length, &ext});
+
+        status = this->fbt.bulk_load(records.begin(), records.end());
+    }
+
+    if (status >= Status::OK && this->has_fot) {
+        status = this->fot.init(cluster_size);
+        if (status >= Status::OK) {
+            Vector<BmTree::Record<Address, Extent>> records(by_offset.get_size());
+            for (const auto &ext : by_offset) records.push_back({ext.offset, &ext});
+
+            status = this->fot.bulk_load(records.begin(), records.end());
+        }
+    }
+
+    this->tree_block_pool = nullptr;
+    if (status < Status::OK) return status;
+
+    // The trees were rebuilt from scratch; their blocks were counted as they were allocated
+    this->counters->free_bytes = 0;
+    this->counters->free_extents = by_offset.get_size();
+    for (const auto &ext : by_offset) this->counters->free_bytes += ext.length;
+
+    const auto tail_length = this->get_tail_length();
+    if (tail_length > 0) {
+        this->counters->free_bytes += tail_length;
+        ++this->counters->free_extents;
+    }
+
+    // Return the blocks the trees didn't need
+    for (const auto &ext : pool) {
+        status = this->free_blocks(ext);
+        if (status < Status::OK) return status;
+    }
+
+    return batch.finish(this->store());
+}
+
+Brufs::Status Brufs::AllocGroup::discard_free_space(Size &discarded) {
+    MutexGuard guard(this->lock);
+
+    auto io = this->fs->get_disk()->io;
+    const auto cluster_size = this->fs->get_header().cluster_size;
+
+    // Nothing can be allocated from the group meanwhile, so the spare clusters can go too
+    for (unsigned int i = 0; i < *this->sc_count; ++i) {
+        auto sstatus = io->discard(cluster_size, this->spare_clusters[i].offset);
+        if (sstatus < 0) return static_cast<Status>(sstatus);
+
+        discarded += sstatus;
+    }
+
+    for (const auto &list : this->free_lists) {
+        for (const auto &ext : list) {
+            auto sstatus = io->discard(ext.length, ext.offset);
+            if (sstatus < 0) return static_cast<Status>(sstatus);
+
+            discarded += sstatus;
+        }
+    }
+
+    const auto tail_length = this->get_tail_length();
+    if (tail_length > 0) {
+        auto sstatus = io->discard(tail_length, *this->uninit_start);
+        if (sstatus < 0) return static_cast<Status>(sstatus);
+
+        discarded += sstatus;
+    }
+
+    // The FOT has no stale entries, the FBT only in absence of a FOT
+    BmTree::Cursor<Size, Extent> cursor(this->has_fot ? this->fot : this->fbt);
+
+    Status status;
+    for (status = cursor.seek_first(); status == Status::OK; status = cursor.next()) {
+        const auto &ext = *cursor.get_value();
+
+        auto sstatus = io->discard(ext.length, ext.offset);
+        if (sstatus < 0) return static_cast<Status>(sstatus);
+
+        discarded += sstatus;
+    }
+
+    if (status == Status::E_NOT_FOUND) return Status::OK;
+    return status;
+}
+
+Brufs::Status Brufs::AllocGroup::count_free_blocks(
+    Size &standby, Size &available, Size &extents, Size &in_fbt
+) {
+    MutexGuard guard(this->lock);
+
+    standby += *this->sc_count * this->fs->get_header().cluster_size;
+    available += this->counters->free_bytes;
+    extents += this->counters->free_extents;
+
+    for (const auto &list : this->free_lists) {
+        for (const auto &ext : list) available += ext.length;
+        extents += list.get_size();
+    }
+    in_fbt += this->counters->tree_bytes;
+
+    return Status::OK;
+}
@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.hpp"
+#include "io.hpp"
+#include "BlockCache.hpp"
+#include "Vector.hpp"
+
+namespace {
+
+/**
+ * The number of batches a thread has open on a cache.
+ */
+struct BatchDepth {
+    const Brufs::BlockCache *cache;
+    unsigned int depth;
+};
+
+}
+
+// Threads work on unrelated inodes at once, so one thread's batch mustn't hold back another's
+static thread_local Brufs::Vector<BatchDepth> batch_depths;
+
+static BatchDepth *find_batch_depth(const Brufs::BlockCache *cache) {
+    for (auto &entry : batch_depths) {
+        if (entry.cache == cache) return &entry;
+    }
+
+    return nullptr;
+}
+
+Brufs::BlockCache::BlockCache(Disk *dsk, unsigned int capacity) :
+    dsk(dsk), slots(nullptr), capacity(0), buckets(nullptr), num_buckets(0), hand(0),
+    dirty(nullptr), num_dirty(0), open_batches(0), commit_hook(nullptr), commit_context(nullptr),
+    hits(0), misses(0)
+{
+    if (capacity == 0) return;
+
+    const auto num_buckets = next_power_of_two<unsigned long>(capacity);
+
+    this->slots = static_cast<Slot *>(calloc(capacity, sizeof(Slot)));
+    this->buckets = static_cast<long *>(malloc(num_buckets * sizeof(long)));
+    this->dirty = static_cast<Slot **>(malloc(capacity * sizeof(Slot *)));
+
+    if (!this->slots || !this->buckets || !this->dirty) {
+        free(this->slots);
+        free(this->buckets);
+        free(this->dirty);
+
+        this->slots = nullptr;
+        this->buckets = nullptr;
+        this->dirty = nullptr;
+
+        return;
+    }
+
+    this->capacity = capacity;
+    this->num_buckets = num_buckets;
+
+    for (unsigned int i = 0; i < this->num_buckets; ++i) this->buckets[i] = -1;
+    for (unsigned int i = 0; i < this->capacity; ++i) this->slots[i].next = -1;
+}
+
+Brufs::BlockCache::~BlockCache() {
+    assert(this->open_batches == 0);
+
+    // Best effort; there's no one left to report errors to
+    (void) this->flush();
+
+    for (unsigned int i = 0; i < this->capacity; ++i) {
+        assert(this->slots[i].pins == 0);
+        free(this->slots[i].buf);
+    }
+
+    free(this->slots);
+    free(this->buckets);
+    free(this->dirty);
+}
+
+unsigned int Brufs::BlockCache::hash(Address addr) const {
+    // Fibonacci hashing; block addresses are at least 512-byte aligned
+    return ((addr / BLOCK_SIZE) * 11400714819323198485ULL) >> 32 & (this->num_buckets - 1);
+}
+
+Brufs::BlockCache::Slot *Brufs::BlockCache::find(Address addr) {
+    if (this->capacity == 0) return nullptr;
+
+    for (long i = this->buckets[this->hash(addr)]; i >= 0; i = this->slots[i].next) {
+        if (this->slots[i].addr == addr) return this->slots + i;
+    }
+
+    return nullptr;
+}
+
+void Brufs::BlockCache::unlink(Slot *slot) {
+    const long idx = slot - this->slots;
+    long *link = this->buckets + this->hash(slot->addr);
+
+    while (*link != idx) {
+        assert(*link >= 0);
+        link = &this->slots[*link].next;
+    }
+
+    *link = slot->next;
+
+    slot->next = -1;
+    slot->addr = 0;
+}
+
+void Brufs::BlockCache::forget_dirty(Slot *slot) {
+    if (!slot->dirty) return;
+
+    for (unsigned int i = 0; i < this->num_dirty; ++i) {
+        if (this->dirty[i] != slot) continue;
+
+        this->dirty[i] = this->dirty[--this->num_dirty];
+        break;
+    }
+
+    slot->dirty = false;
+}
+
+Brufs::BlockCache::Slot *Brufs::BlockCache::evict() {
+    // Two full sweeps: the first one may only clear the reference bits
+    for (unsigned int i = 0; i < 2 * this->capacity; ++i) {
+        auto slot = this->slots + this->hand;
+        this->hand = (this->hand + 1) % this->capacity;
+
+        if (slot->pins > 0 || slot->dirty) continue;
+        if (slot->addr == 0) return slot;
+
+        if (slot->referenced) {
+            slot->referenced = false;
+            continue;
+        }
+
+        this->unlink(slot);
+        return slot;
+    }
+
+    return nullptr;
+}
+
+Brufs::Status Brufs::BlockCache::acquire(Address addr, Size length, Slot *&slot, bool load) {
+    MutexGuard guard(this->mutex);
+
+    assert(addr != 0);
+
+    auto found = this->find(addr);
+    if (found && found->length == length) {
+        if (load) ++this->hits;
+
+        found->referenced = true;
+        ++found->pins;
+
+        slot = found;
+        return Status::OK;
+    }
+
+    if (load) ++this->misses;
+
+    if (found) {
+        // The block is cached with a different size; only replace it if no one's using it
+        if (found->pins > 0 || found->dirty) return Status::E_NO_SPACE;
+        this->unlink(found);
+    }
+
+    auto victim = this->evict();
+    if (!victim) return Status::E_NO_SPACE;
+
+    if (victim->length != length || !victim->buf) {
+        auto buf = static_cast<char *>(realloc(victim->buf, length));
+        if (!buf) return Status::E_NO_MEM;
+
+        victim->buf = buf;
+        victim->length = length;
+    }
+
+    if (load) {
+        SSize status = dread(this->dsk, victim->buf, length, addr);
+        if (status < 0) return static_cast<Status>(status);
+    }
+
+    const auto bucket = this->hash(addr);
+
+    victim->addr = addr;
+    victim->next = this->buckets[bucket];
+    victim->pins = 1;
+    victim->referenced = true;
+
+    this->buckets[bucket] = victim - this->slots;
+
+    slot = victim;
+    return Status::OK;
+}
+
+void Brufs::BlockCache::release(Slot *slot) {
+    MutexGuard guard(this->mutex);
+
+    assert(slot->pins > 0);
+    --slot->pins;
+}
+
+Brufs::Status Brufs::BlockCache::read(Address addr, Size length, void *buf) {
+    MutexGuard guard(this->mutex);
+
+    Slot *slot;
+    auto status = this->acquire(addr, length, slot);
+    if (status == Status::E_NO_SPACE || status == Status::E_NO_MEM) {
+        // No room in the cache, bypass it
+        SSize sstatus = dread(this->dsk, buf, length, addr);
+        if (sstatus < 0) return static_cast<Status>(sstatus);
+
+        return Status::OK;
+    }
+
+    if (status < Status::OK) return status;
+
+    memcpy(buf, slot->buf, length);
+    this->release(slot);
+
+    return Status::OK;
+}
+
+Brufs::Status Brufs::BlockCache::write(Address addr, Size length, const void *buf) {
+    MutexGuard guard(this->mutex);
+
+    if (this->in_batch()) {
+        Slot *slot;
+        auto status = this->acquire(addr, length, slot, false);
+        if (status >= Status::OK) {
+            memcpy(slot->buf, buf, length);
+
+            if (!slot->dirty) {
+                slot->dirty = true;
+                this->dirty[this->num_dirty++] = slot;
+            }
+
+            this->release(slot);
+            return Status::OK;
+        }
+
+        // No room to defer the write; fall through and write it immediately
+    }
+
+    SSize sstatus = dwrite(this->dsk, buf, length, addr);
+    if (sstatus < 0) {
+        this->invalidate(addr, length);
+        return static_cast<Status>(sstatus);
+    }
+
+    Slot *slot;
+    auto status = this->acquire(addr, length, slot, false);
+    if (status < Status::OK) {
+        // Not being able to cache the block is harmless, as long as no stale copy remains
+        this->invalidate(addr, length);
+        return Status::OK;
+    }
+
+    memcpy(slot->buf, buf, length);
+    this->release(slot);
+
+    return Status::OK;
+}
+
+void Brufs::BlockCache::invalidate(Address addr, Size length) {
+    MutexGuard guard(this->mutex);
+
+    for (unsigned int i = 0; i < this->capacity; ++i) {
+        auto slot = this->slots + i;
+        if (slot->addr == 0 || slot->addr < addr || slot->addr >= addr + length) continue;
+
+        // Pinned slots are unhashed as well; they're reused once they are released
+        this->forget_dirty(slot);
+        this->unlink(slot);
+    }
+}
+
+void Brufs::BlockCache::clear() {
+    this->invalidate(0, ~static_cast<Size>(0));
+}
+
+bool Brufs::BlockCache::in_batch() const {
+    return find_batch_depth(this) != nullptr;
+}
+
+void Brufs::BlockCache::begin_batch() {
+    MutexGuard guard(this->mutex);
+
+    ++this->open_batches;
+
+    auto entry = find_batch_depth(this);
+    if (entry) {
+        ++entry->depth;
+    } else {
+        batch_depths.push_back({this, 1});
+    }
+}
+
+Brufs::Status Brufs::BlockCache::end_batch() {
+    Status status;
+
+    {
+        MutexGuard guard(this->mutex);
+
+        auto entry = find_batch_depth(this);
+        assert(entry && entry->depth > 0);
+
+        --this->open_batches;
+        if (--entry->depth > 0) return Status::OK;
+
+        *entry = batch_depths.back();
+        batch_depths.pop_back();
+
+        status = this->flush();
+    }
+
+    // The hook may take locks of its own, which are held while calling into the cache
+    if (status < Status::OK || !this->commit_hook) return status;
+    return this->commit_hook(this->commit_context);
+}
+
+static int compare_slot_addrs(const void *a, const void *b) {
+    const auto left = (*static_cast<Brufs::BlockCache::Slot * const *>(a))->addr;
+    const auto right = (*static_cast<Brufs::BlockCache::Slot * const *>(b))->addr;
+
+    return (left > right) - (left < right);
+}
+
+Brufs::Status Brufs::BlockCache::flush() {
+    MutexGuard guard(this->mutex);
+
+    if (this->num_dirty == 0) return Status::OK;
+
+    // Writing in address order keeps the disk head moving in one direction
+    qsort(this->dirty, this->num_dirty, sizeof(Slot *), compare_slot_addrs);
+
+    auto result = Status::OK;
+    unsigned int kept = 0;
+
+    for (unsigned int i = 0; i < this->num_dirty; ++i) {
+        auto slot = this->dirty[i];
+
+        SSize sstatus = dwrite(this->dsk, slot->buf, slot->length, slot->addr);
+        if (sstatus < 0) {
+            if (result == Status::OK) result = static_cast<Status>(sstatus);
+            this->dirty[kept++] = slot;
+            continue;
+        }
+
+        slot->dirty = false;
+    }
+
+    this->num_dirty = kept;
+    return result;
+}
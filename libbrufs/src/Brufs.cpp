@@ -20,6 +20,7 @@
  * SOFTWARE.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -31,10 +32,7 @@
 #include "Brufs.hpp"
 #include "File.hpp"
 #include "Directory.hpp"
-
-static constexpr unsigned long MEGABYTE = 1024 * 1024;
-static constexpr unsigned long GIGABYTE = 1024 * MEGABYTE;
-static constexpr unsigned long INITIAL_FREE_EXTENT_LENGTH = 4 * GIGABYTE;
+#include "Vector.hpp"
 
 struct pl {
     Brufs::RootHeader *coll;
@@ -50,12 +48,12 @@ bool equiv_values(const RootHeader *current, const RootHeader *replacement) {
 
 }}
 
-Brufs::Brufs::Brufs(Disk *dsk) :
-        dsk(dsk), raw_header(nullptr),
-        fbt(this, nullptr, BmTree::ALLOC_FBT_BLOCK), rht(this, nullptr)
+Brufs::Brufs::Brufs(Disk *dsk, unsigned int cache_capacity) :
+        dsk(dsk), cache(dsk, cache_capacity), raw_header(nullptr), rht(this, nullptr)
 {
-    Header temp_header;
-    memset(&temp_header, 0, sizeof(temp_header));
+    this->cache.set_commit_hook(Brufs::commit_batch, this);
+
+    Header temp_header {};
 
     this->stt = static_cast<Status>(dread(dsk, &temp_header, sizeof(temp_header), 0));
     if (this->stt < 0) return;
@@ -72,9 +70,11 @@ Brufs::Brufs::Brufs(Disk *dsk) :
     this->stt = static_cast<Status>(dread(dsk, this->raw_header, temp_header.cluster_size, 0));
     if (this->stt < 0) return;
 
-    this->fbt.set_target(&this->hdr->fbt_address);
-    this->stt = this->fbt.update_root(this->hdr->fbt_address, this->hdr->cluster_size);
-    if (this->stt < Status::OK) return;
+    this->create_groups();
+    for (unsigned int i = 0; i < this->num_groups; ++i) {
+        this->stt = this->groups[i]->load();
+        if (this->stt < Status::OK) return;
+    }
 
     this->rht.set_target(&this->hdr->rht_address);
     this->stt = this->rht.update_root(this->hdr->rht_address, this->hdr->cluster_size);
@@ -84,24 +84,253 @@ Brufs::Brufs::Brufs(Disk *dsk) :
 }
 
 Brufs::Brufs::~Brufs() {
+    // Best effort, like the cache does for its dirty blocks
+    (void) this->spill_free_lists();
+    (void) this->cache.flush();
+
+    if (this->write_header() >= Status::OK) {
+        // No batches are open anymore, so whatever was freed is free on the disk as well
+        MutexGuard guard(this->discard_lock);
+        for (const auto &pending : this->pending_discards) {
+            this->committed_discards.push_back(pending.extent);
+        }
+
+        this->pending_discards.clear();
+    }
+
+    (void) this->flush_discards();
+
+    this->destroy_groups();
     free(this->raw_header);
 }
 
 Brufs::Status Brufs::Brufs::store_header() {
+    MutexGuard guard(this->lock);
+
+    this->header_dirty = true;
+
+    // The batch writes the header once it ends
+    if (this->cache.in_batch()) return Status::OK;
+
+    return this->write_header();
+}
+
+Brufs::Status Brufs::Brufs::write_header() {
+    MutexGuard guard(this->lock);
+
+    // The thread is still in a batch, which writes the header when it ends
+    if (!this->header_dirty || this->cache.in_batch()) return Status::OK;
+
     this->hdr->checksum = 0;
     this->hdr->checksum = XXH64(this->hdr, this->hdr->header_size, CHECKSUM_SEED);
 
     SSize sstt = dwrite(this->dsk, this->raw_header, this->hdr->cluster_size, 0);
     if (sstt < 0) return static_cast<Status>(sstt);
 
+    this->header_dirty = false;
     return Status::OK;
 }
 
+Brufs::Status Brufs::Brufs::commit_batch(void *fs) {
+    auto self = static_cast<Brufs *>(fs);
+
+    {
+        MutexGuard guard(self->lock);
+
+        // Batches of other threads may have changed the header since the blocks were written,
+        // and the header must never point at blocks that haven't reached the disk
+        if (self->header_dirty) {
+            auto status = self->cache.flush();
+            if (status < Status::OK) return status;
+        }
+
+        // If the header can't be written, the freed extents are still in use on the disk
+        auto status = self->write_header();
+        if (status < Status::OK) return status;
+
+        self->commit_discards();
+    }
+
+    return self->flush_discards();
+}
+
+// Threads are numbered in the order they first allocate or free
+static unsigned int next_thread_number = 0;
+static thread_local unsigned int thread_number =
+    __atomic_fetch_add(&next_thread_number, 1, __ATOMIC_RELAXED);
+
+/*
+ * Discarding
+ */
+
+static int compare_extent_offsets(const void *a, const void *b) {
+    const auto left = static_cast<const Brufs::Extent *>(a)->offset;
+    const auto right = static_cast<const Brufs::Extent *>(b)->offset;
+
+    return (left > right) - (left < right);
+}
+
+void Brufs::Brufs::queue_discard(const Extent &ext) {
+    MutexGuard guard(this->discard_lock);
+    this->pending_discards.push_back({ext, thread_number});
+}
+
+void Brufs::Brufs::cancel_discards(const Extent &ext) {
+    MutexGuard guard(this->discard_lock);
+
+    const auto overlaps = [&](const Extent &other) {
+        return other.offset < ext.offset + ext.length && ext.offset < other.offset + other.length;
+    };
+
+    // Not discarding is always safe, so drop the overlapping extents entirely
+    Size kept = 0;
+    for (const auto &pending : this->pending_discards) {
+        if (!overlaps(pending.extent)) this->pending_discards[kept++] = pending;
+    }
+
+    while (this->pending_discards.get_size() > kept) this->pending_discards.pop_back();
+
+    kept = 0;
+    for (const auto &committed : this->committed_discards) {
+        if (!overlaps(committed)) this->committed_discards[kept++] = committed;
+    }
+
+    while (this->committed_discards.get_size() > kept) this->committed_discards.pop_back();
+}
+
+void Brufs::Brufs::commit_discards() {
+    MutexGuard guard(this->discard_lock);
+
+    // The extents freed by other threads may belong to batches that are still open
+    Size kept = 0;
+    for (const auto &pending : this->pending_discards) {
+        if (pending.thread == thread_number) {
+            this->committed_discards.push_back(pending.extent);
+        } else {
+            this->pending_discards[kept++] = pending;
+        }
+    }
+
+    while (this->pending_discards.get_size() > kept) this->pending_discards.pop_back();
+}
+
+Brufs::Status Brufs::Brufs::flush_discards() {
+    // Held while discarding, so an extent allocated again can't be discarded under its new owner
+    MutexGuard guard(this->discard_lock);
+
+    auto &pending = this->committed_discards;
+    if (pending.get_size() == 0) return Status::OK;
+
+    qsort(pending.data(), pending.get_size(), sizeof(Extent), compare_extent_offsets);
+
+    for (Size i = 0; i < pending.get_size();) {
+        const Size first = i;
+
+        Extent merged = pending[i];
+        for (++i; i < pending.get_size(); ++i) {
+            if (pending[i].offset != merged.offset + merged.length) break;
+            merged.length += pending[i].length;
+        }
+
+        const auto status = this->dsk->io->discard(merged.length, merged.offset);
+        if (status == Status::E_UNSUPPORTED) break;
+
+        // Keep what hasn't been sent for the next flush
+        if (status < 0) {
+            Size kept = 0;
+            for (Size j = first; j < pending.get_size(); ++j) pending[kept++] = pending[j];
+            while (pending.get_size() > kept) pending.pop_back();
+
+            return static_cast<Status>(status);
+        }
+    }
+
+    pending.clear();
+    return Status::OK;
+}
+
+Brufs::Status Brufs::Brufs::set_discarding(bool enable) {
+    {
+        MutexGuard guard(this->lock);
+        this->hdr->set_flag(DISCARD_FREED, enable);
+    }
+
+    if (!enable) {
+        MutexGuard guard(this->discard_lock);
+        this->pending_discards.clear();
+        this->committed_discards.clear();
+    }
+
+    return this->store_header();
+}
+
+Brufs::Status Brufs::Brufs::discard_free_space(Size &discarded) {
+    discarded = 0;
+
+    auto status = this->flush_discards();
+    if (status < Status::OK) return status;
+
+    for (unsigned int i = 0; i < this->num_groups; ++i) {
+        status = this->groups[i]->discard_free_space(discarded);
+        if (status < Status::OK) return status;
+    }
+
+    return Status::OK;
+}
+
+/*
+ * Allocation groups
+ */
+
+void Brufs::Brufs::create_groups() {
+    this->destroy_groups();
+
+    const Size disk_size = this->dsk->io->get_size();
+    const bool has_groups = this->hdr->header_size > offsetof(Header, ag_size);
+    const Size ag_size = has_groups ? this->hdr->ag_size : 0;
+
+    // The last group takes the remainder of the disk
+    this->num_groups = ag_size == 0 ? 1 : max<Size, Size>(disk_size / ag_size, 1);
+    this->groups = static_cast<AllocGroup **>(malloc(this->num_groups * sizeof(AllocGroup *)));
+    assert(this->groups);
+
+    const Address first_end = this->num_groups == 1 ? disk_size : ag_size;
+    this->groups[0] = new AllocGroup(this, this->lock, this->hdr, first_end);
+
+    for (unsigned int i = 1; i < this->num_groups; ++i) {
+        const Address end = i == this->num_groups - 1 ? disk_size : (i + 1) * ag_size;
+        this->groups[i] = new AllocGroup(this, i, i * ag_size, end);
+    }
+}
+
+void Brufs::Brufs::destroy_groups() {
+    for (unsigned int i = 0; i < this->num_groups; ++i) delete this->groups[i];
+    free(this->groups);
+
+    this->groups = nullptr;
+    this->num_groups = 0;
+}
+
+unsigned int Brufs::Brufs::group_of(Address addr) const {
+    if (this->num_groups == 1) return 0;
+    return min<Size>(addr / this->hdr->ag_size, this->num_groups - 1);
+}
+
+unsigned int Brufs::Brufs::preferred_group() const {
+    return thread_number % this->num_groups;
+}
+
+Brufs::Address Brufs::Brufs::get_root_goal(const RootHeader &root) const {
+    return this->groups[root.hash() % this->num_groups]->get_start();
+}
+
 /*
  * Initialization
  */
 
 Brufs::Status Brufs::Brufs::init(Header &protoheader) {
+    this->cache.clear();
+
     free(this->raw_header);
     this->raw_header = static_cast<char *>(malloc(1 << protoheader.cluster_size_exp));
     assert(this->raw_header);
@@ -124,40 +353,25 @@ Brufs::Status Brufs::Brufs::init(Header &protoheader) {
     this->hdr->sc_high_mark = protoheader.sc_high_mark;
     this->hdr->sc_count = 0;
 
-    // Provide some free extents for the FBT
-    Extent *spares = this->get_spare_clusters();
-    for (int i = 0; i < this->hdr->sc_high_mark; ++i) {
-        spares[i] = {(i + 1) * this->hdr->cluster_size, this->hdr->cluster_size};
-    }
-    this->hdr->sc_count = this->hdr->sc_high_mark;
-
-    // Initialize the FBT with 1-megabyte blocks
-    Address dyn_start = (this->hdr->sc_high_mark + 1) * this->hdr->cluster_size;
-    Size remaining = this->dsk->io->get_size() - dyn_start;
-
-    this->fbt.set_target(&this->hdr->fbt_address);
-    Status stt = this->fbt.init(this->hdr->cluster_size);
-    if (stt < Status::OK) return stt;
-
-    while (remaining > INITIAL_FREE_EXTENT_LENGTH) {
-        Extent free_ext{dyn_start, INITIAL_FREE_EXTENT_LENGTH};
-
-        stt = this->fbt.insert(INITIAL_FREE_EXTENT_LENGTH, free_ext);
-        if (stt < Status::OK) return stt;
-
-        dyn_start += INITIAL_FREE_EXTENT_LENGTH;
-        remaining -= INITIAL_FREE_EXTENT_LENGTH;
+    this->hdr->ag_size = protoheader.ag_size;
+    this->hdr->flags = protoheader.flags;
+    if (this->hdr->ag_size != 0) {
+        const auto min_size = 2 * (this->hdr->sc_high_mark + 1) * this->hdr->cluster_size;
+        if (this->hdr->ag_size % this->hdr->cluster_size != 0 || this->hdr->ag_size < min_size) {
+            return Status::E_INVALID_ARGUMENT;
+        }
     }
 
-    if (remaining > 0) {
-        Extent free_ext{dyn_start, remaining};
-        stt = this->fbt.insert(INITIAL_FREE_EXTENT_LENGTH, free_ext);
+    this->create_groups();
+    for (unsigned int i = 0; i < this->num_groups; ++i) {
+        Status stt = this->groups[i]->init();
         if (stt < Status::OK) return stt;
     }
 
     // Initialize the RHT
     this->rht.set_target(&this->hdr->rht_address);
-    stt = this->rht.init(this->hdr->cluster_size);
+    // Counted, so listing and counting roots is logarithmic
+    Status stt = this->rht.init(this->hdr->cluster_size, true);
     if (stt < Status::OK) return stt;
 
     // Store the header
@@ -168,105 +382,142 @@ Brufs::Status Brufs::Brufs::init(Header &protoheader) {
  * Free cluster management
  */
 
-Brufs::Status Brufs::Brufs::allocate_blocks(Size length, Extent &target) {
+Brufs::Status Brufs::Brufs::allocate_blocks(Size length, Extent &target, Address goal) {
     if (length != BLOCK_SIZE && (length % this->hdr->cluster_size != 0)) {
         return Status::E_MISALIGNED;
     }
 
-    Extent result;
-    Status status = this->fbt.remove(length, result);
-    if (status == Status::E_NOT_FOUND) return Status::E_WONT_FIT;
-    if (status < 0) return status;
+    // Outside of the group locks, so the commit can wait for the filesystem lock
+    BlockCache::Batch batch(this->cache);
 
-    target = {result.offset, length};
+    const auto first = goal != 0 ? this->group_of(goal) : this->preferred_group();
+    for (unsigned int i = 0; i < this->num_groups; ++i) {
+        auto group = this->groups[(first + i) % this->num_groups];
 
-    if (result.length > length) {
-        Extent residual {result.offset + length, result.length - length};
-        status = this->fbt.insert(residual.length, residual);
-        if (status < 0) return status;
+        auto status = group->allocate_blocks(length, target, i == 0 ? goal : 0);
+        if (status != Status::E_WONT_FIT) return batch.finish(status);
     }
 
-    auto list = this->get_spare_clusters();
-    while (this->hdr->sc_count < this->hdr->sc_low_mark) {
-        Extent replacement;
-        status = this->fbt.remove(this->hdr->cluster_size, replacement);
-        if (status < Status::OK) return status;
+    return batch.finish(Status::E_WONT_FIT);
+}
 
-        while (
-            replacement.length >= this->hdr->cluster_size
-            && this->hdr->sc_count < this->hdr->sc_low_mark
-        ) {
-            list[this->hdr->sc_count] = replacement;
-            replacement.offset += this->hdr->cluster_size;
-            replacement.length -= this->hdr->cluster_size;
+Brufs::Status Brufs::Brufs::allocate_extents(Size length, Address goal, Vector<Extent> &target) {
+    if (length != BLOCK_SIZE && (length % this->hdr->cluster_size != 0)) {
+        return Status::E_MISALIGNED;
+    }
 
-            ++this->hdr->sc_count;
-        }
+    BlockCache::Batch batch(this->cache);
 
-        status = this->store_header();
-        if (status < Status::OK) return status;
+    target.clear();
 
-        if (replacement.length > 0) {
-            status = this->fbt.insert(replacement.length, replacement);
-            if (status < Status::OK) return status;
-        }
+    Extent ext;
+    auto status = this->allocate_blocks(length, ext, goal);
+    if (status != Status::E_WONT_FIT) {
+        if (status >= Status::OK) target.push_back(ext);
+        return batch.finish(status);
     }
 
-    return this->store_header();
+    // No single extent fits, so take the largest ones until the request is covered
+    const auto first = goal != 0 ? this->group_of(goal) : this->preferred_group();
+    Size remaining = length;
+    for (unsigned int i = 0; i < this->num_groups && remaining > 0; ++i) {
+        status = this->groups[(first + i) % this->num_groups]->take_extents(remaining, target);
+        if (status < Status::OK) break;
+    }
+
+    if (status < Status::OK || remaining > 0) {
+        for (const auto &taken : target) (void) this->free_blocks(taken);
+        target.clear();
+
+        return status < Status::OK ? status : Status::E_WONT_FIT;
+    }
+
+    return batch.finish(Status::OK);
 }
 
 Brufs::Status Brufs::Brufs::allocate_tree_blocks(UNUSED Size length, Extent &target) {
-    if (this->hdr->sc_count == 0) return Status::E_NO_SPACE;
-    --this->hdr->sc_count;
+    return this->groups[0]->allocate_tree_blocks(target);
+}
+
+Brufs::Status Brufs::Brufs::free_blocks(const Extent &ext) {
+    BlockCache::Batch batch(this->cache);
+    return batch.finish(this->groups[this->group_of(ext.offset)]->free_blocks(ext));
+}
 
-    auto list = this->get_spare_clusters();
-    target = list[this->hdr->sc_count];
+Brufs::Status Brufs::Brufs::compact_free_space(Size &merged) {
+    BlockCache::Batch batch(this->cache);
 
-    return this->store_header();
+    merged = 0;
+
+    for (unsigned int i = 0; i < this->num_groups; ++i) {
+        auto status = this->groups[i]->compact_free_space(merged);
+        if (status < Status::OK) return status;
+    }
+
+    return batch.finish(Status::OK);
 }
 
-Brufs::Status Brufs::Brufs::free_blocks(const Extent &ext) {
-    auto fbt_block_size = this->hdr->cluster_size;
+Brufs::Status Brufs::Brufs::spill_free_lists() {
+    BlockCache::Batch batch(this->cache);
 
-    if (this->hdr->sc_count < this->hdr->sc_high_mark && ext.length >= fbt_block_size) {
-        auto list = this->get_spare_clusters();
+    for (unsigned int i = 0; i < this->num_groups; ++i) {
+        auto status = this->groups[i]->spill_free_lists();
+        if (status < Status::OK) return status;
+    }
+
+    return batch.finish(Status::OK);
+}
 
-        list[this->hdr->sc_count++] = {ext.offset, fbt_block_size};
+Brufs::Status Brufs::Brufs::refill_spare_clusters() {
+    BlockCache::Batch batch(this->cache);
 
-        auto status = this->store_header();
+    for (unsigned int i = 0; i < this->num_groups; ++i) {
+        auto status = this->groups[i]->top_up_spare_clusters();
         if (status < Status::OK) return status;
+    }
 
-        Extent residual {ext.offset + fbt_block_size, ext.length - fbt_block_size};
-        if (ext.length > fbt_block_size) {
-            auto status = this->fbt.insert(residual.length, residual);
-            if (status < Status::OK) return status;
-        }
+    return batch.finish(Status::OK);
+}
 
-        return Status::OK;
+Brufs::Status Brufs::Brufs::set_spare_cluster_marks(uint8_t low_mark, uint8_t high_mark) {
+    if (low_mark == 0 || low_mark > high_mark) return Status::E_INVALID_ARGUMENT;
+
+    // The spare cluster lists directly follow the headers, in their first cluster
+    const Size header_size = max<Size, Size>(this->hdr->header_size, sizeof(GroupHeader));
+    if (header_size + high_mark * sizeof(Extent) > this->hdr->cluster_size) {
+        return Status::E_HEADER_TOO_BIG;
     }
 
-    return this->fbt.insert(ext.length, ext);
+    BlockCache::Batch batch(this->cache);
+
+    {
+        MutexGuard guard(this->lock);
+        this->hdr->sc_low_mark = low_mark;
+        this->hdr->sc_high_mark = high_mark;
+    }
+
+    for (unsigned int i = 0; i < this->num_groups; ++i) {
+        auto status = this->groups[i]->release_excess_spare_clusters();
+        if (status < Status::OK) return status;
+    }
+
+    return batch.finish(this->store_header());
 }
 
 Brufs::Status Brufs::Brufs::count_free_blocks(
     Size &standby, Size &available, Size &extents, Size &in_fbt
 ) {
-    standby = this->hdr->sc_count * this->hdr->cluster_size;
-
+    standby = 0;
     available = 0;
-    in_fbt = 0;
     extents = 0;
+    in_fbt = 0;
 
-    auto status = this->fbt.count_used_space(in_fbt);
-    if (status < Status::OK) return status;
-
-    status = this->fbt.count_values(extents);
-    if (status < Status::OK) return status;
+    for (unsigned int i = 0; i < this->num_groups; ++i) {
+        auto status = this->groups[i]->count_free_blocks(standby, available, extents, in_fbt);
+        if (status < Status::OK) return status;
+    }
 
-    return this->fbt.walk<Size *>([](UNUSED auto last, auto ext, auto acc) {
-        *acc += ext->length;
-        return Status::OK;
-    }, &available);
+    return Status::OK;
 }
 
 /*
@@ -283,6 +534,8 @@ static Brufs::Status consume_root(UNUSED Brufs::Hash &hash, Brufs::RootHeader *r
 }
 
 Brufs::SSize Brufs::Brufs::count_roots() {
+    MutexGuard guard(this->lock);
+
     Size count;
     Status stt = this->rht.count_values(count);
 
@@ -292,6 +545,8 @@ Brufs::SSize Brufs::Brufs::count_roots() {
 }
 
 int Brufs::Brufs::collect_roots(RootHeader *coll, Size count) {
+    MutexGuard guard(this->lock);
+
     pl payload{coll, count};
 
     Status stt = this->rht.walk<pl &>(consume_root, payload);
@@ -309,6 +564,8 @@ Brufs::Status Brufs::Brufs::find_root(const char *name, RootHeader &target) {
 
     const Hash hash = XXH64(name, strlen(lbl), HASH_SEED);
 
+    MutexGuard guard(this->lock);
+
     RootHeader roots[MAX_COLLISIONS];
     int num = this->rht.search(hash, roots, MAX_COLLISIONS, true);
     if (num < 0) return static_cast<Status>(num);
@@ -329,6 +586,8 @@ Brufs::Status Brufs::Brufs::find_root(const char *name, RootHeader &target) {
 }
 
 Brufs::Status Brufs::Brufs::add_root(const RootHeader &rt) {
+    MutexGuard guard(this->lock);
+
     RootHeader dummy;
     Status stt = this->find_root(rt.label, dummy);
     if (stt == Status::OK) return Status::E_EXISTS;
@@ -338,5 +597,7 @@ Brufs::Status Brufs::Brufs::add_root(const RootHeader &rt) {
 }
 
 Brufs::Status Brufs::Brufs::update_root(const RootHeader &rt) {
+    MutexGuard guard(this->lock);
+
     return this->rht.update(rt.hash(), rt);
 }
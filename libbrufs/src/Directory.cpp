@@ -37,8 +37,9 @@ Brufs::Status Brufs::Directory::init(const InodeId &id, const InodeHeader *hdr)
     auto status = Inode::init(id, hdr);
     if (status < Status::OK) return status;
 
+    // Counted, so readdir offsets and emptiness checks don't need to scan every leaf
     FileEntryTree entries(*this);
-    status = entries.init();
+    status = entries.init(0, true);
     if (status < Status::OK) return status;
 
     this->enable_store = true;
@@ -126,12 +127,21 @@ Brufs::SSize Brufs::Directory::count() {
 }
 
 Brufs::Status Brufs::Directory::collect(Vector<DirectoryEntry> &entries) {
+    return this->collect(entries, 0, SIZE_MAX);
+}
+
+Brufs::Status Brufs::Directory::collect(Vector<DirectoryEntry> &entries, Size offset, Size max) {
     entries.clear();
-    entries.reserve(this->count());
 
     FileEntryTree tree(*this);
-    return tree.walk<Vector<DirectoryEntry> *>([](UNUSED auto k, auto e, auto v) {
-        v->push_back(*e);
-        return Status::OK;
-    }, &entries);
+    BmTree::Cursor<Hash, DirectoryEntry> cursor(tree);
+
+    auto status = cursor.seek_to_nth(offset);
+    while (status == Status::OK && entries.get_size() < max) {
+        entries.push_back(*cursor.get_value());
+        status = cursor.next();
+    }
+
+    if (status == Status::E_NOT_FOUND) return Status::OK;
+    return status;
 }
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "ExtentMap.hpp"
+
+Brufs::Size Brufs::ExtentMap::find_index(const Offset offset) const {
+    Size low = 0;
+    Size high = this->extents.get_size();
+
+    while (low < high) {
+        const auto mid = low + (high - low) / 2;
+        if (this->extents[mid].get_local_end() > offset) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return low;
+}
+
+bool Brufs::ExtentMap::is_loaded() {
+    MutexGuard guard(this->mutex);
+
+    return this->loaded;
+}
+
+void Brufs::ExtentMap::load(const Vector<DataExtent> &extents) {
+    MutexGuard guard(this->mutex);
+
+    // Readers may race to load the map, the first one wins
+    if (this->loaded) return;
+
+    this->extents = extents;
+    this->loaded = true;
+}
+
+void Brufs::ExtentMap::invalidate() {
+    MutexGuard guard(this->mutex);
+
+    this->extents.clear();
+    this->loaded = false;
+}
+
+Brufs::Status Brufs::ExtentMap::find(const Offset offset, DataExtent &target) {
+    MutexGuard guard(this->mutex);
+
+    const auto index = this->find_index(offset);
+    if (index == this->extents.get_size()) return Status::E_NOT_FOUND;
+
+    target = this->extents[index];
+    return Status::OK;
+}
+
+void Brufs::ExtentMap::find_range(
+    const Offset start, const Offset end, Vector<DataExtent> &target
+) {
+    MutexGuard guard(this->mutex);
+
+    for (auto i = this->find_index(start); i < this->extents.get_size(); ++i) {
+        if (this->extents[i].local_start >= end) break;
+
+        target.push_back(this->extents[i]);
+    }
+}
+
+Brufs::Status Brufs::ExtentMap::get_last(DataExtent &target) {
+    MutexGuard guard(this->mutex);
+
+    if (this->extents.empty()) return Status::E_NOT_FOUND;
+
+    target = this->extents.back();
+    return Status::OK;
+}
+
+void Brufs::ExtentMap::insert(const DataExtent &extent) {
+    MutexGuard guard(this->mutex);
+
+    const auto index = this->find_index(extent.local_start);
+
+    // Appending is the common case, which doesn't move anything
+    this->extents.push_back(extent);
+    for (auto i = this->extents.get_size() - 1; i > index; --i) {
+        this->extents[i] = this->extents[i - 1];
+    }
+    this->extents[index] = extent;
+}
+
+void Brufs::ExtentMap::remove(const DataExtent &extent) {
+    MutexGuard guard(this->mutex);
+
+    const auto index = this->find_index(extent.local_start);
+    if (index == this->extents.get_size()) return;
+    if (this->extents[index].local_start != extent.local_start) return;
+
+    for (auto i = index + 1; i < this->extents.get_size(); ++i) {
+        this->extents[i - 1] = this->extents[i];
+    }
+    this->extents.pop_back();
+}
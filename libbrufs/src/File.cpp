@@ -36,6 +36,97 @@ Brufs::Size Brufs::Inode::get_data_size() const {
     return inode_size - inode_header_size;
 }
 
+/**
+ * Loads the attached extent map from the extent tree, unless it's loaded already.
+ */
+Brufs::Status Brufs::File::load_extent_map() {
+    if (this->extent_map->is_loaded()) return Status::OK;
+
+    InodeExtentTree iet(*this);
+    Vector<DataExtent> extents;
+    {
+        BmTree::Cursor<Offset, DataExtent> cursor(iet);
+
+        Status status;
+        for (status = cursor.seek_first(); status == Status::OK; status = cursor.next()) {
+            extents.push_back(*cursor.get_value());
+        }
+
+        if (status != Status::E_NOT_FOUND) return status;
+    }
+
+    this->extent_map->load(extents);
+    return Status::OK;
+}
+
+/**
+ * Finds the first extent that ends after an offset in the file.
+ */
+Brufs::Status Brufs::File::find_extent(const Offset offset, DataExtent &target) {
+    if (!this->extent_map) {
+        InodeExtentTree iet(*this);
+        return iet.search(offset, target);
+    }
+
+    auto status = this->load_extent_map();
+    if (status < Status::OK) return status;
+
+    return this->extent_map->find(offset, target);
+}
+
+/**
+ * Collects the extents that overlap a range of the file, ordered by file offset.
+ */
+Brufs::Status Brufs::File::find_extents(
+    const Offset start, const Offset end, Vector<DataExtent> &target
+) {
+    if (this->extent_map) {
+        auto status = this->load_extent_map();
+        if (status < Status::OK) return status;
+
+        this->extent_map->find_range(start, end, target);
+        return Status::OK;
+    }
+
+    InodeExtentTree iet(*this);
+    BmTree::Cursor<Offset, DataExtent> cursor(iet);
+
+    Status status;
+    for (status = cursor.seek(start); status == Status::OK; status = cursor.next()) {
+        const auto &extent = *cursor.get_value();
+        if (extent.local_start >= end) break;
+
+        target.push_back(extent);
+    }
+
+    if (status < Status::OK && status != Status::E_NOT_FOUND) return status;
+    return Status::OK;
+}
+
+/**
+ * Finds the extent at the highest offset in the file.
+ */
+Brufs::Status Brufs::File::find_last_extent(DataExtent &target) {
+    if (!this->extent_map) {
+        InodeExtentTree iet(*this);
+        return iet.get_last(target);
+    }
+
+    auto status = this->load_extent_map();
+    if (status < Status::OK) return status;
+
+    return this->extent_map->get_last(target);
+}
+
+/**
+ * Drops the attached extent map after a change to the extent tree failed, which may have left
+ * the tree partially changed; the map is loaded from the tree again on next use.
+ */
+Brufs::Status Brufs::File::forget_extents(const Status status) {
+    if (this->extent_map) this->extent_map->invalidate();
+    return status;
+}
+
 Brufs::Status Brufs::File::truncate(Size new_size) {
     const auto old_size = this->get_size();
     if (old_size == new_size) return Status::OK;
@@ -64,12 +155,11 @@ Brufs::Status Brufs::File::resize_small_to_small(UNUSED const Size old_size, con
 Brufs::Status Brufs::File::resize_big_to_small(UNUSED const Size old_size, const Size new_size) {
     Vector<uint8_t> buf(new_size);
 
-    for (Size copied = 0; copied < new_size;) {
-        SSize read = this->read(buf.data() + copied, new_size - copied, copied);
-        if (read < Status::OK) return static_cast<Status>(read);
+    SSize read = this->read_full(buf.data(), new_size, 0);
+    if (read < Status::OK) return static_cast<Status>(read);
 
-        copied += read;
-    }
+    // Small files have no extents to map
+    if (this->extent_map) this->extent_map->invalidate();
 
     InodeExtentTree iet(*this);
     Status status = iet.destroy();
@@ -89,7 +179,9 @@ Brufs::Status Brufs::File::resize_small_to_big(const Size old_size, const Size n
     auto &fs = this->get_root().get_fs();
 
     Extent block_extent;
-    auto status = fs.allocate_blocks(BLOCK_SIZE, block_extent);
+    auto status = fs.allocate_blocks(
+        BLOCK_SIZE, block_extent, fs.get_root_goal(this->get_root().get_header())
+    );
     if (status < Status::OK) return status;
 
     auto sstatus = dwrite(fs.get_disk(), buf.data(), BLOCK_SIZE, block_extent.offset);
@@ -107,45 +199,205 @@ Brufs::Status Brufs::File::resize_small_to_big(const Size old_size, const Size n
 
 Brufs::Status Brufs::File::resize_big_to_big(const Size old_size, const Size new_size) {
     if (new_size > old_size) {
+        // The extents may hold stale data beyond the old end, from reservations or shrinking
+        auto status = this->zero_range(old_size, new_size);
+        if (status < Status::OK) return status;
+
         this->set_size(new_size);
         return this->store();
     }
 
+    auto status = this->release_beyond(new_size);
+    if (status < Status::OK) return status;
+
+    this->set_size(new_size);
+
+    return this->store();
+}
+
+Brufs::Status Brufs::File::trim() {
+    if (this->get_size() <= this->get_data_size()) return Status::OK;
+
+    return this->release_beyond(this->get_size());
+}
+
+/**
+ * Zeroes the parts of the extents of the file that fall in a range.
+ */
+Brufs::Status Brufs::File::zero_range(const Offset start, const Offset end) {
+    if (start >= end) return Status::OK;
+
+    Vector<DataExtent> covering;
+    auto status = this->find_extents(start, end, covering);
+    if (status < Status::OK) return status;
+
+    if (covering.get_size() == 0) return Status::OK;
+
     auto &fs = this->get_root().get_fs();
-    InodeExtentTree iet(*this);
+    const Size chunk_size = min<Size>(end - start, 16 * fs.get_header().cluster_size);
+    Vector<char> zeroes(chunk_size);
+    memset(zeroes.data(), 0, chunk_size);
 
-    for (auto ptr = old_size; ptr < new_size;) {
-        DataExtent cur_extent;
-        auto status = iet.search(ptr, cur_extent);
-        if (status == Status::E_NOT_FOUND) break;
-        if (status < Status::OK) return status;
+    for (const auto &extent : covering) {
+        const auto to = min<Offset>(end, extent.get_local_end());
+
+        for (auto at = max<Offset>(start, extent.local_start); at < to;) {
+            const auto length = min<Size>(to - at, chunk_size);
+
+            auto sstatus = dwrite(
+                fs.get_disk(), zeroes.data(), length, extent.offset + extent.relativize_local(at)
+            );
+            if (sstatus < 0) return static_cast<Status>(sstatus);
+
+            at += length;
+        }
+    }
+
+    return Status::OK;
+}
+
+/**
+ * Frees all space of the file from the first cluster boundary at or after an offset.
+ *
+ * The extent that straddles that boundary is shortened to end at it.
+ */
+Brufs::Status Brufs::File::release_beyond(const Offset end) {
+    auto &fs = this->get_root().get_fs();
+    const auto cut = next_multiple_of<Offset>(end, fs.get_header().cluster_size);
+
+    Vector<DataExtent> beyond;
+    auto status = this->find_extents(cut, static_cast<Offset>(-1), beyond);
+    if (status < Status::OK) return status;
+
+    if (beyond.get_size() == 0) return Status::OK;
 
-        if (cur_extent.local_start < old_size) {
-            ptr += cur_extent.get_local_end();
+    Vector<Offset> keys;
+    Vector<Extent> released;
+    Vector<DataExtent> shortened;
+    for (const auto &extent : beyond) {
+        keys.push_back(extent.get_local_last());
+
+        if (extent.local_start >= cut) {
+            released.push_back(extent);
             continue;
         }
 
-        status = iet.remove(ptr, cur_extent);
-        if (status < Status::OK) return status;
+        const Size kept = cut - extent.local_start;
+        released.push_back({extent.offset + kept, extent.length - kept});
+        shortened.push_back(DataExtent({extent.offset, kept}, extent.local_start));
+    }
+
+    InodeExtentTree iet(*this);
+    BlockCache::Batch batch(fs.get_cache());
 
-        status = fs.free_blocks(cur_extent);
+    Size removed;
+    status = iet.remove_batch(keys.begin(), keys.end(), removed);
+    if (status < Status::OK) return this->forget_extents(status);
+
+    if (this->extent_map) {
+        for (const auto &extent : beyond) this->extent_map->remove(extent);
+    }
+
+    for (const auto &extent : shortened) {
+        status = iet.insert(extent.get_local_last(), extent);
+        if (status < Status::OK) return this->forget_extents(status);
+
+        if (this->extent_map) this->extent_map->insert(extent);
+    }
+
+    for (const auto &extent : released) {
+        status = fs.free_blocks(extent);
         if (status < Status::OK) return status;
+    }
+
+    return batch.finish(Status::OK);
+}
 
-        ptr = cur_extent.get_local_end();
+/**
+ * Writes the part of a range of data that falls in an extent.
+ */
+static Brufs::SSize write_range(
+    Brufs::Disk *disk, const Brufs::DataExtent &extent, const char *buf,
+    Brufs::Offset start, Brufs::Offset end
+) {
+    const auto from = Brufs::max<Brufs::Offset>(start, extent.local_start);
+    const auto to = Brufs::min<Brufs::Offset>(end, extent.get_local_end());
+    if (from >= to) return 0;
+
+    return Brufs::dwrite(
+        disk, buf + (from - start), to - from, extent.offset + extent.relativize_local(from)
+    );
+}
+
+/**
+ * Zeroes the parts of an extent outside a range of data, up to the end of the file.
+ *
+ * Whatever lies beyond the end of the file is zeroed once the file grows over it.
+ */
+static Brufs::SSize zero_outside(
+    Brufs::Disk *disk, const Brufs::DataExtent &extent, Brufs::Offset start, Brufs::Offset end,
+    Brufs::Offset file_end
+) {
+    const auto extent_end = Brufs::max(
+        Brufs::min<Brufs::Offset>(extent.get_local_end(), file_end), extent.local_start
+    );
+    const auto from = Brufs::min(Brufs::max<Brufs::Offset>(start, extent.local_start), extent_end);
+    const auto to = Brufs::max(Brufs::min<Brufs::Offset>(end, extent_end), from);
+
+    const Brufs::Size before = from - extent.local_start;
+    const Brufs::Size after = extent_end - to;
+    if (before == 0 && after == 0) return 0;
+
+    const auto zero_length = Brufs::max(before, after);
+    Brufs::Vector<char> zeroes(zero_length);
+    memset(zeroes.data(), 0, zero_length);
+
+    if (before > 0) {
+        auto sstatus = Brufs::dwrite(disk, zeroes.data(), before, extent.offset);
+        if (sstatus < 0) return sstatus;
     }
 
-    this->set_size(new_size);
+    if (after > 0) {
+        const auto address = extent.offset + extent.relativize_local(to);
 
-    return this->store();
+        auto sstatus = Brufs::dwrite(disk, zeroes.data(), after, address);
+        if (sstatus < 0) return sstatus;
+    }
+
+    return 0;
+}
+
+/**
+ * Frees freshly allocated extents that never made it into a file, and passes on the error that
+ * caused it.
+ */
+static Brufs::SSize free_unused(
+    Brufs::Brufs &fs, const Brufs::Vector<Brufs::Extent> &extents, Brufs::SSize error
+) {
+    // The original error is the one worth reporting
+    for (const auto &extent : extents) (void) fs.free_blocks(extent);
+    return error;
 }
 
-Brufs::SSize Brufs::File::write(const void *vbuf, Size count, Offset offset) {
+Brufs::SSize Brufs::File::write_data(
+    const void *vbuf, Size count, Offset offset, const bool sequential
+) {
     if (count == 0) return 0;
 
     auto buf = static_cast<const char *>(vbuf);
+    const auto end = offset + count;
+
+    const auto old_size = this->get_size();
+    if (end > old_size && old_size > this->get_data_size()) {
+        // Only the gap before the data needs zeroing, the data itself covers the rest
+        auto status = this->zero_range(old_size, offset);
+        if (status < Status::OK) return static_cast<SSize>(status);
 
-    if (offset + count > this->get_size()) {
-        auto status = this->truncate(count + offset);
+        this->set_size(end);
+        status = this->store();
+        if (status < Status::OK) return static_cast<SSize>(status);
+    } else if (end > old_size) {
+        auto status = this->truncate(end);
         if (status < Status::OK) return static_cast<SSize>(status);
     }
 
@@ -161,72 +413,228 @@ Brufs::SSize Brufs::File::write(const void *vbuf, Size count, Offset offset) {
     InodeExtentTree iet(*this);
 
     auto &fs = this->get_root().get_fs();
+    const auto cluster_size = fs.get_header().cluster_size;
 
-    DataExtent data_extent;
-    auto status = iet.search(offset, data_extent);
-
-    const auto offset_fits = status != Status::E_NOT_FOUND;
-    if (!offset_fits) status = iet.get_last(data_extent);
+    DataExtent last;
+    auto status = this->find_last_extent(last);
+    if (status < Status::OK && status != Status::E_NOT_FOUND) return status;
     const auto extent_present = status != Status::E_NOT_FOUND;
 
-    if (!offset_fits && extent_present && data_extent.length == BLOCK_SIZE) {
+    if (extent_present && last.length == BLOCK_SIZE && end > last.get_local_end()) {
         // Resize the last block to a full cluster
-        status = iet.remove(data_extent.get_local_last(), data_extent);
-        if (status < Status::OK) return status;
+        status = iet.remove(last.get_local_last(), last);
+        if (status < Status::OK) return this->forget_extents(status);
+        if (this->extent_map) this->extent_map->remove(last);
+
+        // The rest of the new cluster up to the data is zeroed, it may hold stale disk contents
+        const Size copied = max<Size>(
+            BLOCK_SIZE, min<Size>(cluster_size, offset - min<Offset>(offset, last.local_start))
+        );
 
-        Vector<uint8_t> small_buf(BLOCK_SIZE);
-        auto sstatus = dread(fs.get_disk(), small_buf.data(), BLOCK_SIZE, data_extent.offset);
+        Vector<uint8_t> small_buf(copied);
+        memset(small_buf.data(), 0, copied);
+
+        auto sstatus = dread(fs.get_disk(), small_buf.data(), BLOCK_SIZE, last.offset);
         if (sstatus < 0) return sstatus;
 
-        status = fs.free_blocks(data_extent);
+        status = fs.free_blocks(last);
         if (status < Status::OK) return status;
 
         Extent new_raw_extent;
-        status = fs.allocate_blocks(fs.get_header().cluster_size, new_raw_extent);
+        status = fs.allocate_blocks(cluster_size, new_raw_extent, last.offset);
         if (status < Status::OK) return status;
 
-        DataExtent new_extent(new_raw_extent, data_extent.local_start);
+        DataExtent new_extent(new_raw_extent, last.local_start);
 
-        sstatus = dwrite(fs.get_disk(), small_buf.data(), BLOCK_SIZE, new_extent.offset);
+        sstatus = dwrite(fs.get_disk(), small_buf.data(), copied, new_extent.offset);
         if (sstatus < 0) return sstatus;
 
         status = iet.insert(new_extent.get_local_last(), new_extent);
-        if (status < Status::OK) return status;
+        if (status < Status::OK) return this->forget_extents(status);
+        if (this->extent_map) this->extent_map->insert(new_extent);
 
-        data_extent = new_extent;
+        last = new_extent;
     }
 
-    if (extent_present && data_extent.contains_local(offset)) {
-        // The data fits in the extent
-        const auto relative_offset = data_extent.relativize_local(offset);
-        const auto true_end = min(offset + count, data_extent.get_local_end());
-        const auto length = true_end - offset;
+    // Find every extent the data lands in with a single scan
+    Vector<DataExtent> existing;
+    status = this->find_extents(offset, end, existing);
+    if (status < Status::OK) return status;
+
+    // The holes in between are filled with whole clusters; these extents are in file offsets
+    Vector<Extent> holes;
+    Size missing = 0;
+    {
+        Offset covered = previous_multiple_of<Offset>(offset, cluster_size);
+        for (const auto &extent : existing) {
+            if (extent.local_start > covered) {
+                holes.push_back({covered, extent.local_start - covered});
+                missing += extent.local_start - covered;
+            }
+
+            covered = max<Offset>(covered, extent.get_local_end());
+        }
 
-        return dwrite(fs.get_disk(), buf, length, data_extent.offset + relative_offset);
+        // A block sized extent may already hold the end of the data
+        const auto aligned_end = next_multiple_of<Offset>(end, cluster_size);
+        if (end > covered) {
+            holes.push_back({covered, aligned_end - covered});
+            missing += aligned_end - covered;
+        }
     }
 
-    // The data goes before or after the extent
-    const auto cluster_size = fs.get_header().cluster_size;
-    const auto max_extent_length = this->get_root().get_header().max_extent_length;
-    const auto aligned_end = next_multiple_of<Offset>(offset + count, cluster_size);
-    const auto aligned_offset = previous_multiple_of<Offset>(offset, cluster_size);
-    const auto aligned_length = min<Size>(aligned_end - aligned_offset, max_extent_length);
+    BlockCache::Batch batch(fs.get_cache());
 
-    Extent raw_new_extent;
-    status = fs.allocate_blocks(aligned_length, raw_new_extent);
-    if (status < Status::OK) return status;
+    // Allocate all missing space at once; it's only split up if the free space is fragmented
+    Vector<DataExtent> created;
+
+    // The extent before the first hole, if the first new space directly follows it
+    DataExtent grown;
+    Offset grown_key = 0;
+    bool growing = false;
+
+    Vector<Extent> raw_extents;
+    if (missing > 0) {
+        const auto hole_start = holes[0].offset;
+
+        // Keep the file physically contiguous after the extent before the first hole, and in
+        // the allocation group of its root otherwise
+        const DataExtent *before = nullptr;
+        if (extent_present && last.get_local_end() <= hole_start) before = &last;
+        for (const auto &extent : existing) {
+            if (extent.get_local_end() <= hole_start) before = &extent;
+        }
+
+        Address goal = fs.get_root_goal(this->get_root().get_header());
+        if (before) {
+            goal = before->offset + before->length + (hole_start - before->get_local_end());
+        }
+
+        // Sequential writers are likely to keep appending, so they get long extents and space
+        // reserved past the end of the file, as much again as the last extent already holds
+        const bool appending = sequential && extent_present && last.get_local_end() == hole_start;
+        const Size reserved = appending ? previous_multiple_of<Size>(
+            min<Size>(last.length, MAX_SEQUENTIAL_EXTENT_LENGTH), cluster_size
+        ) : 0;
+
+        if (reserved > 0) {
+            status = fs.allocate_extents(missing + reserved, goal, raw_extents);
+
+            // A reservation that doesn't continue the file would only break it up further
+            if (status >= Status::OK && raw_extents[0].offset != goal) {
+                for (const auto &raw : raw_extents) {
+                    status = fs.free_blocks(raw);
+                    if (status < Status::OK) return status;
+                }
+
+                status = Status::E_WONT_FIT;
+            }
+
+            if (status < Status::OK && status != Status::E_WONT_FIT) return status;
+        }
+
+        if (reserved > 0 && status >= Status::OK) {
+            holes.back().length += reserved;
+        } else {
+            status = fs.allocate_extents(missing, goal, raw_extents);
+            if (status < Status::OK) return status;
+        }
+
+        // Other new extents still respect the maximum extent length of the root
+        const auto root_max = appending ? MAX_SEQUENTIAL_EXTENT_LENGTH
+                                        : this->get_root().get_header().max_extent_length;
+        const auto max_extent_length = max<Size>(
+            previous_multiple_of<Size>(root_max, cluster_size), cluster_size
+        );
+
+        // Appending writers grow their last extent instead of adding one after it
+        growing = before && before->get_local_end() == hole_start
+               && before->offset + before->length == raw_extents[0].offset
+               && before->length < max_extent_length;
+        if (growing) {
+            grown = *before;
+            grown_key = before->get_local_last();
+        }
 
-    const auto local_offset = offset - aligned_offset;
+        Size raw_index = 0;
+        Size raw_used = 0;
+        for (const auto &hole : holes) {
+            for (Size done = 0; done < hole.length;) {
+                const auto &raw = raw_extents[raw_index];
+
+                // The growth is written like a new extent, but stored as part of the old one
+                const bool growth = growing && created.get_size() == 0;
+                const auto length = min(
+                    min(hole.length - done, raw.length - raw_used),
+                    growth ? max_extent_length - grown.length : max_extent_length
+                );
+
+                created.push_back(DataExtent({raw.offset + raw_used, length}, hole.offset + done));
+                if (growth) grown.length += length;
+
+                done += length;
+                raw_used += length;
+                if (raw_used == raw.length) {
+                    ++raw_index;
+                    raw_used = 0;
+                }
+            }
+        }
+    }
+
+    for (const auto &extent : existing) {
+        auto sstatus = write_range(fs.get_disk(), extent, buf, offset, end);
+        if (sstatus < 0) return free_unused(fs, raw_extents, sstatus);
+    }
+
+    for (const auto &extent : created) {
+        auto sstatus = write_range(fs.get_disk(), extent, buf, offset, end);
+        if (sstatus < 0) return free_unused(fs, raw_extents, sstatus);
+
+        // The rest of the new clusters would otherwise show stale data
+        sstatus = zero_outside(fs.get_disk(), extent, offset, end, this->get_size());
+        if (sstatus < 0) return free_unused(fs, raw_extents, sstatus);
+    }
+
+    Vector<BmTree::Record<Offset, DataExtent>> records(created.get_size());
+    DataExtent removed;
+    if (growing) {
+        // Its key is its last offset, so the grown extent is stored under a new one
+        status = iet.remove(grown_key, removed, true);
+        if (status < Status::OK) {
+            (void) free_unused(fs, raw_extents, status);
+            return this->forget_extents(status);
+        }
+
+        if (this->extent_map) this->extent_map->remove(removed);
+
+        records.push_back({grown.get_local_last(), &grown});
+    }
+
+    for (Size i = growing ? 1 : 0; i < created.get_size(); ++i) {
+        records.push_back({created[i].get_local_last(), &created[i]});
+    }
 
-    DataExtent new_extent(raw_new_extent, aligned_offset);
+    status = iet.insert_batch(records.begin(), records.end());
+    if (status < Status::OK) {
+        // Part of the batch may have been stored, so the new space can't be freed, but the
+        // extent that was going to grow mustn't get lost
+        if (growing) {
+            DataExtent stored;
+            (void) iet.remove(grown.get_local_last(), stored, true);
+            (void) iet.insert(grown_key, removed);
+        }
+        return this->forget_extents(status);
+    }
 
-    auto sstatus = dwrite(fs.get_disk(), buf, count, new_extent.offset + local_offset);
-    if (sstatus < 0) return sstatus;
+    if (this->extent_map) {
+        for (const auto &record : records) this->extent_map->insert(*record.value);
+    }
 
-    status = iet.insert(new_extent.get_local_last(), new_extent);
+    status = batch.finish(Status::OK);
     if (status < Status::OK) return status;
 
-    return sstatus;
+    return count;
 }
 
 Brufs::SSize Brufs::File::read(void *vbuf, const Size count, const Offset offset) {
@@ -249,9 +657,8 @@ Brufs::SSize Brufs::File::read(void *vbuf, const Size count, const Offset offset
         return true_count;
     }
 
-    InodeExtentTree iet(*this);
     DataExtent extent;
-    const auto status = iet.search(offset, extent);
+    const auto status = this->find_extent(offset, extent);
 
     if (status == Status::E_NOT_FOUND) {
         memset(vbuf, 0, true_count);
@@ -273,3 +680,58 @@ Brufs::SSize Brufs::File::read(void *vbuf, const Size count, const Offset offset
     const auto read_count = min(true_count, extent.length - local_offset);
     return dread(fs.get_disk(), vbuf, read_count, extent.offset + local_offset);
 }
+
+Brufs::SSize Brufs::File::read_full(void *vbuf, const Size count, const Offset offset) {
+    if (!vbuf) return Status::E_INVALID_ARGUMENT;
+    if (offset > this->get_size()) return Status::E_BEYOND_EOF;
+
+    const auto end = min<Size>(this->get_size(), offset + count);
+    const auto true_count = end - offset;
+
+    if (true_count == 0) return 0;
+
+    // Small files don't have extents
+    if (this->get_size() <= this->get_data_size()) return this->read(vbuf, true_count, offset);
+
+    auto buf = static_cast<char *>(vbuf);
+
+    // Collect the parts of the extents in the range, merging physically contiguous neighbors
+    Vector<DataExtent> extents;
+    auto status = this->find_extents(offset, end, extents);
+    if (status < Status::OK) return status;
+
+    Vector<DataExtent> runs;
+    for (const auto &extent : extents) {
+        const auto from = max<Offset>(offset, extent.local_start);
+        const auto to = min<Offset>(end, extent.get_local_end());
+        const Address address = extent.offset + extent.relativize_local(from);
+
+        if (runs.get_size() > 0) {
+            auto &last = runs.back();
+            if (last.get_local_end() == from && last.offset + last.length == address) {
+                last.length += to - from;
+                continue;
+            }
+        }
+
+        runs.push_back(DataExtent({address, to - from}, from));
+    }
+
+    auto &fs = this->get_root().get_fs();
+
+    Offset filled = offset;
+    for (const auto &run : runs) {
+        memset(buf + (filled - offset), 0, run.local_start - filled);
+
+        auto sstatus = dread(
+            fs.get_disk(), buf + (run.local_start - offset), run.length, run.offset
+        );
+        if (sstatus < 0) return sstatus;
+
+        filled = run.get_local_end();
+    }
+
+    memset(buf + (filled - offset), 0, end - filled);
+
+    return true_count;
+}
@@ -47,7 +47,7 @@ int Brufs::Header::validate(void *dsk) const {
         return Status::E_HEADER_TOO_BIG;
     }
 
-    if (this->header_size < sizeof(Header)) {
+    if (this->header_size < MIN_HEADER_SIZE) {
         return Status::E_HEADER_TOO_SMALL;
     }
 
@@ -63,6 +63,10 @@ int Brufs::Header::validate(void *dsk) const {
         return Status::E_NO_RHT;
     }
 
+    if (this->header_size > offsetof(Header, ag_size) && this->ag_size % this->cluster_size != 0) {
+        return Status::E_MISALIGNED;
+    }
+
     // Verify the header checksum
     void *buf = malloc(this->header_size);
     if (!buf) return Status::E_NO_MEM;
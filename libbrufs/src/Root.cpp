@@ -33,6 +33,8 @@ static bool is_main_stream(const Brufs::InodeId &id) {
 }
 
 Brufs::Status Brufs::Root::store() {
+    MutexGuard guard(this->lock);
+
     if (!this->enable_store) return Status::OK;
     return this->fs.update_root(this->header);
 }
@@ -101,24 +103,32 @@ void Brufs::Root::destroy_inode_header(InodeHeader *header) const {
 }
 
 Brufs::Status Brufs::Root::insert_inode(const InodeId &id, const InodeHeader *ino) {
+    MutexGuard guard(this->lock);
+
     if (is_main_stream(id)) return this->it.insert(id, ino, true);
 
     return this->ait.insert(id, ino, true);
 }
 
 Brufs::Status Brufs::Root::find_inode(const InodeId &id, InodeHeader *ino) {
+    MutexGuard guard(this->lock);
+
     if (is_main_stream(id)) return this->it.search(id, ino, true);
 
     return this->ait.search(id, ino, true);
 }
 
 Brufs::Status Brufs::Root::update_inode(const InodeId &id, const InodeHeader *ino) {
+    MutexGuard guard(this->lock);
+
     if (is_main_stream(id)) return this->it.update(id, ino);
 
     return this->ait.update(id, ino);
 }
 
 Brufs::Status Brufs::Root::remove_inode(const InodeId &id, InodeHeader *ino) {
+    MutexGuard guard(this->lock);
+
     if (is_main_stream(id)) return this->it.remove(id, ino, true);
 
     return this->ait.insert(id, ino, true);
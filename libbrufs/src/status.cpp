@@ -51,6 +51,7 @@ const char *Brufs::strerror(Status eno) {
         case E_WRONG_INODE_TYPE: return "E_WRONG_INODE_TYPE";
         case E_NOT_DIR: return "E_NOT_DIR";
         case E_IS_DIR: return "E_IS_DIR";
+        case E_UNSUPPORTED: return "E_UNSUPPORTED";
         case E_ABSTIO_BASE: return "E_ABSTIO_BASE";
         case OK: return "OK";
         case RETRY: return "RETRY";
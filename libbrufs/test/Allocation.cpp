@@ -0,0 +1,939 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "MemIO.hpp"
+#include "Brufs.hpp"
+
+static constexpr size_t DISK_SIZE = 32 * 1024 * 1024;
+static constexpr Brufs::Size CLUSTER_SIZE = 4096;
+
+static Brufs::Size count_total_free(Brufs::Brufs &fs) {
+    Brufs::Size standby, available, extents, in_fbt;
+    auto status = fs.count_free_blocks(standby, available, extents, in_fbt);
+    REQUIRE(status == Brufs::Status::OK);
+
+    return standby + available + in_fbt;
+}
+
+TEST_CASE("Allocations are placed near their goal", "[Allocation]") {
+    MemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    const Brufs::Size free_before = count_total_free(fs);
+
+    SECTION("Consecutive allocations with a goal are contiguous") {
+        Brufs::Extent first;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, first) == Brufs::Status::OK);
+
+        Brufs::Extent prev = first;
+        for (int i = 0; i < 16; ++i) {
+            Brufs::Extent next;
+            auto status = fs.allocate_blocks(CLUSTER_SIZE, next, prev.offset + prev.length);
+            REQUIRE(status == Brufs::Status::OK);
+            CHECK(next.offset == prev.offset + prev.length);
+            CHECK(next.length == CLUSTER_SIZE);
+
+            prev = next;
+        }
+    }
+
+    SECTION("A free goal is used exactly") {
+        const Brufs::Address goal = DISK_SIZE / 2;
+
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(4 * CLUSTER_SIZE, ext, goal) == Brufs::Status::OK);
+        CHECK(ext.offset == goal);
+        CHECK(ext.length == 4 * CLUSTER_SIZE);
+    }
+
+    SECTION("An unaligned goal is rounded up") {
+        const Brufs::Address goal = DISK_SIZE / 2 + 1;
+
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, ext, goal) == Brufs::Status::OK);
+        CHECK(ext.offset == DISK_SIZE / 2 + Brufs::BLOCK_SIZE);
+    }
+
+    SECTION("Space taken near a goal is never handed out again") {
+        const Brufs::Address goal = DISK_SIZE / 2;
+
+        std::vector<Brufs::Extent> taken;
+
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(8 * CLUSTER_SIZE, ext, goal) == Brufs::Status::OK);
+        taken.push_back(ext);
+
+        // Drain the disk; the stale entries in the free blocks tree must be skipped
+        Brufs::Status status;
+        while ((status = fs.allocate_blocks(CLUSTER_SIZE, ext)) == Brufs::Status::OK) {
+            taken.push_back(ext);
+        }
+        CHECK(status == Brufs::Status::E_WONT_FIT);
+
+        std::sort(taken.begin(), taken.end(), [](const auto &a, const auto &b) {
+            return a.offset < b.offset;
+        });
+
+        for (size_t i = 1; i < taken.size(); ++i) {
+            REQUIRE(taken[i - 1].offset + taken[i - 1].length <= taken[i].offset);
+        }
+
+        REQUIRE(taken.back().offset + taken.back().length <= DISK_SIZE);
+    }
+
+    SECTION("Freed space near a goal is conserved") {
+        std::vector<Brufs::Extent> taken;
+
+        for (int i = 0; i < 64; ++i) {
+            const Brufs::Address goal = (i % 2 == 0) ? DISK_SIZE / 4 : 3 * DISK_SIZE / 4;
+
+            Brufs::Extent ext;
+            REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, ext, goal) == Brufs::Status::OK);
+            taken.push_back(ext);
+        }
+
+        for (const auto &ext : taken) REQUIRE(fs.free_blocks(ext) == Brufs::Status::OK);
+
+        CHECK(count_total_free(fs) == free_before);
+    }
+
+    SECTION("The free offset tree survives a remount") {
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, ext, DISK_SIZE / 2) == Brufs::Status::OK);
+        REQUIRE(fs.spill_free_lists() == Brufs::Status::OK);
+
+        Brufs::Brufs remounted(&disk);
+        REQUIRE(remounted.get_status() == Brufs::Status::OK);
+
+        Brufs::Extent next;
+        auto status = remounted.allocate_blocks(CLUSTER_SIZE, next, ext.offset + ext.length);
+        REQUIRE(status == Brufs::Status::OK);
+        CHECK(next.offset == ext.offset + ext.length);
+    }
+}
+
+TEST_CASE("Freed extents are merged with their neighbors", "[Allocation]") {
+    MemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    // Single blocks are smaller than a cluster and never end up in the spare cluster list
+    Brufs::Header proto;
+    proto.cluster_size_exp = 14;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    Brufs::Size standby, available, extents_before, extents_after, in_fbt;
+    REQUIRE(fs.count_free_blocks(standby, available, extents_before, in_fbt) == Brufs::Status::OK);
+
+    const Brufs::Address goal = DISK_SIZE / 2;
+    std::vector<Brufs::Extent> taken;
+    for (int i = 0; i < 64; ++i) {
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(Brufs::BLOCK_SIZE, ext, goal + i * Brufs::BLOCK_SIZE) == Brufs::Status::OK);
+        REQUIRE(ext.offset == goal + i * Brufs::BLOCK_SIZE);
+        taken.push_back(ext);
+    }
+
+    SECTION("Freeing every block restores a single extent") {
+        // Free out of order, so blocks get merged on both sides
+        for (size_t i = 0; i < taken.size(); i += 2) REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+        for (size_t i = 1; i < taken.size(); i += 2) REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+
+        REQUIRE(fs.count_free_blocks(standby, available, extents_after, in_fbt) == Brufs::Status::OK);
+        CHECK(extents_after == extents_before);
+
+        Brufs::Extent whole;
+        REQUIRE(fs.allocate_blocks(64 * Brufs::BLOCK_SIZE, whole, goal) == Brufs::Status::OK);
+        CHECK(whole.offset == goal);
+    }
+
+    SECTION("Compaction keeps all free space and drops stale entries") {
+        for (size_t i = 0; i < taken.size(); i += 2) REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+
+        const Brufs::Size free_before = count_total_free(fs);
+
+        Brufs::Size merged;
+        REQUIRE(fs.compact_free_space(merged) == Brufs::Status::OK);
+
+        CHECK(count_total_free(fs) == free_before);
+
+        REQUIRE(fs.count_free_blocks(standby, available, extents_after, in_fbt) == Brufs::Status::OK);
+
+        // Everything that is reported available can be allocated, without overlaps
+        std::vector<Brufs::Extent> drained;
+        Brufs::Size num_drained = 0;
+
+        Brufs::Extent ext;
+        while (fs.allocate_blocks(Brufs::BLOCK_SIZE, ext) == Brufs::Status::OK) {
+            drained.push_back(ext);
+            num_drained += ext.length;
+        }
+
+        CHECK(num_drained >= available);
+
+        for (size_t i = 1; i < taken.size(); i += 2) drained.push_back(taken[i]);
+        std::sort(drained.begin(), drained.end(), [](const auto &a, const auto &b) {
+            return a.offset < b.offset;
+        });
+
+        for (size_t i = 1; i < drained.size(); ++i) {
+            REQUIRE(drained[i - 1].offset + drained[i - 1].length <= drained[i].offset);
+        }
+    }
+}
+
+class HeaderCountingIO : public MemIO {
+public:
+    unsigned int header_writes = 0;
+
+    HeaderCountingIO(size_t size) : MemIO(size) {}
+
+    Brufs::SSize write(const void *buf, Brufs::Size count, Brufs::Address offset) override {
+        if (offset == 0) ++this->header_writes;
+        return MemIO::write(buf, count, offset);
+    }
+};
+
+TEST_CASE("The header is written once per allocation", "[Allocation]") {
+    HeaderCountingIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    // Drain the spare clusters, so every allocation refills them
+    std::vector<Brufs::Extent> taken;
+    for (int i = 0; i < 256; ++i) {
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, ext) == Brufs::Status::OK);
+        taken.push_back(ext);
+    }
+
+    io.header_writes = 0;
+
+    for (const auto &ext : taken) {
+        const auto before = io.header_writes;
+        REQUIRE(fs.free_blocks(ext) == Brufs::Status::OK);
+        CHECK(io.header_writes - before <= 1);
+    }
+
+    for (int i = 0; i < 256; ++i) {
+        const auto before = io.header_writes;
+
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, ext) == Brufs::Status::OK);
+        CHECK(io.header_writes - before <= 1);
+    }
+
+    SECTION("A batch writes the header once, when it ends") {
+        io.header_writes = 0;
+
+        // Single clusters would be served from the free lists, without touching the header
+        Brufs::BlockCache::Batch batch(fs.get_cache());
+        for (int i = 0; i < 64; ++i) {
+            Brufs::Extent ext;
+            REQUIRE(fs.allocate_blocks(2 * CLUSTER_SIZE, ext) == Brufs::Status::OK);
+            REQUIRE(fs.free_blocks(ext) == Brufs::Status::OK);
+        }
+
+        CHECK(io.header_writes == 0);
+        REQUIRE(batch.finish(Brufs::Status::OK) == Brufs::Status::OK);
+        CHECK(io.header_writes == 1);
+    }
+
+    // The header on disk is still consistent
+    REQUIRE(fs.spill_free_lists() == Brufs::Status::OK);
+    Brufs::Brufs reopened(&disk);
+    CHECK(reopened.get_status() == Brufs::Status::OK);
+    CHECK(count_total_free(reopened) == count_total_free(fs));
+}
+
+TEST_CASE("Large requests are spread over several extents", "[Allocation]") {
+    MemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    SECTION("A request that fits is allocated as a single extent") {
+        Brufs::Vector<Brufs::Extent> exts;
+        REQUIRE(fs.allocate_extents(64 * CLUSTER_SIZE, 0, exts) == Brufs::Status::OK);
+        REQUIRE(exts.get_size() == 1);
+        CHECK(exts[0].length == 64 * CLUSTER_SIZE);
+    }
+
+    SECTION("Fragmented free space is still usable") {
+        // Take everything, then give back every other cluster
+        std::vector<Brufs::Extent> taken;
+        Brufs::Extent ext;
+        while (fs.allocate_blocks(CLUSTER_SIZE, ext) == Brufs::Status::OK) taken.push_back(ext);
+
+        std::sort(taken.begin(), taken.end(), [](const auto &a, const auto &b) {
+            return a.offset < b.offset;
+        });
+
+        Brufs::Size num_freed = 0;
+        for (size_t i = 0; i + 1 < taken.size() && num_freed < 32; i += 2) {
+            if (taken[i].offset + CLUSTER_SIZE == taken[i + 1].offset) {
+                REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+                ++num_freed;
+            }
+        }
+
+        REQUIRE(num_freed == 32);
+
+        const Brufs::Size free_before = count_total_free(fs);
+
+        CHECK(fs.allocate_blocks(4 * CLUSTER_SIZE, ext) == Brufs::Status::E_WONT_FIT);
+
+        Brufs::Vector<Brufs::Extent> exts;
+        REQUIRE(fs.allocate_extents(4 * CLUSTER_SIZE, 0, exts) == Brufs::Status::OK);
+
+        Brufs::Size total = 0;
+        for (const auto &piece : exts) total += piece.length;
+        CHECK(total == 4 * CLUSTER_SIZE);
+        CHECK(exts.get_size() > 1);
+        CHECK(count_total_free(fs) == free_before - 4 * CLUSTER_SIZE);
+
+        SECTION("Too large requests allocate nothing") {
+            Brufs::Vector<Brufs::Extent> too_many;
+            CHECK(fs.allocate_extents(DISK_SIZE, 0, too_many) == Brufs::Status::E_WONT_FIT);
+            CHECK(too_many.get_size() == 0);
+            CHECK(count_total_free(fs) == free_before - 4 * CLUSTER_SIZE);
+        }
+    }
+}
+
+TEST_CASE("The disk is divided into allocation groups", "[Allocation]") {
+    static constexpr Brufs::Size GROUP_SIZE = 8 * 1024 * 1024;
+
+    MemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+    proto.ag_size = GROUP_SIZE;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+    REQUIRE(fs.get_num_groups() == DISK_SIZE / GROUP_SIZE);
+
+    const Brufs::Size free_before = count_total_free(fs);
+
+    SECTION("Allocations stay in the group of their goal") {
+        for (Brufs::Size group = 0; group < fs.get_num_groups(); ++group) {
+            const Brufs::Address goal = group * GROUP_SIZE + GROUP_SIZE / 2;
+
+            Brufs::Extent ext;
+            REQUIRE(fs.allocate_blocks(4 * CLUSTER_SIZE, ext, goal) == Brufs::Status::OK);
+            CHECK(ext.offset == goal);
+
+            REQUIRE(fs.free_blocks(ext) == Brufs::Status::OK);
+        }
+
+        CHECK(count_total_free(fs) == free_before);
+    }
+
+    SECTION("A full group spills over into the others") {
+        std::vector<Brufs::Extent> taken;
+        Brufs::Extent ext;
+        while (fs.allocate_blocks(CLUSTER_SIZE, ext, GROUP_SIZE) == Brufs::Status::OK) {
+            taken.push_back(ext);
+        }
+
+        CHECK(std::any_of(taken.begin(), taken.end(), [](const auto &e) {
+            return e.offset < GROUP_SIZE;
+        }));
+        CHECK(std::any_of(taken.begin(), taken.end(), [](const auto &e) {
+            return e.offset >= 2 * GROUP_SIZE;
+        }));
+
+        for (const auto &e : taken) REQUIRE(fs.free_blocks(e) == Brufs::Status::OK);
+
+        CHECK(count_total_free(fs) == free_before);
+    }
+
+    SECTION("The groups survive a remount") {
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, ext, 3 * GROUP_SIZE) == Brufs::Status::OK);
+        REQUIRE(fs.spill_free_lists() == Brufs::Status::OK);
+
+        Brufs::Brufs remounted(&disk);
+        REQUIRE(remounted.get_status() == Brufs::Status::OK);
+        CHECK(remounted.get_num_groups() == fs.get_num_groups());
+        CHECK(count_total_free(remounted) == free_before - CLUSTER_SIZE);
+
+        Brufs::Extent next;
+        auto status = remounted.allocate_blocks(CLUSTER_SIZE, next, ext.offset + ext.length);
+        REQUIRE(status == Brufs::Status::OK);
+        CHECK(next.offset == ext.offset + ext.length);
+    }
+
+    SECTION("Groups must fit their spare clusters") {
+        MemIO other_io(DISK_SIZE);
+        Brufs::Disk other_disk(&other_io);
+        Brufs::Brufs other(&other_disk);
+
+        proto.ag_size = 2 * CLUSTER_SIZE;
+        CHECK(other.init(proto) == Brufs::Status::E_INVALID_ARGUMENT);
+    }
+}
+
+TEST_CASE("Free space counters are kept in the header", "[Allocation]") {
+    MemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+    proto.ag_size = 8 * 1024 * 1024;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    const Brufs::Size free_before = count_total_free(fs);
+
+    // Churn the free space trees so they split, merge and refill the spare clusters
+    std::vector<Brufs::Extent> taken;
+    for (int i = 0; i < 512; ++i) {
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(((i % 3) + 1) * CLUSTER_SIZE, ext) == Brufs::Status::OK);
+        taken.push_back(ext);
+    }
+
+    for (size_t i = 0; i < taken.size(); i += 2) {
+        REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+    }
+
+    // The counters on disk leave out the free lists
+    REQUIRE(fs.spill_free_lists() == Brufs::Status::OK);
+
+    Brufs::Size standby, available, extents, in_fbt;
+    REQUIRE(fs.count_free_blocks(standby, available, extents, in_fbt) == Brufs::Status::OK);
+    CHECK(extents > fs.get_num_groups());
+
+    SECTION("The counters survive a remount") {
+        Brufs::Brufs remounted(&disk);
+        REQUIRE(remounted.get_status() == Brufs::Status::OK);
+
+        Brufs::Size r_standby, r_available, r_extents, r_in_fbt;
+        auto status = remounted.count_free_blocks(r_standby, r_available, r_extents, r_in_fbt);
+        REQUIRE(status == Brufs::Status::OK);
+
+        CHECK(r_standby == standby);
+        CHECK(r_available == available);
+        CHECK(r_extents == extents);
+        CHECK(r_in_fbt == in_fbt);
+    }
+
+    SECTION("Freeing everything restores the counters") {
+        for (size_t i = 1; i < taken.size(); i += 2) {
+            REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+        }
+
+        CHECK(count_total_free(fs) == free_before);
+
+        Brufs::Size merged;
+        REQUIRE(fs.compact_free_space(merged) == Brufs::Status::OK);
+        CHECK(count_total_free(fs) == free_before);
+
+        const Brufs::Size extents_before = extents;
+        REQUIRE(fs.count_free_blocks(standby, available, extents, in_fbt) == Brufs::Status::OK);
+        CHECK(extents < extents_before);
+    }
+}
+
+class DiscardingIO : public MemIO {
+public:
+    using MemIO::MemIO;
+
+    std::vector<Brufs::Extent> discarded;
+    Brufs::Status failure = Brufs::Status::OK;
+
+    Brufs::SSize discard(Brufs::Size count, Brufs::Address offset) override {
+        if (this->failure < Brufs::Status::OK) return this->failure;
+
+        this->discarded.push_back({offset, count});
+        return count;
+    }
+
+    bool was_discarded(const Brufs::Extent &ext) const {
+        return std::any_of(this->discarded.begin(), this->discarded.end(), [&](const auto &d) {
+            return d.offset < ext.offset + ext.length && ext.offset < d.offset + d.length;
+        });
+    }
+
+    Brufs::Size total_discarded() const {
+        Brufs::Size total = 0;
+        for (const auto &ext : this->discarded) total += ext.length;
+        return total;
+    }
+};
+
+TEST_CASE("Freed extents can be discarded", "[Allocation]") {
+    DiscardingIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+    REQUIRE_FALSE(fs.is_discarding());
+
+    Brufs::Extent first, second;
+    REQUIRE(fs.allocate_blocks(8 * CLUSTER_SIZE, first) == Brufs::Status::OK);
+    REQUIRE(fs.allocate_blocks(8 * CLUSTER_SIZE, second) == Brufs::Status::OK);
+
+    SECTION("Nothing is discarded by default") {
+        REQUIRE(fs.free_blocks(first) == Brufs::Status::OK);
+        CHECK(io.discarded.empty());
+    }
+
+    SECTION("Freed extents are discarded when enabled") {
+        REQUIRE(fs.set_discarding(true) == Brufs::Status::OK);
+
+        REQUIRE(fs.free_blocks(first) == Brufs::Status::OK);
+        CHECK(io.was_discarded({first.offset + first.length - CLUSTER_SIZE, CLUSTER_SIZE}));
+        CHECK_FALSE(io.was_discarded(second));
+
+        SECTION("The setting is stored in the header") {
+            REQUIRE(fs.spill_free_lists() == Brufs::Status::OK);
+            Brufs::Brufs remounted(&disk);
+            REQUIRE(remounted.get_status() == Brufs::Status::OK);
+            CHECK(remounted.is_discarding());
+        }
+    }
+
+    SECTION("Discards wait for the batch and skip reallocated extents") {
+        REQUIRE(fs.set_discarding(true) == Brufs::Status::OK);
+
+        Brufs::BlockCache::Batch batch(fs.get_cache());
+
+        REQUIRE(fs.free_blocks(first) == Brufs::Status::OK);
+        CHECK(io.discarded.empty());
+
+        Brufs::Extent again;
+        REQUIRE(fs.allocate_blocks(first.length, again, first.offset) == Brufs::Status::OK);
+        REQUIRE(fs.free_blocks(second) == Brufs::Status::OK);
+
+        REQUIRE(batch.finish(Brufs::Status::OK) == Brufs::Status::OK);
+        CHECK_FALSE(io.was_discarded(again));
+        CHECK(io.was_discarded({second.offset + second.length - CLUSTER_SIZE, CLUSTER_SIZE}));
+    }
+
+    SECTION("Extents that fail to be discarded are kept for the next batch") {
+        REQUIRE(fs.set_discarding(true) == Brufs::Status::OK);
+
+        io.failure = Brufs::Status::E_DISK_TRUNCATED;
+        CHECK(fs.free_blocks(first) == Brufs::Status::E_DISK_TRUNCATED);
+        CHECK(io.discarded.empty());
+
+        io.failure = Brufs::Status::OK;
+        REQUIRE(fs.free_blocks(second) == Brufs::Status::OK);
+        CHECK(io.was_discarded({first.offset + first.length - CLUSTER_SIZE, CLUSTER_SIZE}));
+        CHECK(io.was_discarded({second.offset + second.length - CLUSTER_SIZE, CLUSTER_SIZE}));
+    }
+
+    SECTION("Disks that can't discard say so") {
+        io.failure = Brufs::Status::E_UNSUPPORTED;
+
+        REQUIRE(fs.set_discarding(true) == Brufs::Status::OK);
+        CHECK(fs.free_blocks(first) == Brufs::Status::OK);
+
+        Brufs::Size discarded;
+        CHECK(fs.discard_free_space(discarded) == Brufs::Status::E_UNSUPPORTED);
+    }
+
+    SECTION("All free space can be discarded at once") {
+        Brufs::Size standby, available, extents, in_fbt;
+        REQUIRE(fs.count_free_blocks(standby, available, extents, in_fbt) == Brufs::Status::OK);
+
+        Brufs::Size discarded;
+        REQUIRE(fs.discard_free_space(discarded) == Brufs::Status::OK);
+        CHECK(discarded == standby + available);
+        CHECK(io.total_discarded() == discarded);
+        CHECK_FALSE(io.was_discarded(first));
+        CHECK_FALSE(io.was_discarded(second));
+    }
+}
+
+TEST_CASE("Common sizes are served from the free lists", "[Allocation]") {
+    HeaderCountingIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    const Brufs::Size free_before = count_total_free(fs);
+
+    // Runs of clusters are taken out of the trees at once, the allocations in between don't
+    // touch them
+    std::vector<Brufs::Extent> taken;
+    Brufs::Extent first;
+    REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, first) == Brufs::Status::OK);
+    taken.push_back(first);
+
+    io.header_writes = 0;
+
+    for (int i = 0; i < 63; ++i) {
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, ext) == Brufs::Status::OK);
+        taken.push_back(ext);
+    }
+
+    CHECK(io.header_writes <= 64 / 16);
+
+    // Runs are handed out in order
+    CHECK(taken[2].offset == taken[1].offset + CLUSTER_SIZE);
+    CHECK(taken[3].offset == taken[2].offset + CLUSTER_SIZE);
+    CHECK(count_total_free(fs) == free_before - taken.size() * CLUSTER_SIZE);
+
+    SECTION("Freed extents are listed once the spare clusters are full") {
+        // Top up the spare clusters first
+        for (int i = 0; i < 12; ++i) REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+
+        io.header_writes = 0;
+        for (size_t i = 12; i < 28; ++i) REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+        CHECK(io.header_writes == 0);
+
+        // Full lists overflow into the trees
+        for (size_t i = 28; i < taken.size(); ++i) {
+            REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+        }
+
+        CHECK(count_total_free(fs) == free_before);
+
+        Brufs::Extent again;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, again, taken[12].offset) == Brufs::Status::OK);
+        CHECK(again.offset == taken[12].offset);
+    }
+
+    SECTION("A goal is served from the list") {
+        Brufs::Extent next;
+        auto status = fs.allocate_blocks(CLUSTER_SIZE, next, taken.back().offset + CLUSTER_SIZE);
+        REQUIRE(status == Brufs::Status::OK);
+        CHECK(next.offset == taken.back().offset + CLUSTER_SIZE);
+    }
+
+    SECTION("Spilled lists survive a remount") {
+        REQUIRE(fs.free_blocks(taken.back()) == Brufs::Status::OK);
+        REQUIRE(fs.spill_free_lists() == Brufs::Status::OK);
+
+        Brufs::Brufs remounted(&disk);
+        REQUIRE(remounted.get_status() == Brufs::Status::OK);
+        CHECK(count_total_free(remounted) == count_total_free(fs));
+        CHECK(count_total_free(remounted) == free_before - (taken.size() - 1) * CLUSTER_SIZE);
+    }
+}
+
+TEST_CASE("Lazily initialized groups hand out their tail on demand", "[Allocation]") {
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    MemIO eager_io(DISK_SIZE);
+    Brufs::Disk eager_disk(&eager_io);
+    Brufs::Brufs eager(&eager_disk);
+    REQUIRE(eager.init(proto) == Brufs::Status::OK);
+
+    MemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    proto.set_flag(Brufs::LAZY_INIT, true);
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    const Brufs::Size free_before = count_total_free(fs);
+    CHECK(free_before == count_total_free(eager));
+
+    SECTION("The free space trees start out as bare roots") {
+        Brufs::Size standby, available, extents, in_fbt;
+        REQUIRE(fs.count_free_blocks(standby, available, extents, in_fbt) == Brufs::Status::OK);
+        CHECK(in_fbt == 2 * CLUSTER_SIZE);
+    }
+
+    SECTION("Space comes from the tail and returns to it") {
+        std::vector<Brufs::Extent> taken;
+        for (int i = 0; i < 256; ++i) {
+            Brufs::Extent ext;
+            REQUIRE(fs.allocate_blocks(((i % 3) + 1) * CLUSTER_SIZE, ext) == Brufs::Status::OK);
+            taken.push_back(ext);
+        }
+
+        for (const auto &ext : taken) REQUIRE(fs.free_blocks(ext) == Brufs::Status::OK);
+
+        CHECK(count_total_free(fs) == free_before);
+    }
+
+    SECTION("A goal in the tail is met") {
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, ext, DISK_SIZE / 2) == Brufs::Status::OK);
+        CHECK(ext.offset == DISK_SIZE / 2);
+
+        Brufs::Extent before;
+        REQUIRE(fs.allocate_blocks(CLUSTER_SIZE, before, DISK_SIZE / 4) == Brufs::Status::OK);
+        CHECK(before.offset == DISK_SIZE / 4);
+
+        CHECK(count_total_free(fs) == free_before - 2 * CLUSTER_SIZE);
+    }
+
+    SECTION("A large request takes the whole tail") {
+        Brufs::Vector<Brufs::Extent> extents;
+        REQUIRE(fs.allocate_extents(DISK_SIZE / 2, 0, extents) == Brufs::Status::OK);
+        CHECK(extents.get_size() == 1);
+    }
+
+    SECTION("The tail survives a remount") {
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(2 * CLUSTER_SIZE, ext) == Brufs::Status::OK);
+        REQUIRE(fs.spill_free_lists() == Brufs::Status::OK);
+
+        Brufs::Brufs remounted(&disk);
+        REQUIRE(remounted.get_status() == Brufs::Status::OK);
+        CHECK(count_total_free(remounted) == free_before - 2 * CLUSTER_SIZE);
+
+        Brufs::Extent next;
+        auto status = remounted.allocate_blocks(CLUSTER_SIZE, next, 3 * DISK_SIZE / 4);
+        REQUIRE(status == Brufs::Status::OK);
+        CHECK(next.offset == 3 * DISK_SIZE / 4);
+    }
+}
+
+/**
+ * A disk that only stores the blocks written to it, so it can be larger than memory.
+ *
+ * Discarded blocks read back as zeroes, like a punched hole.
+ */
+class SparseIO : public Brufs::AbstIO {
+private:
+    static constexpr Brufs::Size BLOCK = 4096;
+
+    Brufs::Size size;
+    std::map<Brufs::Address, std::vector<char>> blocks;
+
+public:
+    explicit SparseIO(Brufs::Size size) : size(size) {}
+
+    Brufs::SSize read(void *buf, Brufs::Size count, Brufs::Address offset) const override {
+        if (count + offset > this->size) return Brufs::Status::E_DISK_TRUNCATED;
+
+        auto out = static_cast<char *>(buf);
+        for (Brufs::Size done = 0; done < count;) {
+            const auto at = offset + done;
+            const auto in_block = std::min(count - done, BLOCK - at % BLOCK);
+
+            const auto found = this->blocks.find(at - at % BLOCK);
+            if (found == this->blocks.end()) {
+                memset(out + done, 0, in_block);
+            } else {
+                memcpy(out + done, found->second.data() + at % BLOCK, in_block);
+            }
+
+            done += in_block;
+        }
+
+        return count;
+    }
+
+    Brufs::SSize write(const void *buf, Brufs::Size count, Brufs::Address offset) override {
+        if (count + offset > this->size) return Brufs::Status::E_DISK_TRUNCATED;
+
+        auto in = static_cast<const char *>(buf);
+        for (Brufs::Size done = 0; done < count;) {
+            const auto at = offset + done;
+            const auto in_block = std::min(count - done, BLOCK - at % BLOCK);
+
+            auto &block = this->blocks[at - at % BLOCK];
+            block.resize(BLOCK);
+            memcpy(block.data() + at % BLOCK, in + done, in_block);
+
+            done += in_block;
+        }
+
+        return count;
+    }
+
+    Brufs::SSize discard(Brufs::Size count, Brufs::Address offset) override {
+        std::vector<char> zeroes(std::min(count, BLOCK), 0);
+        for (Brufs::Size done = 0; done < count;) {
+            const auto in_block = std::min(count - done, BLOCK);
+            this->write(zeroes.data(), in_block, offset + done);
+            done += in_block;
+        }
+
+        return count;
+    }
+
+    const char *strstatus(Brufs::SSize eno) const override {
+        return Brufs::strerror(static_cast<Brufs::Status>(eno));
+    }
+
+    Brufs::Size get_size() const override {
+        return this->size;
+    }
+};
+
+TEST_CASE("Space freed into the tail isn't discarded under its next owner", "[Allocation]") {
+    // Larger than the chunks the tail is indexed in, so it survives the first allocations
+    SparseIO io(16ULL * 1024 * 1024 * 1024);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+    proto.set_flag(Brufs::LAZY_INIT, true);
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+    REQUIRE(fs.set_discarding(true) == Brufs::Status::OK);
+
+    // With the spare clusters full, all of the extent returns to the tail when freed
+    REQUIRE(fs.refill_spare_clusters() == Brufs::Status::OK);
+
+    Brufs::Extent first;
+    REQUIRE(fs.allocate_blocks(8 * CLUSTER_SIZE, first, 8ULL * 1024 * 1024 * 1024) == Brufs::Status::OK);
+
+    Brufs::BlockCache::Batch batch(fs.get_cache());
+
+    REQUIRE(fs.free_blocks(first) == Brufs::Status::OK);
+
+    Brufs::Extent again;
+    REQUIRE(fs.allocate_blocks(7 * CLUSTER_SIZE, again, first.offset) == Brufs::Status::OK);
+    REQUIRE(again.offset == first.offset);
+
+    std::vector<char> data(again.length, 'x');
+    REQUIRE(io.write(data.data(), data.size(), again.offset) == static_cast<Brufs::SSize>(data.size()));
+
+    REQUIRE(batch.finish(Brufs::Status::OK) == Brufs::Status::OK);
+
+    std::vector<char> readback(again.length);
+    REQUIRE(io.read(readback.data(), readback.size(), again.offset) == static_cast<Brufs::SSize>(readback.size()));
+    CHECK(readback == data);
+}
+
+TEST_CASE("Spare clusters are refilled on request", "[Allocation]") {
+    MemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    const Brufs::Size free_before = count_total_free(fs);
+
+    // Fragment the free space, so the trees have something to index
+    std::vector<Brufs::Extent> taken;
+    for (int i = 0; i < 1024; ++i) {
+        Brufs::Extent ext;
+        REQUIRE(fs.allocate_blocks(((i % 3) + 2) * CLUSTER_SIZE, ext) == Brufs::Status::OK);
+        taken.push_back(ext);
+    }
+
+    for (size_t i = 0; i < taken.size(); i += 2) {
+        REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+    }
+
+    const Brufs::Size free_after = count_total_free(fs);
+
+    Brufs::Size standby, available, extents, in_fbt;
+
+    SECTION("A raised high mark is reached on request") {
+        REQUIRE(fs.set_spare_cluster_marks(12, 48) == Brufs::Status::OK);
+        REQUIRE(fs.count_free_blocks(standby, available, extents, in_fbt) == Brufs::Status::OK);
+        CHECK(standby == 24 * CLUSTER_SIZE);
+
+        REQUIRE(fs.refill_spare_clusters() == Brufs::Status::OK);
+        REQUIRE(fs.count_free_blocks(standby, available, extents, in_fbt) == Brufs::Status::OK);
+        CHECK(standby == 48 * CLUSTER_SIZE);
+        CHECK(count_total_free(fs) == free_after);
+
+        for (size_t i = 1; i < taken.size(); i += 2) {
+            REQUIRE(fs.free_blocks(taken[i]) == Brufs::Status::OK);
+        }
+
+        CHECK(count_total_free(fs) == free_before);
+
+        REQUIRE(fs.spill_free_lists() == Brufs::Status::OK);
+        Brufs::Brufs remounted(&disk);
+        REQUIRE(remounted.get_status() == Brufs::Status::OK);
+        CHECK(remounted.get_header().sc_high_mark == 48);
+        CHECK(count_total_free(remounted) == free_before);
+    }
+
+    SECTION("Spare clusters above a lowered high mark are freed") {
+        REQUIRE(fs.set_spare_cluster_marks(4, 8) == Brufs::Status::OK);
+        REQUIRE(fs.count_free_blocks(standby, available, extents, in_fbt) == Brufs::Status::OK);
+        CHECK(standby == 8 * CLUSTER_SIZE);
+        CHECK(count_total_free(fs) == free_after);
+    }
+
+    SECTION("Invalid marks are rejected") {
+        CHECK(fs.set_spare_cluster_marks(0, 8) == Brufs::Status::E_INVALID_ARGUMENT);
+        CHECK(fs.set_spare_cluster_marks(9, 8) == Brufs::Status::E_INVALID_ARGUMENT);
+        CHECK(fs.set_spare_cluster_marks(12, 255) == Brufs::Status::E_HEADER_TOO_BIG);
+        CHECK(fs.get_header().sc_high_mark == 24);
+    }
+}
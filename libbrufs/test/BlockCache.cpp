@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <future>
+#include <thread>
+
+#include "catch.hpp"
+
+#include "MemIO.hpp"
+#include "Brufs.hpp"
+#include "BlockCache.hpp"
+
+static constexpr size_t DISK_SIZE = 1024 * 1024;
+static constexpr Brufs::Size NODE_SIZE = 4096;
+
+class CountingMemIO : public MemIO {
+public:
+    mutable unsigned long reads = 0;
+    unsigned long writes = 0;
+    Brufs::Vector<Brufs::Address> write_offsets;
+
+    using MemIO::MemIO;
+
+    Brufs::SSize read(void *buf, Brufs::Size count, Brufs::Address offset) const override {
+        ++this->reads;
+        return MemIO::read(buf, count, offset);
+    }
+
+    Brufs::SSize write(const void *buf, Brufs::Size count, Brufs::Address offset) override {
+        ++this->writes;
+        this->write_offsets.push_back(offset);
+        return MemIO::write(buf, count, offset);
+    }
+};
+
+TEST_CASE("Block caches keep blocks in memory", "[BlockCache]") {
+    CountingMemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+
+    char block[NODE_SIZE];
+    char result[NODE_SIZE];
+
+    SECTION("Repeated reads only hit the disk once") {
+        Brufs::BlockCache cache(&disk, 4);
+
+        REQUIRE(cache.read(NODE_SIZE, NODE_SIZE, result) == Brufs::Status::OK);
+        REQUIRE(cache.read(NODE_SIZE, NODE_SIZE, result) == Brufs::Status::OK);
+        REQUIRE(cache.read(NODE_SIZE, NODE_SIZE, result) == Brufs::Status::OK);
+
+        CHECK(io.reads == 1);
+        CHECK(cache.get_misses() == 1);
+        CHECK(cache.get_hits() == 2);
+    }
+
+    SECTION("Writes go to disk and to the cache") {
+        Brufs::BlockCache cache(&disk, 4);
+
+        memset(block, 0x5A, NODE_SIZE);
+        REQUIRE(cache.write(2 * NODE_SIZE, NODE_SIZE, block) == Brufs::Status::OK);
+
+        REQUIRE(io.read(result, NODE_SIZE, 2 * NODE_SIZE) == NODE_SIZE);
+        CHECK(memcmp(block, result, NODE_SIZE) == 0);
+
+        io.reads = 0;
+        memset(result, 0, NODE_SIZE);
+        REQUIRE(cache.read(2 * NODE_SIZE, NODE_SIZE, result) == Brufs::Status::OK);
+        CHECK(memcmp(block, result, NODE_SIZE) == 0);
+        CHECK(io.reads == 0);
+    }
+
+    SECTION("The cache is bounded") {
+        Brufs::BlockCache cache(&disk, 2);
+
+        for (Brufs::Address addr = NODE_SIZE; addr <= 8 * NODE_SIZE; addr += NODE_SIZE) {
+            REQUIRE(cache.read(addr, NODE_SIZE, result) == Brufs::Status::OK);
+        }
+
+        CHECK(cache.get_misses() == 8);
+
+        REQUIRE(cache.read(NODE_SIZE, NODE_SIZE, result) == Brufs::Status::OK);
+        CHECK(cache.get_misses() == 9);
+    }
+
+    SECTION("Pinned blocks are never evicted") {
+        Brufs::BlockCache cache(&disk, 2);
+
+        Brufs::BlockCache::Slot *pinned;
+        REQUIRE(cache.acquire(NODE_SIZE, NODE_SIZE, pinned) == Brufs::Status::OK);
+
+        for (Brufs::Address addr = 2 * NODE_SIZE; addr <= 8 * NODE_SIZE; addr += NODE_SIZE) {
+            REQUIRE(cache.read(addr, NODE_SIZE, result) == Brufs::Status::OK);
+        }
+
+        CHECK(pinned->addr == NODE_SIZE);
+
+        Brufs::BlockCache::Slot *again;
+        REQUIRE(cache.acquire(NODE_SIZE, NODE_SIZE, again) == Brufs::Status::OK);
+        CHECK(again == pinned);
+
+        cache.release(again);
+        cache.release(pinned);
+    }
+
+    SECTION("Reads bypass the cache when every slot is pinned") {
+        Brufs::BlockCache cache(&disk, 1);
+
+        Brufs::BlockCache::Slot *pinned;
+        REQUIRE(cache.acquire(NODE_SIZE, NODE_SIZE, pinned) == Brufs::Status::OK);
+
+        CHECK(cache.read(2 * NODE_SIZE, NODE_SIZE, result) == Brufs::Status::OK);
+
+        cache.release(pinned);
+    }
+
+    SECTION("Invalidated blocks are read from disk again") {
+        Brufs::BlockCache cache(&disk, 4);
+
+        REQUIRE(cache.read(NODE_SIZE, NODE_SIZE, result) == Brufs::Status::OK);
+
+        memset(block, 0xA5, NODE_SIZE);
+        REQUIRE(io.write(block, NODE_SIZE, NODE_SIZE) == NODE_SIZE);
+
+        cache.invalidate(0, 2 * NODE_SIZE);
+
+        REQUIRE(cache.read(NODE_SIZE, NODE_SIZE, result) == Brufs::Status::OK);
+        CHECK(memcmp(block, result, NODE_SIZE) == 0);
+        CHECK(cache.get_misses() == 2);
+    }
+}
+
+TEST_CASE("Block caches defer writes in batches", "[BlockCache]") {
+    CountingMemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+
+    char block[NODE_SIZE];
+    char result[NODE_SIZE];
+
+    SECTION("Each dirty block is written once, in address order") {
+        Brufs::BlockCache cache(&disk, 8);
+
+        cache.begin_batch();
+
+        for (int round = 0; round < 3; ++round) {
+            for (Brufs::Address addr = 4 * NODE_SIZE; addr >= NODE_SIZE; addr -= NODE_SIZE) {
+                memset(block, round + addr / NODE_SIZE, NODE_SIZE);
+                REQUIRE(cache.write(addr, NODE_SIZE, block) == Brufs::Status::OK);
+            }
+        }
+
+        CHECK(io.writes == 0);
+        CHECK(cache.get_num_dirty() == 4);
+
+        REQUIRE(cache.end_batch() == Brufs::Status::OK);
+
+        REQUIRE(io.writes == 4);
+        CHECK(cache.get_num_dirty() == 0);
+
+        for (unsigned int i = 0; i < 4; ++i) {
+            CHECK(io.write_offsets[i] == (i + 1) * NODE_SIZE);
+
+            REQUIRE(io.read(result, NODE_SIZE, (i + 1) * NODE_SIZE) == NODE_SIZE);
+            CHECK(result[0] == static_cast<char>(2 + i + 1));
+        }
+    }
+
+    SECTION("Dirty blocks can be read back before they are written") {
+        Brufs::BlockCache cache(&disk, 4);
+
+        cache.begin_batch();
+
+        memset(block, 0x3C, NODE_SIZE);
+        REQUIRE(cache.write(NODE_SIZE, NODE_SIZE, block) == Brufs::Status::OK);
+        REQUIRE(cache.read(NODE_SIZE, NODE_SIZE, result) == Brufs::Status::OK);
+        CHECK(memcmp(block, result, NODE_SIZE) == 0);
+
+        REQUIRE(cache.end_batch() == Brufs::Status::OK);
+    }
+
+    SECTION("Only the outermost batch writes the dirty blocks") {
+        Brufs::BlockCache cache(&disk, 4);
+
+        {
+            Brufs::BlockCache::Batch outer(cache);
+
+            {
+                Brufs::BlockCache::Batch inner(cache);
+                REQUIRE(cache.write(NODE_SIZE, NODE_SIZE, block) == Brufs::Status::OK);
+                REQUIRE(inner.finish(Brufs::Status::OK) == Brufs::Status::OK);
+            }
+
+            CHECK(io.writes == 0);
+            REQUIRE(outer.finish(Brufs::Status::OK) == Brufs::Status::OK);
+        }
+
+        CHECK(io.writes == 1);
+    }
+
+    SECTION("Dirty blocks are never evicted") {
+        Brufs::BlockCache cache(&disk, 2);
+
+        cache.begin_batch();
+
+        for (Brufs::Address addr = NODE_SIZE; addr <= 4 * NODE_SIZE; addr += NODE_SIZE) {
+            REQUIRE(cache.write(addr, NODE_SIZE, block) == Brufs::Status::OK);
+        }
+
+        // The last two writes didn't fit and went straight to disk
+        CHECK(io.writes == 2);
+        CHECK(cache.get_num_dirty() == 2);
+
+        REQUIRE(cache.end_batch() == Brufs::Status::OK);
+        CHECK(io.writes == 4);
+    }
+
+    SECTION("A batch of another thread doesn't hold back the write-back") {
+        Brufs::BlockCache cache(&disk, 4);
+
+        // Catch assertions aren't thread-safe, so the other thread only records its results
+        Brufs::Status other_write, other_finish;
+        std::promise<void> opened, done;
+        std::thread other([&]() {
+            Brufs::BlockCache::Batch batch(cache);
+            other_write = cache.write(NODE_SIZE, NODE_SIZE, block);
+
+            opened.set_value();
+            done.get_future().wait();
+
+            other_finish = batch.finish(Brufs::Status::OK);
+        });
+
+        opened.get_future().wait();
+        CHECK_FALSE(cache.in_batch());
+
+        // Outside of a batch, writes still go straight to disk
+        REQUIRE(cache.write(2 * NODE_SIZE, NODE_SIZE, block) == Brufs::Status::OK);
+        CHECK(io.writes == 1);
+
+        {
+            Brufs::BlockCache::Batch batch(cache);
+            REQUIRE(cache.write(3 * NODE_SIZE, NODE_SIZE, block) == Brufs::Status::OK);
+            CHECK(io.writes == 1);
+
+            REQUIRE(batch.finish(Brufs::Status::OK) == Brufs::Status::OK);
+        }
+
+        CHECK(cache.get_num_dirty() == 0);
+        CHECK(io.writes == 3);
+
+        done.set_value();
+        other.join();
+
+        CHECK(other_write == Brufs::Status::OK);
+        CHECK(other_finish == Brufs::Status::OK);
+    }
+
+    SECTION("Invalidated dirty blocks are never written") {
+        Brufs::BlockCache cache(&disk, 4);
+
+        cache.begin_batch();
+
+        REQUIRE(cache.write(NODE_SIZE, NODE_SIZE, block) == Brufs::Status::OK);
+        REQUIRE(cache.write(2 * NODE_SIZE, NODE_SIZE, block) == Brufs::Status::OK);
+        cache.invalidate(NODE_SIZE, NODE_SIZE);
+
+        REQUIRE(cache.end_batch() == Brufs::Status::OK);
+
+        REQUIRE(io.writes == 1);
+        CHECK(io.write_offsets[0] == 2 * NODE_SIZE);
+    }
+}
+
+TEST_CASE("Tree operations write each node once", "[BlockCache]") {
+    CountingMemIO io(32 * 1024 * 1024);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    Brufs::BmTree::BmTree<uint64_t, uint64_t> tree(&fs, 4096);
+    REQUIRE(tree.init() == Brufs::Status::OK);
+
+    io.writes = 0;
+    io.write_offsets.clear();
+
+    {
+        Brufs::BlockCache::Batch batch(fs.get_cache());
+
+        for (uint64_t key = 0; key < 2000; ++key) {
+            REQUIRE(tree.insert(key * 7919 % 2000, &key) == Brufs::Status::OK);
+        }
+
+        // Only the filesystem header bypasses the cache
+        for (const auto offset : io.write_offsets) CHECK(offset == 0);
+
+        REQUIRE(batch.finish(Brufs::Status::OK) == Brufs::Status::OK);
+    }
+
+    Brufs::Vector<Brufs::Address> node_writes;
+    for (const auto offset : io.write_offsets) {
+        if (offset != 0) node_writes.push_back(offset);
+    }
+
+    REQUIRE(node_writes.get_size() > 1);
+    for (Brufs::Size i = 1; i < node_writes.get_size(); ++i) {
+        CHECK(node_writes[i - 1] < node_writes[i]);
+    }
+
+    CHECK(fs.get_cache().get_num_dirty() == 0);
+
+    for (uint64_t key = 0; key < 2000; ++key) {
+        uint64_t value;
+        REQUIRE(tree.search(key * 7919 % 2000, &value) == Brufs::Status::OK);
+        CHECK(value == key);
+    }
+}
+
+TEST_CASE("Tree lookups are served from the block cache", "[BlockCache]") {
+    CountingMemIO io(32 * 1024 * 1024);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    Brufs::RootHeader root_header;
+    root_header.set_label("root-name");
+    REQUIRE(fs.add_root(root_header) == Brufs::Status::OK);
+
+    io.reads = 0;
+
+    Brufs::RootHeader found;
+    REQUIRE(fs.find_root("root-name", found) == Brufs::Status::OK);
+    REQUIRE(fs.find_root("root-name", found) == Brufs::Status::OK);
+
+    CHECK(io.reads == 0);
+    CHECK(fs.get_cache().get_hits() > 0);
+}
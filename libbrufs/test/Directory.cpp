@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <set>
+#include <string>
+
+#include "catch.hpp"
+
+#include "MemIO.hpp"
+#include "Brufs.hpp"
+#include "Root.hpp"
+#include "Directory.hpp"
+#include "EntityCreator.hpp"
+
+static constexpr size_t NORMAL_DISK_SIZE = 32 * 1024 * 1024;
+
+TEST_CASE("Directories can be listed in slices", "[Directory]") {
+    MemIO mem_io(NORMAL_DISK_SIZE);
+    Brufs::Disk disk(&mem_io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    Brufs::RootHeader root_header;
+    root_header.set_label("root-name");
+
+    Brufs::Root root(fs, root_header);
+    REQUIRE(root.init() == Brufs::Status::OK);
+    REQUIRE(fs.add_root(root) == Brufs::Status::OK);
+
+    Brufs::InodeIdGenerator inode_id_generator;
+    Brufs::EntityCreator entity_creator(inode_id_generator);
+
+    Brufs::Path path("root-name", Brufs::Vector<Brufs::String>::of("dir"));
+    Brufs::Directory dir(root);
+    Brufs::InodeHeaderBuilder ihb;
+    REQUIRE(entity_creator.create_directory(path, ihb, dir) == Brufs::Status::OK);
+
+    static constexpr unsigned int NUM_ENTRIES = 500;
+    for (unsigned int i = 0; i < NUM_ENTRIES; ++i) {
+        const auto label = "entry-" + std::to_string(i);
+        REQUIRE(dir.insert(Brufs::String(label.c_str()), i + 1) == Brufs::Status::OK);
+    }
+
+    Brufs::Vector<Brufs::DirectoryEntry> all;
+    REQUIRE(dir.collect(all) == Brufs::Status::OK);
+    // Including . and ..
+    const Brufs::Size total = all.get_size();
+    REQUIRE(total == NUM_ENTRIES + 2);
+
+    SECTION("slices cover the directory exactly once") {
+        std::set<std::string> seen;
+
+        for (Brufs::Size offset = 0; offset < total; offset += 64) {
+            Brufs::Vector<Brufs::DirectoryEntry> slice;
+            REQUIRE(dir.collect(slice, offset, 64) == Brufs::Status::OK);
+            REQUIRE(slice.get_size() == std::min<Brufs::Size>(64, total - offset));
+
+            for (Brufs::Size i = 0; i < slice.get_size(); ++i) {
+                CHECK(slice[i].inode_id == all[offset + i].inode_id);
+                seen.insert(std::string(slice[i].label, strnlen(slice[i].label, Brufs::MAX_LABEL_LENGTH)));
+            }
+        }
+
+        CHECK(seen.size() == total);
+    }
+
+    SECTION("a slice past the end is empty") {
+        Brufs::Vector<Brufs::DirectoryEntry> slice;
+        REQUIRE(dir.collect(slice, total, 10) == Brufs::Status::OK);
+        CHECK(slice.empty());
+    }
+}
@@ -20,6 +20,9 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
+#include <vector>
+
 #include "catch.hpp"
 
 #include "MemIO.hpp"
@@ -33,6 +36,26 @@
 static constexpr size_t NORMAL_DISK_SIZE = 32 * 1024 * 1024;
 static constexpr Brufs::InodeId INODE_ID = 65536;
 
+/**
+ * Fails to write anything from a given buffer, so file data can be lost while metadata isn't.
+ */
+class FailingIO : public MemIO {
+public:
+    std::vector<char> *failing = nullptr;
+
+    FailingIO(size_t size) : MemIO(size) {}
+
+    Brufs::SSize write(const void *buf, Brufs::Size count, Brufs::Address offset) override {
+        const auto cbuf = static_cast<const char *>(buf);
+        if (this->failing && cbuf >= this->failing->data()
+                && cbuf < this->failing->data() + this->failing->size()) {
+            return Brufs::Status::E_DISK_TRUNCATED;
+        }
+
+        return MemIO::write(buf, count, offset);
+    }
+};
+
 class StaticInodeIdGenerator : public Brufs::InodeIdGenerator {
 public:
     Brufs::InodeId generate() const override {
@@ -76,4 +99,423 @@ TEST_CASE("Can read and write files", "[File]") {
         char buf[1];
         CHECK(file.read(buf, 0, 0) == 0);
     }
+
+    SECTION("Shrinking a file releases the extents beyond the new end") {
+        char buf[4096];
+        for (unsigned int i = 0; i < 64; ++i) {
+            memset(buf, static_cast<int>(i), sizeof(buf));
+
+            for (Brufs::Size written = 0; written < sizeof(buf);) {
+                const auto num = file.write(buf + written, sizeof(buf) - written, i * sizeof(buf) + written);
+                REQUIRE(num > 0);
+                written += num;
+            }
+        }
+
+        Brufs::Size reserved, available_before, available_after, extents, in_fbt;
+        REQUIRE(fs.count_free_blocks(reserved, available_before, extents, in_fbt) == Brufs::Status::OK);
+
+        REQUIRE(file.truncate(3 * sizeof(buf) + 100) == Brufs::Status::OK);
+        CHECK(file.get_size() == 3 * sizeof(buf) + 100);
+
+        REQUIRE(fs.count_free_blocks(reserved, available_after, extents, in_fbt) == Brufs::Status::OK);
+        CHECK(reserved + available_after >= available_before + 60 * sizeof(buf));
+
+        REQUIRE(file.read(buf, sizeof(buf), 3 * sizeof(buf)) == 100);
+        CHECK(buf[0] == 3);
+        CHECK(buf[99] == 3);
+    }
+
+    SECTION("Appending keeps the file physically contiguous") {
+        char buf[4096];
+        memset(buf, 'a', sizeof(buf));
+
+        for (unsigned int i = 0; i < 16; ++i) {
+            for (Brufs::Size written = 0; written < sizeof(buf);) {
+                const auto num = file.write(buf + written, sizeof(buf) - written, i * sizeof(buf) + written);
+                REQUIRE(num > 0);
+                written += num;
+            }
+        }
+
+        Brufs::InodeExtentTree iet(file);
+        Brufs::BmTree::Cursor<Brufs::Offset, Brufs::DataExtent> cursor(iet);
+
+        Brufs::DataExtent prev;
+        REQUIRE(cursor.seek_first() == Brufs::Status::OK);
+        prev = *cursor.get_value();
+
+        Brufs::Status status;
+        while ((status = cursor.next()) == Brufs::Status::OK) {
+            const auto &ext = *cursor.get_value();
+            CHECK(ext.local_start == prev.get_local_end());
+            CHECK(ext.offset == prev.offset + prev.length);
+            prev = ext;
+        }
+        CHECK(status == Brufs::Status::E_NOT_FOUND);
+    }
+
+    SECTION("A large write completes in a single call") {
+        std::vector<char> buf(1024 * 1024);
+        for (size_t i = 0; i < buf.size(); ++i) buf[i] = static_cast<char>(i / 4096);
+
+        // The first cluster starts out as a single block, which is grown separately
+        for (Brufs::Size written = 0; written < 4096;) {
+            const auto num = file.write(buf.data() + written, 4096 - written, written);
+            REQUIRE(num > 0);
+            written += num;
+        }
+
+        const auto rest = static_cast<Brufs::SSize>(buf.size() - 4096);
+        CHECK(file.write(buf.data() + 4096, rest, 4096) == rest);
+
+        std::vector<char> readback(buf.size());
+        for (Brufs::Size done = 0; done < readback.size();) {
+            const auto num = file.read(readback.data() + done, readback.size() - done, done);
+            REQUIRE(num > 0);
+            done += num;
+        }
+
+        CHECK(std::equal(readback.begin(), readback.end(), buf.begin()));
+
+        // The extents of sequentially written files may exceed the maximum of the root
+        Brufs::InodeExtentTree iet(file);
+        Brufs::BmTree::Cursor<Brufs::Offset, Brufs::DataExtent> cursor(iet);
+
+        Brufs::Status status;
+        for (status = cursor.seek_first(); status == Brufs::Status::OK; status = cursor.next()) {
+            CHECK(cursor.get_value()->length <= Brufs::File::MAX_SEQUENTIAL_EXTENT_LENGTH);
+        }
+        CHECK(status == Brufs::Status::E_NOT_FOUND);
+    }
+
+    SECTION("A sparse file is read in full in a single call") {
+        const Brufs::Size size = 512 * 1024;
+        std::vector<char> expected(size, 0);
+
+        // Data at the start, in the middle and at the end, with holes in between
+        const Brufs::Offset offsets[] = {0, 64 * 1024, size - 8192};
+        const Brufs::Size lengths[] = {4096, 128 * 1024, 8192};
+        for (int i = 0; i < 3; ++i) {
+            for (Brufs::Size j = 0; j < lengths[i]; ++j) {
+                expected[offsets[i] + j] = static_cast<char>(i + 1 + j / 4096);
+            }
+
+            for (Brufs::Size written = 0; written < lengths[i];) {
+                const auto num = file.write(
+                    expected.data() + offsets[i] + written, lengths[i] - written,
+                    offsets[i] + written
+                );
+                REQUIRE(num > 0);
+                written += num;
+            }
+        }
+
+        REQUIRE(file.get_size() == size);
+
+        std::vector<char> readback(size + 4096, 'x');
+        CHECK(file.read_full(readback.data(), readback.size(), 0) == static_cast<Brufs::SSize>(size));
+        CHECK(std::equal(expected.begin(), expected.end(), readback.begin()));
+
+        // Starting and ending in holes
+        const Brufs::Offset start = 16 * 1024;
+        const Brufs::Size count = 256 * 1024;
+        CHECK(file.read_full(readback.data(), count, start) == static_cast<Brufs::SSize>(count));
+        CHECK(std::equal(
+            expected.begin() + start, expected.begin() + start + count, readback.begin()
+        ));
+
+        CHECK(file.read_full(readback.data(), 1, size + 1) == Brufs::Status::E_BEYOND_EOF);
+    }
+
+    SECTION("A write spanning extents and holes completes in a single call") {
+        std::vector<char> expected(512 * 1024, 0);
+
+        // Leave holes between a few existing extents
+        const Brufs::Offset offsets[] = {64 * 1024, 128 * 1024, 132 * 1024};
+        for (auto data_offset : offsets) {
+            memset(expected.data() + data_offset, 'e', 8192);
+            for (Brufs::Size written = 0; written < 8192;) {
+                const auto num = file.write(
+                    expected.data() + data_offset + written, 8192 - written, data_offset + written
+                );
+                REQUIRE(num > 0);
+                written += num;
+            }
+        }
+
+        const Brufs::Offset start = 32 * 1024 + 100;
+        const Brufs::Size count = 320 * 1024;
+        for (Brufs::Size i = 0; i < count; ++i) expected[start + i] = static_cast<char>(i / 4096);
+
+        CHECK(file.write(expected.data() + start, count, start) == static_cast<Brufs::SSize>(count));
+        CHECK(file.get_size() == start + count);
+
+        std::vector<char> readback(file.get_size());
+        REQUIRE(file.read_full(readback.data(), readback.size(), 0) == static_cast<Brufs::SSize>(readback.size()));
+        CHECK(std::equal(readback.begin(), readback.end(), expected.begin()));
+
+        // The extents don't overlap
+        Brufs::InodeExtentTree iet(file);
+        Brufs::BmTree::Cursor<Brufs::Offset, Brufs::DataExtent> cursor(iet);
+
+        Brufs::Offset prev_end = 0;
+        Brufs::Status status;
+        for (status = cursor.seek_first(); status == Brufs::Status::OK; status = cursor.next()) {
+            CHECK(cursor.get_value()->local_start >= prev_end);
+            prev_end = cursor.get_value()->get_local_end();
+        }
+        CHECK(status == Brufs::Status::E_NOT_FOUND);
+    }
+
+    SECTION("Plain writes don't reserve space beyond the end") {
+        char buf[4096];
+        memset(buf, 'a', sizeof(buf));
+
+        for (unsigned int i = 0; i < 16; ++i) {
+            REQUIRE(file.write(buf, sizeof(buf), i * sizeof(buf)) == sizeof(buf));
+        }
+
+        Brufs::InodeExtentTree iet(file);
+        Brufs::DataExtent last;
+        REQUIRE(iet.get_last(last) == Brufs::Status::OK);
+        CHECK(last.get_local_end() == file.get_size());
+        CHECK(last.length <= root.get_header().max_extent_length);
+    }
+
+    SECTION("Appending grows the last extent beyond the maximum of the root") {
+        char buf[4096];
+        memset(buf, 'a', sizeof(buf));
+
+        for (unsigned int i = 0; i < 64; ++i) {
+            for (Brufs::Size written = 0; written < sizeof(buf);) {
+                const auto num = file.write_sequential(buf + written, sizeof(buf) - written, i * sizeof(buf) + written);
+                REQUIRE(num > 0);
+                written += num;
+            }
+        }
+
+        Brufs::InodeExtentTree iet(file);
+        Brufs::Size num_extents;
+        REQUIRE(iet.count_values(num_extents) == Brufs::Status::OK);
+        CHECK(num_extents < 64 * sizeof(buf) / root.get_header().max_extent_length);
+
+        Brufs::DataExtent last;
+        REQUIRE(iet.get_last(last) == Brufs::Status::OK);
+        CHECK(last.length > root.get_header().max_extent_length);
+
+        std::vector<char> readback(file.get_size());
+        REQUIRE(file.read_full(readback.data(), readback.size(), 0) == static_cast<Brufs::SSize>(readback.size()));
+        CHECK(std::all_of(readback.begin(), readback.end(), [](char c) { return c == 'a'; }));
+
+        SECTION("Trimming releases the space reserved beyond the end") {
+            CHECK(last.get_local_end() > file.get_size());
+
+            Brufs::Size reserved, available_before, available_after, extents, in_fbt;
+            REQUIRE(fs.count_free_blocks(reserved, available_before, extents, in_fbt) == Brufs::Status::OK);
+
+            REQUIRE(file.trim() == Brufs::Status::OK);
+
+            REQUIRE(iet.get_last(last) == Brufs::Status::OK);
+            CHECK(last.get_local_end() == file.get_size());
+
+            REQUIRE(fs.count_free_blocks(reserved, available_after, extents, in_fbt) == Brufs::Status::OK);
+            CHECK(available_after > available_before);
+
+            REQUIRE(file.read_full(readback.data(), readback.size(), 0) == static_cast<Brufs::SSize>(readback.size()));
+            CHECK(std::all_of(readback.begin(), readback.end(), [](char c) { return c == 'a'; }));
+        }
+
+        SECTION("Growing the file again doesn't expose stale data") {
+            const Brufs::Size shrunk = 5000;
+            REQUIRE(file.truncate(shrunk) == Brufs::Status::OK);
+
+            REQUIRE(iet.get_last(last) == Brufs::Status::OK);
+            CHECK(last.get_local_end() == 2 * sizeof(buf));
+
+            REQUIRE(file.truncate(readback.size()) == Brufs::Status::OK);
+            REQUIRE(file.read_full(readback.data(), readback.size(), 0) == static_cast<Brufs::SSize>(readback.size()));
+            CHECK(std::all_of(readback.begin(), readback.begin() + shrunk, [](char c) { return c == 'a'; }));
+            CHECK(std::all_of(readback.begin() + shrunk, readback.end(), [](char c) { return c == 0; }));
+
+            // Writing past the end zeroes the gap before the data as well
+            REQUIRE(file.truncate(shrunk) == Brufs::Status::OK);
+            REQUIRE(file.write(buf, 1, 3 * sizeof(buf)) == 1);
+            REQUIRE(file.read_full(readback.data(), 3 * sizeof(buf) + 1, 0) == static_cast<Brufs::SSize>(3 * sizeof(buf) + 1));
+            CHECK(std::all_of(readback.begin() + shrunk, readback.begin() + 3 * sizeof(buf), [](char c) { return c == 0; }));
+            CHECK(readback[3 * sizeof(buf)] == 'a');
+        }
+    }
+
+    SECTION("An attached extent map stays in line with the extent tree") {
+        Brufs::ExtentMap map;
+        file.set_extent_map(&map);
+
+        const auto check_map = [&]() {
+            Brufs::Vector<Brufs::DataExtent> mapped;
+            map.find_range(0, static_cast<Brufs::Offset>(-1), mapped);
+
+            Brufs::InodeExtentTree iet(file);
+            Brufs::BmTree::Cursor<Brufs::Offset, Brufs::DataExtent> cursor(iet);
+
+            Brufs::Size i = 0;
+            Brufs::Status status;
+            for (status = cursor.seek_first(); status == Brufs::Status::OK; status = cursor.next()) {
+                REQUIRE(i < mapped.get_size());
+                CHECK(mapped[i].local_start == cursor.get_value()->local_start);
+                CHECK(mapped[i].offset == cursor.get_value()->offset);
+                CHECK(mapped[i].length == cursor.get_value()->length);
+                ++i;
+            }
+            CHECK(status == Brufs::Status::E_NOT_FOUND);
+            CHECK(i == mapped.get_size());
+        };
+
+        std::vector<char> expected(1024 * 1024, 0);
+        const auto write = [&](Brufs::Offset offset, Brufs::Size count, char value) {
+            memset(expected.data() + offset, value, count);
+            REQUIRE(file.write(expected.data() + offset, count, offset) == static_cast<Brufs::SSize>(count));
+        };
+
+        // Appends, writes into holes and over existing data
+        write(0, 4096, 'a');
+        write(4096, 60000, 'b');
+        write(512 * 1024, 8192, 'c');
+        write(128 * 1024, 200 * 1024, 'd');
+        write(1000, 100000, 'e');
+        CHECK(map.is_loaded());
+        check_map();
+
+        std::vector<char> readback(file.get_size());
+        REQUIRE(file.read_full(readback.data(), readback.size(), 0) == static_cast<Brufs::SSize>(readback.size()));
+        CHECK(std::equal(readback.begin(), readback.end(), expected.begin()));
+
+        for (Brufs::Offset offset = 0; offset < file.get_size(); offset += 10000) {
+            char c;
+            REQUIRE(file.read(&c, 1, offset) == 1);
+            CHECK(c == expected[offset]);
+        }
+
+        // Another copy of the inode shares the map
+        Brufs::File copy = file;
+        REQUIRE(copy.truncate(200 * 1024) == Brufs::Status::OK);
+        check_map();
+
+        REQUIRE(copy.trim() == Brufs::Status::OK);
+        check_map();
+
+        // Going small drops every extent, and going big again starts over
+        REQUIRE(copy.truncate(10) == Brufs::Status::OK);
+        CHECK(!map.is_loaded());
+
+        file = copy;
+        write(64 * 1024, 4096, 'f');
+        check_map();
+    }
+}
+
+TEST_CASE("Growing the first block of a file doesn't expose stale data", "[File]") {
+    MemIO mem_io(NORMAL_DISK_SIZE);
+
+    // Whatever was on the device before must never show up in the file
+    std::vector<char> pattern(NORMAL_DISK_SIZE, 'S');
+    REQUIRE(mem_io.write(pattern.data(), pattern.size(), 0) == static_cast<Brufs::SSize>(pattern.size()));
+
+    Brufs::Disk disk(&mem_io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    Brufs::RootHeader root_header;
+    root_header.set_label("root-name");
+
+    Brufs::Root root(fs, root_header);
+    REQUIRE(root.init() == Brufs::Status::OK);
+    REQUIRE(fs.add_root(root) == Brufs::Status::OK);
+
+    StaticInodeIdGenerator inode_id_generator;
+    Brufs::EntityCreator entity_creator(inode_id_generator);
+
+    Brufs::Path path("root-name", Brufs::Vector<Brufs::String>::of("thing"));
+    Brufs::File file(root);
+    Brufs::InodeHeaderBuilder ihb;
+    REQUIRE(entity_creator.create_file(path, ihb, file) == Brufs::Status::OK);
+
+    // Too large for the inode, so the data moves to a single block
+    std::vector<char> data(300, 'd');
+    REQUIRE(file.write(data.data(), data.size(), 0) == static_cast<Brufs::SSize>(data.size()));
+    REQUIRE(file.get_size() > file.get_data_size());
+
+    // Writing past the block grows it to a cluster, leaving a gap before the new data
+    const Brufs::Offset offset = 3000;
+    REQUIRE(file.write("e", 1, offset) == 1);
+
+    std::vector<char> readback(offset + 1);
+    REQUIRE(file.read_full(readback.data(), readback.size(), 0) == static_cast<Brufs::SSize>(readback.size()));
+    CHECK(std::all_of(readback.begin(), readback.begin() + data.size(), [](char c) { return c == 'd'; }));
+    CHECK(std::all_of(readback.begin() + data.size(), readback.begin() + offset, [](char c) { return c == 0; }));
+    CHECK(readback[offset] == 'e');
+}
+
+TEST_CASE("A failed write leaves the extents of a file as they were", "[File]") {
+    FailingIO io(NORMAL_DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    Brufs::RootHeader root_header;
+    root_header.set_label("root-name");
+
+    Brufs::Root root(fs, root_header);
+    REQUIRE(root.init() == Brufs::Status::OK);
+    REQUIRE(fs.add_root(root) == Brufs::Status::OK);
+
+    StaticInodeIdGenerator inode_id_generator;
+    Brufs::EntityCreator entity_creator(inode_id_generator);
+
+    Brufs::Path path("root-name", Brufs::Vector<Brufs::String>::of("thing"));
+    Brufs::File file(root);
+    Brufs::InodeHeaderBuilder ihb;
+    REQUIRE(entity_creator.create_file(path, ihb, file) == Brufs::Status::OK);
+
+    std::vector<char> data(8192, 'd');
+    REQUIRE(file.write(data.data(), data.size(), 0) == static_cast<Brufs::SSize>(data.size()));
+
+    REQUIRE(file.trim() == Brufs::Status::OK);
+
+    Brufs::InodeExtentTree iet(file);
+    Brufs::DataExtent last_before;
+    REQUIRE(iet.get_last(last_before) == Brufs::Status::OK);
+    REQUIRE(last_before.get_local_end() == file.get_size());
+
+    Brufs::Size reserved_before, reserved_after, available_before, available_after, extents, in_fbt;
+    REQUIRE(fs.count_free_blocks(reserved_before, available_before, extents, in_fbt) == Brufs::Status::OK);
+
+    // Appending grows the last extent, but the data never reaches the disk
+    io.failing = &data;
+    CHECK(file.write(data.data(), data.size(), file.get_size()) < 0);
+    io.failing = nullptr;
+
+    Brufs::DataExtent last_after;
+    REQUIRE(iet.get_last(last_after) == Brufs::Status::OK);
+    CHECK(last_after.offset == last_before.offset);
+    CHECK(last_after.length == last_before.length);
+
+    REQUIRE(fs.count_free_blocks(reserved_after, available_after, extents, in_fbt) == Brufs::Status::OK);
+    CHECK(reserved_after + available_after == reserved_before + available_before);
+
+    std::vector<char> readback(data.size());
+    REQUIRE(file.read_full(readback.data(), readback.size(), 0) == static_cast<Brufs::SSize>(readback.size()));
+    CHECK(std::all_of(readback.begin(), readback.end(), [](char c) { return c == 'd'; }));
 }
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2017-2018 Luc Everse <luc@wukl.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "MemIO.hpp"
+#include "Brufs.hpp"
+
+static constexpr size_t DISK_SIZE = 64 * 1024 * 1024;
+static constexpr unsigned int NUM_THREADS = 4;
+static constexpr uint64_t NUM_KEYS = 3000;
+
+static Brufs::Status fill_and_drain(Brufs::BmTree::BmTree<uint64_t, uint64_t> &tree) {
+    auto status = tree.init();
+    if (status < Brufs::Status::OK) return status;
+
+    for (uint64_t i = 0; i < NUM_KEYS; ++i) {
+        const uint64_t key = i * 7919 % NUM_KEYS;
+        status = tree.insert(key, &i);
+        if (status < Brufs::Status::OK) return status;
+    }
+
+    for (uint64_t key = 0; key < NUM_KEYS; key += 2) {
+        uint64_t value;
+        status = tree.remove(key, &value, true);
+        if (status < Brufs::Status::OK) return status;
+    }
+
+    return Brufs::Status::OK;
+}
+
+/**
+ * Holds up the first read of a given block until it's let go.
+ */
+class StallingIO : public MemIO {
+public:
+    Brufs::Address stall_at = 0;
+    std::promise<void> stalled, let_go;
+
+    using MemIO::MemIO;
+
+    Brufs::SSize read(void *buf, Brufs::Size count, Brufs::Address offset) const override {
+        auto self = const_cast<StallingIO *>(this);
+        if (self->stall_at != 0 && offset == self->stall_at) {
+            self->stall_at = 0;
+            self->stalled.set_value();
+            self->let_go.get_future().wait();
+        }
+
+        return MemIO::read(buf, count, offset);
+    }
+};
+
+TEST_CASE("A batch writes the header while another thread holds the filesystem", "[Threads]") {
+    StallingIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    Brufs::Extent ext;
+    REQUIRE(fs.allocate_blocks(16 * 4096, ext) == Brufs::Status::OK);
+
+    fs.get_cache().clear();
+
+    Brufs::SSize num_roots = 0;
+    std::thread reader, releaser;
+
+    {
+        Brufs::BlockCache::Batch batch(fs.get_cache());
+        REQUIRE(fs.free_blocks(ext) == Brufs::Status::OK);
+
+        // Looking up the roots holds the filesystem lock while reading the root header tree
+        io.stall_at = fs.get_header().rht_address;
+        reader = std::thread([&] { num_roots = fs.count_roots(); });
+        io.stalled.get_future().wait();
+
+        releaser = std::thread([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            io.let_go.set_value();
+        });
+
+        REQUIRE(batch.finish(Brufs::Status::OK) == Brufs::Status::OK);
+    }
+
+    // Nothing else will write the header later
+    const auto &header = fs.get_header();
+    std::vector<char> on_disk(header.header_size);
+    REQUIRE(io.MemIO::read(on_disk.data(), on_disk.size(), 0) == static_cast<Brufs::SSize>(on_disk.size()));
+    CHECK(memcmp(on_disk.data(), &header, on_disk.size()) == 0);
+
+    releaser.join();
+    reader.join();
+    CHECK(num_roots == 0);
+}
+
+TEST_CASE("Trees on the same filesystem can be modified in parallel", "[Threads]") {
+    MemIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    Brufs::Header proto;
+    proto.cluster_size_exp = 12;
+    proto.sc_low_mark = 12;
+    proto.sc_high_mark = 24;
+
+    REQUIRE(fs.init(proto) == Brufs::Status::OK);
+
+    Brufs::Size standby, available_before, available_after, extents, in_fbt;
+    REQUIRE(fs.count_free_blocks(standby, available_before, extents, in_fbt) == Brufs::Status::OK);
+    available_before += standby + in_fbt;
+
+    std::vector<std::unique_ptr<Brufs::BmTree::BmTree<uint64_t, uint64_t>>> trees;
+    for (unsigned int i = 0; i < NUM_THREADS; ++i) {
+        trees.emplace_back(new Brufs::BmTree::BmTree<uint64_t, uint64_t>(&fs, 4096));
+    }
+
+    std::vector<Brufs::Status> results(NUM_THREADS, Brufs::Status::OK);
+    std::vector<std::thread> threads;
+
+    for (unsigned int i = 0; i < NUM_THREADS; ++i) {
+        threads.emplace_back([&trees, &results, i] {
+            results[i] = fill_and_drain(*trees[i]);
+        });
+    }
+
+    for (auto &thread : threads) thread.join();
+
+    for (unsigned int i = 0; i < NUM_THREADS; ++i) {
+        REQUIRE(results[i] == Brufs::Status::OK);
+
+        Brufs::Size count;
+        REQUIRE(trees[i]->count_values(count) == Brufs::Status::OK);
+        CHECK(count == NUM_KEYS / 2);
+
+        for (uint64_t key = 1; key < NUM_KEYS; key += 2) {
+            uint64_t value;
+            REQUIRE(trees[i]->search(key, &value) == Brufs::Status::OK);
+            CHECK(value * 7919 % NUM_KEYS == key);
+        }
+
+        REQUIRE(trees[i]->destroy() == Brufs::Status::OK);
+    }
+
+    // Every block taken by the trees must have been returned exactly once
+    REQUIRE(fs.count_free_blocks(standby, available_after, extents, in_fbt) == Brufs::Status::OK);
+    available_after += standby + in_fbt;
+
+    CHECK(available_after == available_before);
+
+    // No thread is left to write the header later, so it must be up to date on the disk
+    const auto &header = fs.get_header();
+    std::vector<char> on_disk(header.header_size);
+    REQUIRE(io.read(on_disk.data(), on_disk.size(), 0) == static_cast<Brufs::SSize>(on_disk.size()));
+    CHECK(memcmp(on_disk.data(), &header, on_disk.size()) == 0);
+}
@@ -0,0 +1,59 @@
+#include "btree-common.hpp"
+
+TEST_CASE("Appending to a Bm+tree packs its nodes", "[btree]") {
+    while (!free_pages.empty()) free_pages.pop();
+    allocated_pages.clear();
+
+    MemAbstIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    for (unsigned int i = 1; i < (DISK_SIZE / PAGE_SIZE); ++i) {
+        free_pages.push(i * PAGE_SIZE);
+    }
+
+    Brufs::BmTree::BmTree<long, long> tree(
+        &fs, PAGE_SIZE, allocate_test_page, deallocate_test_page
+    );
+    REQUIRE(tree.init() == Brufs::Status::OK);
+
+    static constexpr long NUM_VALUES = 100000;
+
+    // 16 bytes per value in a leaf
+    static constexpr Brufs::Size LEAF_CAP = (PAGE_SIZE - 16) / 16;
+
+    SECTION("ascending keys fill the leaves") {
+        for (long i = 0; i < NUM_VALUES; ++i) REQUIRE(tree.insert(i, i) == Brufs::Status::OK);
+
+        Brufs::Size used;
+        REQUIRE(tree.count_used_space(used) == Brufs::Status::OK);
+
+        // A 50/50 split would leave every leaf half full
+        const Brufs::Size half_full = NUM_VALUES / (LEAF_CAP / 2) * PAGE_SIZE;
+        CHECK(used < half_full * 6 / 10);
+
+        for (long i = 0; i < NUM_VALUES; i += 37) {
+            long value;
+            REQUIRE(tree.search(i, value, true) == Brufs::Status::OK);
+            CHECK(value == i);
+        }
+
+        SECTION("and the tree still accepts keys in the middle") {
+            for (long i = 0; i < NUM_VALUES; i += 10) {
+                REQUIRE(tree.insert(i, -i) == Brufs::Status::OK);
+            }
+
+            Brufs::Size count;
+            REQUIRE(tree.count_values(count) == Brufs::Status::OK);
+            CHECK(count == NUM_VALUES + NUM_VALUES / 10);
+        }
+    }
+
+    SECTION("descending keys are split evenly") {
+        for (long i = NUM_VALUES; i > 0; --i) REQUIRE(tree.insert(i, i) == Brufs::Status::OK);
+
+        Brufs::Size count;
+        REQUIRE(tree.count_values(count) == Brufs::Status::OK);
+        CHECK(count == NUM_VALUES);
+    }
+}
@@ -0,0 +1,177 @@
+#include "btree-common.hpp"
+
+using LongRecord = Brufs::BmTree::Record<long, long>;
+
+class CountingMemAbstIO : public MemAbstIO {
+public:
+    unsigned long writes = 0;
+
+    using MemAbstIO::MemAbstIO;
+
+    Brufs::SSize write(const void *buf, Brufs::Size count, Brufs::Address offset) override {
+        ++this->writes;
+        return MemAbstIO::write(buf, count, offset);
+    }
+};
+
+static void check_contents(Brufs::BmTree::BmTree<long, long> &tree, const std::multiset<long> &expected) {
+    Brufs::Size count;
+    REQUIRE(tree.count_values(count) == Brufs::Status::OK);
+    REQUIRE(count == expected.size());
+
+    Brufs::BmTree::Cursor<long, long> cursor(tree);
+
+    auto it = expected.begin();
+    for (auto status = cursor.seek_first(); status == Brufs::Status::OK; status = cursor.next()) {
+        REQUIRE(it != expected.end());
+        REQUIRE(cursor.get_key() == *it);
+        REQUIRE(*cursor.get_value() == *it);
+        ++it;
+    }
+
+    CHECK(it == expected.end());
+}
+
+static void test_batches(bool counted) {
+    while (!free_pages.empty()) free_pages.pop();
+    allocated_pages.clear();
+
+    CountingMemAbstIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    for (unsigned int i = 1; i < (DISK_SIZE / PAGE_SIZE); ++i) {
+        free_pages.push(i * PAGE_SIZE);
+    }
+
+    Brufs::BmTree::BmTree<long, long> tree(
+        &fs, PAGE_SIZE, allocate_test_page, deallocate_test_page
+    );
+    REQUIRE(tree.init(0, counted) == Brufs::Status::OK);
+
+    std::multiset<long> expected;
+    std::mt19937 rng(42);
+
+    std::vector<long> values;
+    std::vector<LongRecord> records;
+
+    const auto make_batch = [&](unsigned int num, long range) {
+        values.clear();
+        records.clear();
+
+        for (unsigned int i = 0; i < num; ++i) values.push_back(static_cast<long>(rng() % range));
+        std::sort(values.begin(), values.end());
+
+        for (const auto &value : values) records.push_back({value, &value});
+    };
+
+    SECTION("sorted records fill an empty tree with few writes") {
+        make_batch(20000, 1000000);
+
+        const auto writes_before = io.writes;
+        REQUIRE(tree.insert_batch(records.begin(), records.end()) == Brufs::Status::OK);
+        expected.insert(values.begin(), values.end());
+
+        // Every leaf and inner node is written a handful of times, not once per record
+        CHECK(io.writes - writes_before < 20000 / 10);
+
+        check_contents(tree, expected);
+    }
+
+    SECTION("batches interleave with existing values") {
+        for (int round = 0; round < 20; ++round) {
+            make_batch(2000, 50000);
+            REQUIRE(tree.insert_batch(records.begin(), records.end()) == Brufs::Status::OK);
+            expected.insert(values.begin(), values.end());
+        }
+
+        check_contents(tree, expected);
+
+        SECTION("and can be removed in batches") {
+            for (int round = 0; round < 20; ++round) {
+                make_batch(1500, 50000);
+
+                Brufs::Size num_expected = 0;
+                for (const auto &value : values) {
+                    auto pos = expected.find(value);
+                    if (pos == expected.end()) continue;
+
+                    expected.erase(pos);
+                    ++num_expected;
+                }
+
+                Brufs::Size removed;
+                REQUIRE(tree.remove_batch(values.begin(), values.end(), removed) == Brufs::Status::OK);
+                CHECK(removed == num_expected);
+            }
+
+            check_contents(tree, expected);
+
+            std::vector<long> rest(expected.begin(), expected.end());
+            Brufs::Size removed;
+            REQUIRE(tree.remove_batch(rest.begin(), rest.end(), removed) == Brufs::Status::OK);
+            CHECK(removed == rest.size());
+
+            expected.clear();
+            check_contents(tree, expected);
+        }
+    }
+
+    SECTION("keys are removed from half-full leaves in a batch") {
+        values.clear();
+        records.clear();
+        for (long i = 0; i < 20000; ++i) values.push_back(i);
+        for (const auto &value : values) records.push_back({value, &value});
+
+        REQUIRE(tree.bulk_load(records.begin(), records.end(), 75) == Brufs::Status::OK);
+        expected.insert(values.begin(), values.end());
+
+        // Every leaf loses an eighth of its keys and stays above the minimum
+        std::vector<long> keys;
+        for (long i = 0; i < 20000; i += 8) {
+            keys.push_back(i);
+            expected.erase(i);
+        }
+
+        fs.get_cache().reset_stats();
+        Brufs::Size removed;
+        REQUIRE(tree.remove_batch(keys.begin(), keys.end(), removed) == Brufs::Status::OK);
+        CHECK(removed == keys.size());
+
+        // Every leaf is visited once, instead of a walk down the tree for every key
+        auto &cache = fs.get_cache();
+        CHECK(cache.get_hits() + cache.get_misses() < keys.size() / 4);
+
+        check_contents(tree, expected);
+    }
+
+    SECTION("colliding records are refused") {
+        values.clear();
+        records.clear();
+        for (long i = 0; i < 10; ++i) values.push_back(2 * i);
+        for (const auto &value : values) records.push_back({value, &value});
+
+        REQUIRE(tree.insert(6, 6L) == Brufs::Status::OK);
+        CHECK(tree.insert_batch(records.begin(), records.end(), true) == Brufs::Status::E_EXISTS);
+    }
+
+    SECTION("unsorted batches are refused") {
+        make_batch(10, 1000);
+        std::reverse(records.begin(), records.end());
+        if (records.front().key != records.back().key) {
+            CHECK(tree.insert_batch(records.begin(), records.end()) == Brufs::Status::E_INVALID_ARGUMENT);
+        }
+
+        std::vector<long> keys {3, 2, 1};
+        Brufs::Size removed;
+        CHECK(tree.remove_batch(keys.begin(), keys.end(), removed) == Brufs::Status::E_INVALID_ARGUMENT);
+    }
+}
+
+TEST_CASE("Bm+trees accept batches", "[btree]") {
+    test_batches(false);
+}
+
+TEST_CASE("Counted Bm+trees accept batches", "[btree]") {
+    test_batches(true);
+}
@@ -0,0 +1,91 @@
+#include "btree-common.hpp"
+
+TEST_CASE("Node buffer pools recycle buffers", "[btree]") {
+    Brufs::BmTree::NodeBufferPool pool;
+
+    SECTION("a returned buffer is handed out again") {
+        char *buf = pool.take(PAGE_SIZE);
+        REQUIRE(buf);
+
+        pool.give(buf, PAGE_SIZE);
+        CHECK(pool.take(PAGE_SIZE) == buf);
+
+        pool.give(buf, PAGE_SIZE);
+    }
+
+    SECTION("buffers of another size are not reused") {
+        char *buf = pool.take(PAGE_SIZE);
+        pool.give(buf, PAGE_SIZE);
+
+        char *other = pool.take(2 * PAGE_SIZE);
+        CHECK(other != buf);
+
+        pool.give(other, 2 * PAGE_SIZE);
+        CHECK(pool.take(2 * PAGE_SIZE) == other);
+
+        pool.give(other, 2 * PAGE_SIZE);
+    }
+
+    SECTION("the pool is bounded") {
+        std::vector<char *> bufs;
+        for (unsigned int i = 0; i < 2 * Brufs::BmTree::NodeBufferPool::CAPACITY; ++i) {
+            bufs.push_back(pool.take(PAGE_SIZE));
+        }
+
+        // Every buffer beyond the capacity is freed right away
+        for (auto buf : bufs) pool.give(buf, PAGE_SIZE);
+    }
+}
+
+TEST_CASE("Bm+tree nodes and trees can be moved and copied", "[btree]") {
+    while (!free_pages.empty()) free_pages.pop();
+    allocated_pages.clear();
+
+    MemAbstIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    for (unsigned int i = 1; i < (DISK_SIZE / PAGE_SIZE); ++i) {
+        free_pages.push(i * PAGE_SIZE);
+    }
+
+    Brufs::BmTree::BmTree<long, long> tree(
+        &fs, PAGE_SIZE, allocate_test_page, deallocate_test_page
+    );
+    REQUIRE(tree.init() == Brufs::Status::OK);
+
+    for (long i = 0; i < 5000; ++i) REQUIRE(tree.insert(i, i * 3) == Brufs::Status::OK);
+
+    SECTION("moving a node takes over its buffer") {
+        Brufs::BmTree::Node<long, long> node(&fs, PAGE_SIZE, PAGE_SIZE, &tree);
+        char *buf = node.buf;
+
+        Brufs::BmTree::Node<long, long> moved(std::move(node));
+        CHECK(moved.buf == buf);
+        CHECK(node.buf == nullptr);
+
+        Brufs::BmTree::Node<long, long> assigned(&fs, 2 * PAGE_SIZE, PAGE_SIZE, &tree);
+        assigned = std::move(moved);
+        CHECK(assigned.buf == buf);
+        CHECK(assigned.addr == PAGE_SIZE);
+        CHECK(moved.buf == nullptr);
+    }
+
+    SECTION("a copied tree outlives the original") {
+        Brufs::BmTree::BmTree<long, long> copy(tree);
+
+        {
+            Brufs::BmTree::BmTree<long, long> other(tree);
+            copy = other;
+        }
+
+        for (long i = 0; i < 5000; i += 7) {
+            long value;
+            REQUIRE(copy.search(i, value) == Brufs::Status::OK);
+            CHECK(value == i * 3);
+        }
+    }
+
+    REQUIRE(tree.destroy() == Brufs::Status::OK);
+    CHECK(allocated_pages.empty());
+}
@@ -0,0 +1,129 @@
+#include "btree-common.hpp"
+
+using LongRecord = Brufs::BmTree::Record<long, long>;
+
+static std::vector<LongRecord> make_records(const std::vector<long> &values) {
+    std::vector<LongRecord> records;
+    for (const auto &value : values) records.push_back({value, &value});
+
+    return records;
+}
+
+TEST_CASE("Bm+trees can be bulk-loaded", "[btree]") {
+    while (!free_pages.empty()) free_pages.pop();
+    allocated_pages.clear();
+
+    MemAbstIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    for (unsigned int i = 1; i < (DISK_SIZE / PAGE_SIZE); ++i) {
+        free_pages.push(i * PAGE_SIZE);
+    }
+
+    Brufs::BmTree::BmTree<long, long> tree(
+        &fs, PAGE_SIZE, allocate_test_page, deallocate_test_page
+    );
+    REQUIRE(tree.init() == Brufs::Status::OK);
+
+    SECTION("loading nothing leaves the tree empty") {
+        std::vector<LongRecord> records;
+        REQUIRE(tree.bulk_load(records.begin(), records.end()) == Brufs::Status::OK);
+
+        Brufs::Size count;
+        REQUIRE(tree.count_values(count) == Brufs::Status::OK);
+        CHECK(count == 0);
+    }
+
+    for (const long num : {1L, 7L, 255L, 256L, 1000L, 100000L}) {
+        for (const unsigned int fill : {50u, 75u, 100u}) {
+            SECTION("can load and query " + std::to_string(num) + " records at "
+                    + std::to_string(fill) + "%") {
+                std::vector<long> values;
+                for (long i = 0; i < num; ++i) values.push_back(2 * i);
+
+                const auto records = make_records(values);
+                REQUIRE(tree.bulk_load(records.begin(), records.end(), fill) == Brufs::Status::OK);
+
+                Brufs::Size count;
+                REQUIRE(tree.count_values(count) == Brufs::Status::OK);
+                CHECK(count == static_cast<Brufs::Size>(num));
+
+                for (long i = 0; i < num; ++i) {
+                    long value;
+                    REQUIRE(tree.search(2 * i, value, true) == Brufs::Status::OK);
+                    CHECK(value == 2 * i);
+                }
+
+                long value;
+                CHECK(tree.search(1, value, true) == Brufs::Status::E_NOT_FOUND);
+
+                long first, last;
+                REQUIRE(tree.get_first(first) == Brufs::Status::OK);
+                REQUIRE(tree.get_last(last) == Brufs::Status::OK);
+                CHECK(first == 0);
+                CHECK(last == 2 * (num - 1));
+            }
+        }
+    }
+
+    SECTION("a bulk-loaded tree can be modified afterwards") {
+        std::vector<long> values;
+        for (long i = 0; i < 20000; ++i) values.push_back(2 * i);
+
+        const auto records = make_records(values);
+        REQUIRE(tree.bulk_load(records.begin(), records.end()) == Brufs::Status::OK);
+
+        for (long i = 0; i < 20000; ++i) {
+            REQUIRE(tree.insert(2 * i + 1, 2 * i + 1, true) == Brufs::Status::OK);
+        }
+
+        for (long i = 0; i < 40000; i += 3) {
+            long value;
+            REQUIRE(tree.remove(i, value, true) == Brufs::Status::OK);
+            CHECK(value == i);
+        }
+
+        for (long i = 0; i < 40000; ++i) {
+            CAPTURE(i);
+            long value;
+            const auto status = tree.search(i, value, true);
+            CHECK(status == (i % 3 == 0 ? Brufs::Status::E_NOT_FOUND : Brufs::Status::OK));
+        }
+
+        REQUIRE(tree.destroy() == Brufs::Status::OK);
+        CHECK(allocated_pages.empty());
+    }
+
+    SECTION("a lower fill factor leaves room in the nodes") {
+        std::vector<long> values;
+        for (long i = 0; i < 10000; ++i) values.push_back(i);
+
+        const auto records = make_records(values);
+        REQUIRE(tree.bulk_load(records.begin(), records.end(), 50) == Brufs::Status::OK);
+
+        Brufs::Size size;
+        REQUIRE(tree.count_used_space(size) == Brufs::Status::OK);
+
+        // 10000 records of 16 bytes at half a 4k page per leaf
+        CHECK(size / PAGE_SIZE >= 10000 / (PAGE_SIZE / 16 / 2));
+    }
+
+    SECTION("unsorted records are refused") {
+        const std::vector<long> values {1, 2, 3, 2};
+        const auto records = make_records(values);
+        CHECK(tree.bulk_load(records.begin(), records.end()) == Brufs::Status::E_INVALID_ARGUMENT);
+    }
+
+    SECTION("a non-empty tree can't be bulk-loaded") {
+        REQUIRE(tree.insert(1, 1L) == Brufs::Status::OK);
+
+        const auto records = make_records({2, 3});
+        CHECK(tree.bulk_load(records.begin(), records.end()) == Brufs::Status::E_EXISTS);
+    }
+
+    SECTION("the fill factor must be sane") {
+        const auto records = make_records({2, 3});
+        CHECK(tree.bulk_load(records.begin(), records.end(), 20) == Brufs::Status::E_INVALID_ARGUMENT);
+    }
+}
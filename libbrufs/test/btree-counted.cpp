@@ -0,0 +1,162 @@
+#include "btree-common.hpp"
+
+using LongCursor = Brufs::BmTree::Cursor<long, long>;
+
+static void check_ranks(Brufs::BmTree::BmTree<long, long> &tree, const std::multiset<long> &expected) {
+    Brufs::Size count;
+    REQUIRE(tree.count_values(count) == Brufs::Status::OK);
+    REQUIRE(count == expected.size());
+
+    LongCursor cursor(tree);
+    LongCursor ranked(tree);
+
+    Brufs::Size rank = 0;
+    auto it = expected.begin();
+    for (auto status = cursor.seek_first(); status == Brufs::Status::OK; status = cursor.next()) {
+        REQUIRE(it != expected.end());
+        REQUIRE(cursor.get_key() == *it);
+
+        if (rank % 7 == 0 || rank + 1 == expected.size()) {
+            CAPTURE(rank);
+            REQUIRE(ranked.seek_to_nth(rank) == Brufs::Status::OK);
+            REQUIRE(ranked.get_key() == cursor.get_key());
+            REQUIRE(*ranked.get_value() == *cursor.get_value());
+        }
+
+        ++rank;
+        ++it;
+    }
+
+    CHECK(it == expected.end());
+    CHECK(ranked.seek_to_nth(expected.size()) == Brufs::Status::E_NOT_FOUND);
+}
+
+TEST_CASE("Counted Bm+trees keep subtree counts", "[btree]") {
+    while (!free_pages.empty()) free_pages.pop();
+    allocated_pages.clear();
+
+    MemAbstIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    for (unsigned int i = 1; i < (DISK_SIZE / PAGE_SIZE); ++i) {
+        free_pages.push(i * PAGE_SIZE);
+    }
+
+    Brufs::BmTree::BmTree<long, long> tree(
+        &fs, PAGE_SIZE, allocate_test_page, deallocate_test_page
+    );
+    REQUIRE(tree.init(0, true) == Brufs::Status::OK);
+
+    std::multiset<long> expected;
+    std::mt19937 rng(1234);
+
+    SECTION("an empty tree has no values") {
+        check_ranks(tree, expected);
+    }
+
+    SECTION("counts follow inserts with splits at every level") {
+        for (long i = 0; i < 60000; ++i) {
+            const long key = static_cast<long>(rng() % 100000);
+            REQUIRE(tree.insert(key, key) == Brufs::Status::OK);
+            expected.insert(key);
+        }
+
+        check_ranks(tree, expected);
+
+        SECTION("and exact removals with merges") {
+            std::vector<long> keys(expected.begin(), expected.end());
+            std::shuffle(keys.begin(), keys.end(), rng);
+
+            for (std::size_t i = 0; i < keys.size(); ++i) {
+                long value;
+                REQUIRE(tree.remove(keys[i], value, true) == Brufs::Status::OK);
+                expected.erase(expected.find(keys[i]));
+
+                if (i % 15000 == 0) check_ranks(tree, expected);
+            }
+
+            check_ranks(tree, expected);
+        }
+
+        SECTION("and inexact removals") {
+            for (long i = 0; i < 30000; ++i) {
+                const long key = static_cast<long>(rng() % 100000);
+
+                long value;
+                const auto status = tree.remove(key, value);
+                if (status == Brufs::Status::E_NOT_FOUND) continue;
+
+                REQUIRE(status == Brufs::Status::OK);
+                REQUIRE(expected.count(value) > 0);
+                expected.erase(expected.find(value));
+            }
+
+            check_ranks(tree, expected);
+        }
+    }
+
+    SECTION("many duplicates are counted") {
+        for (long i = 0; i < 20000; ++i) {
+            REQUIRE(tree.insert(i % 3, i) == Brufs::Status::OK);
+            expected.insert(i % 3);
+        }
+
+        check_ranks(tree, expected);
+
+        for (long i = 0; i < 10000; ++i) {
+            long value;
+            REQUIRE(tree.remove(i % 3, value, true) == Brufs::Status::OK);
+            expected.erase(expected.find(i % 3));
+        }
+
+        check_ranks(tree, expected);
+    }
+
+    SECTION("bulk loading fills in the counts") {
+        std::vector<long> values;
+        std::vector<Brufs::BmTree::Record<long, long>> records;
+        for (long i = 0; i < 50000; ++i) values.push_back(i);
+        for (const auto &value : values) {
+            records.push_back({value, &value});
+            expected.insert(value);
+        }
+
+        REQUIRE(tree.bulk_load(records.begin(), records.end(), 75) == Brufs::Status::OK);
+        check_ranks(tree, expected);
+
+        for (long i = 0; i < 50000; i += 2) {
+            long value;
+            REQUIRE(tree.remove(i, value, true) == Brufs::Status::OK);
+            expected.erase(i);
+        }
+
+        check_ranks(tree, expected);
+    }
+}
+
+TEST_CASE("Uncounted Bm+trees can still seek by rank", "[btree]") {
+    while (!free_pages.empty()) free_pages.pop();
+    allocated_pages.clear();
+
+    MemAbstIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    for (unsigned int i = 1; i < (DISK_SIZE / PAGE_SIZE); ++i) {
+        free_pages.push(i * PAGE_SIZE);
+    }
+
+    Brufs::BmTree::BmTree<long, long> tree(
+        &fs, PAGE_SIZE, allocate_test_page, deallocate_test_page
+    );
+    REQUIRE(tree.init() == Brufs::Status::OK);
+
+    std::multiset<long> expected;
+    for (long i = 0; i < 3000; ++i) {
+        REQUIRE(tree.insert(i, i) == Brufs::Status::OK);
+        expected.insert(i);
+    }
+
+    check_ranks(tree, expected);
+}
@@ -0,0 +1,117 @@
+#include "btree-common.hpp"
+
+TEST_CASE("Bm+tree cursors scan ranges", "[btree]") {
+    while (!free_pages.empty()) free_pages.pop();
+    allocated_pages.clear();
+
+    MemAbstIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    for (unsigned int i = 1; i < (DISK_SIZE / PAGE_SIZE); ++i) {
+        free_pages.push(i * PAGE_SIZE);
+    }
+
+    Brufs::BmTree::BmTree<long, long> tree(
+        &fs, PAGE_SIZE, allocate_test_page, deallocate_test_page
+    );
+    REQUIRE(tree.init() == Brufs::Status::OK);
+
+    Brufs::BmTree::Cursor<long, long> cursor(tree);
+
+    SECTION("an empty tree has no entries") {
+        CHECK(cursor.seek_first() == Brufs::Status::E_NOT_FOUND);
+        CHECK(cursor.seek_last() == Brufs::Status::E_NOT_FOUND);
+        CHECK(cursor.seek(0) == Brufs::Status::E_NOT_FOUND);
+        CHECK_FALSE(cursor.is_valid());
+        CHECK(cursor.next() == Brufs::Status::E_NOT_FOUND);
+    }
+
+    for (const long num : {1L, 10L, 1000L, 50000L}) {
+        SECTION("can scan a tree of " + std::to_string(num) + " entries") {
+            // Insert in a scrambled order so the tree is built by splits
+            for (long i = 0; i < num; ++i) {
+                const long key = ((i * 7919) % num) * 2;
+                REQUIRE(tree.insert(key, key) == Brufs::Status::OK);
+            }
+
+            SECTION("forwards") {
+                long expected = 0;
+                Brufs::Status status;
+                for (status = cursor.seek_first(); status == Brufs::Status::OK; status = cursor.next()) {
+                    REQUIRE(cursor.get_key() == expected);
+                    REQUIRE(*cursor.get_value() == expected);
+                    expected += 2;
+                }
+
+                CHECK(status == Brufs::Status::E_NOT_FOUND);
+                CHECK(expected == 2 * num);
+                CHECK_FALSE(cursor.is_valid());
+            }
+
+            SECTION("backwards") {
+                long expected = 2 * (num - 1);
+                Brufs::Status status;
+                for (status = cursor.seek_last(); status == Brufs::Status::OK; status = cursor.prev()) {
+                    REQUIRE(cursor.get_key() == expected);
+                    expected -= 2;
+                }
+
+                CHECK(status == Brufs::Status::E_NOT_FOUND);
+                CHECK(expected == -2);
+            }
+
+            SECTION("from any key") {
+                for (long key = -1; key < 2 * num + 1; key += (num > 1000 ? 97 : 1)) {
+                    CAPTURE(key);
+                    const auto status = cursor.seek(key);
+
+                    if (key >= 2 * (num - 1) + 1) {
+                        CHECK(status == Brufs::Status::E_NOT_FOUND);
+                        continue;
+                    }
+
+                    REQUIRE(status == Brufs::Status::OK);
+                    const long expected = key < 0 ? 0 : key + (key % 2);
+                    CHECK(cursor.get_key() == expected);
+
+                    if (expected > 0) {
+                        REQUIRE(cursor.prev() == Brufs::Status::OK);
+                        CHECK(cursor.get_key() == expected - 2);
+                        REQUIRE(cursor.next() == Brufs::Status::OK);
+                        CHECK(cursor.get_key() == expected);
+                    }
+                }
+            }
+        }
+    }
+
+    SECTION("stops at the first of several equal keys") {
+        for (long i = 0; i < 2000; ++i) {
+            REQUIRE(tree.insert(i / 500, i) == Brufs::Status::OK);
+        }
+
+        for (long key = 0; key < 4; ++key) {
+            REQUIRE(cursor.seek(key) == Brufs::Status::OK);
+
+            long count = 0;
+            for (; cursor.is_valid() && cursor.get_key() == key; (void) cursor.next()) ++count;
+
+            CHECK(count == 500);
+        }
+    }
+
+    SECTION("skips leaves emptied by removals") {
+        for (long i = 0; i < 5000; ++i) REQUIRE(tree.insert(i, i) == Brufs::Status::OK);
+        for (long i = 1000; i < 4000; ++i) {
+            long value;
+            REQUIRE(tree.remove(i, value, true) == Brufs::Status::OK);
+        }
+
+        REQUIRE(cursor.seek(1000) == Brufs::Status::OK);
+        CHECK(cursor.get_key() == 4000);
+
+        REQUIRE(cursor.prev() == Brufs::Status::OK);
+        CHECK(cursor.get_key() == 999);
+    }
+}
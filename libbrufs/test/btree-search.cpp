@@ -0,0 +1,90 @@
+#include "btree-common.hpp"
+
+template <typename K>
+static void check_bounds(std::vector<K> &keys, std::default_random_engine &reng, K (*gen)(long)) {
+    std::sort(keys.begin(), keys.end());
+
+    for (int i = 0; i < 200; ++i) {
+        const K key = gen(static_cast<long>(reng() % 4096) - 2048);
+
+        const auto expected_lower = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        const auto expected_upper = std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+
+        CHECK(Brufs::BmTree::lower_bound(keys.data(), keys.size(), key) == expected_lower);
+        CHECK(Brufs::BmTree::upper_bound(keys.data(), keys.size(), key) == expected_upper);
+    }
+}
+
+template <typename K>
+static void check_all_sizes(K (*gen)(long)) {
+    std::default_random_engine reng(6);
+
+    for (unsigned int num = 0; num < 300; num += 1 + num / 8) {
+        CAPTURE(num);
+
+        std::vector<K> keys;
+        for (unsigned int i = 0; i < num; ++i) {
+            keys.push_back(gen(static_cast<long>(reng() % 4096) - 2048));
+        }
+
+        check_bounds(keys, reng, gen);
+    }
+}
+
+TEST_CASE("Node key searches match a plain binary search", "[btree]") {
+    SECTION("signed keys") {
+        check_all_sizes<long>([](long v) { return v; });
+    }
+
+    SECTION("unsigned keys around the sign bit") {
+        check_all_sizes<Brufs::Size>([](long v) {
+            return static_cast<Brufs::Size>(v) + (static_cast<Brufs::Size>(1) << 63);
+        });
+    }
+
+    SECTION("hashes with many duplicates") {
+        check_all_sizes<Brufs::Hash>([](long v) { return static_cast<Brufs::Hash>(v / 256); });
+    }
+
+    SECTION("128-bit inode IDs") {
+        check_all_sizes<Brufs::InodeId>([](long v) {
+            return (static_cast<Brufs::InodeId>(v + 4096) << 64) | static_cast<Brufs::Hash>(v);
+        });
+    }
+
+    SECTION("narrow keys") {
+        check_all_sizes<int>([](long v) { return static_cast<int>(v); });
+    }
+}
+
+TEST_CASE("Bm+trees with hash keys find every key", "[btree]") {
+    while (!free_pages.empty()) free_pages.pop();
+
+    MemAbstIO io(DISK_SIZE);
+    Brufs::Disk disk(&io);
+    Brufs::Brufs fs(&disk);
+
+    for (unsigned int i = 1; i < (DISK_SIZE / PAGE_SIZE); ++i) {
+        free_pages.push(i * PAGE_SIZE);
+    }
+
+    Brufs::BmTree::BmTree<Brufs::Hash, Brufs::Hash> tree(
+        &fs, PAGE_SIZE, allocate_test_page, deallocate_test_page
+    );
+    REQUIRE(tree.init() == Brufs::Status::OK);
+
+    std::default_random_engine reng(6);
+
+    std::vector<Brufs::Hash> keys;
+    for (int i = 0; i < 20000; ++i) keys.push_back(reng() * 0x9E3779B97F4A7C15ULL);
+
+    for (const auto key : keys) {
+        REQUIRE(tree.insert(key, key, true) == Brufs::Status::OK);
+    }
+
+    for (const auto key : keys) {
+        Brufs::Hash value;
+        REQUIRE(tree.search(key, value, true) == Brufs::Status::OK);
+        CHECK(value == key);
+    }
+}